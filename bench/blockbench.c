@@ -0,0 +1,153 @@
+/* Benchmark of the source blocklists: blocklist_lookup() one source at a
+ * time against blocklist_lookup_batch(), which fetches the slots of a batch
+ * ahead, for blocklists from a thousand entries to the largest allowed.
+ * The entries are /32, /28 and /24 prefixes, so each lookup probes three
+ * times. One source in 10 is drawn from an entry, and random sources fall
+ * in the /24s of the larger lists too.
+ *
+ *   blockbench [sources] [rounds]
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocklist.h"
+#include "synth.h"
+
+#define BENCH_BATCH 64 // sources per call, as the darkfilter looks them up
+#define BENCH_HIT 10 // one source in this many is blocked
+
+static const uint32_t sizes[] = {
+    1 << 10, 1 << 16, 1 << 20, BLOCKLIST_MAX_SIZE
+};
+static const int lens[3] = { 32, 28, 24 };
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t prefix(uint32_t addr, int len) {
+    return addr & (~0U << (32 - len));
+}
+
+/* Write size entries to path, and draw cnt sources of which a share falls
+ * in an entry. */
+static int write_blocklist(const char *path, uint32_t size, uint32_t *srcs,
+        uint32_t cnt) {
+    uint64_t state = 7;
+    uint32_t hits = cnt / BENCH_HIT, addr, i;
+    FILE *f;
+
+    if ((f = fopen(path, "w")) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < size; ++i) {
+        addr = prefix(synth_rand(&state), lens[i % 3]);
+        fprintf(f, "%u.%u.%u.%u/%d\n", addr >> 24, (addr >> 16) & 0xff,
+                (addr >> 8) & 0xff, addr & 0xff, lens[i % 3]);
+        if (i < hits) {
+            srcs[i] = addr;
+        }
+    }
+    for (i = 0; i < cnt; ++i) {
+        if (i >= hits) {
+            srcs[i] = synth_rand(&state);
+        } else {
+            /* Anywhere in the prefix of an entry. */
+            addr = prefix(srcs[i % size], lens[i % size % 3]);
+            srcs[i] = addr | (synth_rand(&state) &
+                    ~(~0U << (32 - lens[i % size % 3])));
+        }
+    }
+    /* Mix the blocked sources in with the others. */
+    for (i = cnt - 1; i > 0; --i) {
+        addr = synth_rand(&state) % (i + 1);
+        hits = srcs[i];
+        srcs[i] = srcs[addr];
+        srcs[addr] = hits;
+    }
+    return fclose(f);
+}
+
+int main(int argc, char **argv) {
+    char path[] = "/tmp/blockbench.XXXXXX";
+    uint32_t cnt = argc > 1 ? strtoul(argv[1], NULL, 10) : 1 << 20;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    uint64_t best[2], sum[2] = {0, 0}, start, ns;
+    uint32_t *srcs;
+    color_t *clear;
+    blocklist_t bl;
+    uint32_t i;
+    int s, r, fd;
+
+    srcs = (uint32_t *)malloc(sizeof(uint32_t) * cnt);
+    clear = (color_t *)malloc(sizeof(color_t) * cnt);
+    if (srcs == NULL || clear == NULL) {
+        fprintf(stderr, "blockbench: out of memory\n");
+        return 1;
+    }
+    if ((fd = mkstemp(path)) < 0) {
+        perror("blockbench: blocklist file");
+        return 1;
+    }
+    close(fd);
+
+    printf("%u sources, best of %d\n", cnt, rounds);
+    printf("%9s %12s %12s %9s\n", "entries", "single", "batch", "blocked");
+    for (s = 0; s < (int)(sizeof(sizes) / sizeof(uint32_t)); ++s) {
+        if (write_blocklist(path, sizes[s], srcs, cnt) != 0 ||
+                blocklist_init(&bl, sizes[s]) != 0 ||
+                blocklist_parse_file(&bl, path, 2) != 0) {
+            fprintf(stderr, "blockbench: failed to load %u entries\n",
+                    sizes[s]);
+            unlink(path);
+            return 1;
+        }
+
+        best[0] = best[1] = UINT64_MAX;
+        for (r = 0; r < rounds; ++r) {
+            start = now_ns();
+            for (i = 0, sum[0] = 0; i < cnt; ++i) {
+                sum[0] += blocklist_lookup(&bl, srcs[i]) != 0;
+            }
+            if ((ns = now_ns() - start) < best[0]) {
+                best[0] = ns;
+            }
+
+            start = now_ns();
+            for (i = 0; i < cnt; i += BENCH_BATCH) {
+                blocklist_lookup_batch(&bl, srcs + i, clear + i,
+                        cnt - i < BENCH_BATCH ? cnt - i : BENCH_BATCH);
+            }
+            ns = now_ns() - start;
+            for (i = 0, sum[1] = 0; i < cnt; ++i) {
+                sum[1] += clear[i] != 0;
+            }
+            if (ns < best[1]) {
+                best[1] = ns;
+            }
+        }
+        blocklist_free(&bl);
+        if (sum[0] != sum[1]) {
+            fprintf(stderr, "blockbench: lookups disagree with %u entries\n",
+                    sizes[s]);
+            unlink(path);
+            return 1;
+        }
+        printf("%9u %9.2f ns %9.2f ns %8.2f%%\n", sizes[s],
+                (double)best[0] / cnt, (double)best[1] / cnt,
+                sum[0] * 100.0 / cnt);
+    }
+
+    unlink(path);
+    free(clear);
+    free(srcs);
+    return 0;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,114 @@
+/* Benchmark of the record decoder: the addresses of each record read by the
+ * native decoder of erf.h against libtrace, with trace_prepare_packet() and
+ * trace_get_ip() as the darkfilter used before. One buffer of records with
+ * mixed lengths for each encapsulation, and one that mixes them all.
+ *
+ *   decodebench [buffer MiB] [rounds]
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <libtrace.h>
+
+#include "synth.h"
+
+static const char *kindnames[SYNTH_KINDS + 1] = {
+    "ethernet", "vlan", "qinq", "mpls", "ext header", "erf ipv4", "mixed"
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Sum of the destinations, so the decoders can be checked against each
+ * other and the loops are not optimised away. */
+static uint64_t decode_native(char **recs, uint32_t cnt) {
+    uint32_t src, dst, i;
+    uint64_t addr6, sum = 0;
+
+    for (i = 0; i < cnt; ++i) {
+        if (erf_ip_addrs((const uint8_t *)recs[i], &src, &dst, &addr6) == 4) {
+            sum += dst;
+        }
+    }
+    return sum;
+}
+
+static uint64_t decode_libtrace(libtrace_t *trace, libtrace_packet_t *packet,
+        char **recs, uint32_t cnt) {
+    libtrace_ip_t *ip;
+    uint64_t sum = 0;
+    uint32_t i;
+
+    for (i = 0; i < cnt; ++i) {
+        if (trace_prepare_packet(trace, packet, recs[i], TRACE_RT_DATA_ERF,
+                    TRACE_PREP_DO_NOT_OWN_BUFFER) == -1) {
+            return 0;
+        }
+        if ((ip = trace_get_ip(packet)) != NULL) {
+            sum += ntohl(ip->ip_dst.s_addr);
+        }
+    }
+    return sum;
+}
+
+int main(int argc, char **argv) {
+    size_t mib = argc > 1 ? strtoul(argv[1], NULL, 10) : 16;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    libtrace_t *trace = trace_create_dead("erf:dummy.erf");
+    libtrace_packet_t *packet = trace_create_packet();
+    uint64_t best[2], sum[2] = {0, 0}, start, ns;
+    uint32_t cnt, i;
+    char **recs;
+    char *buf, *rec;
+    int kind, r;
+
+    buf = (char *)malloc(mib << 20);
+    recs = (char **)malloc(sizeof(char *) * ((mib << 20) / 80 + 1));
+    if (buf == NULL || recs == NULL || trace == NULL || packet == NULL) {
+        fprintf(stderr, "decodebench: out of memory\n");
+        return 1;
+    }
+
+    printf("%-10s %12s %12s\n", "", "native", "libtrace");
+    for (kind = 0; kind <= SYNTH_KINDS; ++kind) {
+        synth_buffer((uint8_t *)buf, mib << 20, kind, 12, 60, 1, &cnt);
+        for (i = 0, rec = buf; i < cnt; ++i) {
+            recs[i] = rec;
+            rec += ((uint8_t)rec[10] << 8) | (uint8_t)rec[11];
+        }
+
+        best[0] = best[1] = UINT64_MAX;
+        for (r = 0; r < rounds; ++r) {
+            start = now_ns();
+            sum[0] = decode_native(recs, cnt);
+            if ((ns = now_ns() - start) < best[0]) {
+                best[0] = ns;
+            }
+            start = now_ns();
+            sum[1] = decode_libtrace(trace, packet, recs, cnt);
+            if ((ns = now_ns() - start) < best[1]) {
+                best[1] = ns;
+            }
+        }
+        if (sum[0] != sum[1]) {
+            fprintf(stderr, "decodebench: decoders disagree on %s records\n",
+                    kindnames[kind]);
+            return 1;
+        }
+        printf("%-10s %9.2f ns %9.2f ns\n", kindnames[kind],
+                (double)best[0] / cnt, (double)best[1] / cnt);
+    }
+
+    trace_destroy_packet(packet);
+    trace_destroy_dead(trace);
+    free(recs);
+    free(buf);
+    return 0;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,157 @@
+/* Benchmark of the flow rules: rules_classify_batch() on a synthetic buffer
+ * of records with mixed lengths, for rule sets of growing size spread over
+ * 1, 8 and 64 combinations of prefix lengths. Every record starts out sent
+ * to the default sink, so each one is looked up in every combination. The
+ * rules have random source prefixes and destination prefixes in the
+ * darknet, with or without a protocol, port or flags. The prefixes are long
+ * enough that rules rarely share addresses. One rule in 16 covers the
+ * source of a record in the buffer, so a few lookups hit. The buffer is
+ * small by default, so the records stay in the cache as they do when the
+ * darkfilter classifies them.
+ *
+ *   rulesbench [buffer MiB] [rounds]
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rules.h"
+#include "synth.h"
+
+#define BENCH_DARKNET 12
+#define BENCH_CHUNK 32 // records per call, as the walker classifies them
+#define BENCH_HIT 16 // one rule in this many covers a record
+
+static const int tuplecnts[] = { 1, 8, 64 };
+static const int rulecnts[] = { 16, 256, 4096, 65536 };
+static const int prefixlens[8] = { 32, 24, 28, 20, 30, 26, 22, 18 };
+static const char *extras[4] = {
+    "", " proto tcp dport 22", " proto udp", " flags S/SA"
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t prefix(uint32_t addr, int len) {
+    return len == 0 ? 0 : addr & (~0U << (32 - len));
+}
+
+/* Write rulecnt rules, spread evenly over tuplecnt combinations of source
+ * and destination prefix lengths, to path. */
+static int write_rules(const char *path, int rulecnt, int tuplecnt,
+        char **recs, uint32_t cnt) {
+    uint64_t state = 7, addr6;
+    uint32_t src, dst;
+    FILE *f;
+    int i, t;
+
+    if ((f = fopen(path, "w")) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < rulecnt; ++i) {
+        t = i % tuplecnt;
+        src = synth_rand(&state);
+        dst = ((uint32_t)BENCH_DARKNET << 24) |
+                (synth_rand(&state) & 0xffffff);
+        if (i % BENCH_HIT == 0) {
+            erf_ip_addrs((const uint8_t *)recs[synth_rand(&state) % cnt],
+                    &src, &dst, &addr6);
+        }
+        src = prefix(src, prefixlens[t % 8]);
+        dst = prefix(dst, prefixlens[t / 8]);
+        fprintf(f, "src %u.%u.%u.%u/%d dst %u.%u.%u.%u/%d%s\n",
+                src >> 24, (src >> 16) & 0xff, (src >> 8) & 0xff, src & 0xff,
+                prefixlens[t % 8], dst >> 24, (dst >> 16) & 0xff,
+                (dst >> 8) & 0xff, dst & 0xff, prefixlens[t / 8],
+                extras[synth_rand(&state) % 4]);
+    }
+    return fclose(f);
+}
+
+int main(int argc, char **argv) {
+    char path[] = "/tmp/rulesbench.XXXXXX";
+    size_t mib = argc > 1 ? strtoul(argv[1], NULL, 10) : 1;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    uint64_t best, start, ns, matched;
+    uint32_t cnt, i;
+    color_t *colors;
+    rules_t rules;
+    char **recs;
+    char *buf, *rec;
+    int t, n, r, done, fd;
+
+    buf = (char *)malloc(mib << 20);
+    recs = (char **)malloc(sizeof(char *) * ((mib << 20) / 80 + 1));
+    colors = (color_t *)malloc(sizeof(color_t) * ((mib << 20) / 80 + 1));
+    if (buf == NULL || recs == NULL || colors == NULL ||
+            rules_init(&rules) != 0) {
+        fprintf(stderr, "rulesbench: out of memory\n");
+        return 1;
+    }
+    if ((fd = mkstemp(path)) < 0) {
+        perror("rulesbench: rule file");
+        return 1;
+    }
+    close(fd);
+
+    synth_buffer((uint8_t *)buf, mib << 20, SYNTH_KINDS, BENCH_DARKNET, 60, 1,
+            &cnt);
+    for (i = 0, rec = buf; i < cnt; ++i) {
+        recs[i] = rec;
+        rec += ((uint8_t)rec[10] << 8) | (uint8_t)rec[11];
+    }
+
+    printf("%u records, best of %d\n", cnt, rounds);
+    printf("%7s %7s %12s %14s %9s\n", "tuples", "rules", "ns/record",
+            "Mrecords/s", "matched");
+    for (t = 0; t < (int)(sizeof(tuplecnts) / sizeof(int)); ++t) {
+        for (n = 0; n < (int)(sizeof(rulecnts) / sizeof(int)); ++n) {
+            rules_reset(&rules);
+            if (write_rules(path, rulecnts[n], tuplecnts[t], recs,
+                        cnt) != 0 ||
+                    rules_parse_file(&rules, path, 2, 0) != 0) {
+                fprintf(stderr, "rulesbench: failed to load %d rules\n",
+                        rulecnts[n]);
+                unlink(path);
+                return 1;
+            }
+
+            best = UINT64_MAX;
+            for (r = 0; r < rounds; ++r) {
+                for (i = 0; i < cnt; ++i) {
+                    colors[i] = 1;
+                }
+                start = now_ns();
+                for (done = 0; done < (int)cnt; done += BENCH_CHUNK) {
+                    rules_classify_batch(&rules, recs + done, colors + done,
+                            cnt - done < BENCH_CHUNK ? cnt - done :
+                            BENCH_CHUNK);
+                }
+                if ((ns = now_ns() - start) < best) {
+                    best = ns;
+                }
+            }
+            for (i = 0, matched = 0; i < cnt; ++i) {
+                matched += colors[i] != 1;
+            }
+            printf("%7d %7d %9.2f ns %14.2f %8.2f%%\n", rules.tuplecnt,
+                    rules.rulecnt, (double)best / cnt, cnt * 1000.0 / best,
+                    matched * 100.0 / cnt);
+        }
+    }
+
+    unlink(path);
+    rules_free(&rules);
+    free(colors);
+    free(recs);
+    free(buf);
+    return 0;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,141 @@
+#ifndef SYNTH_H_
+#define SYNTH_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "erf.h"
+
+/* Synthetic ERF records for the benchmarks. Everything is drawn from a
+ * fixed seed, so runs are comparable. */
+
+enum {
+    SYNTH_ETH,
+    SYNTH_VLAN,
+    SYNTH_QINQ,
+    SYNTH_MPLS,
+    SYNTH_EXT, // Ethernet behind an ERF extension header
+    SYNTH_IPV4, // ERF IPv4 record type
+    SYNTH_KINDS
+};
+
+static inline uint32_t synth_rand(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (uint32_t)(*state >> 16);
+}
+
+/* Record lengths in the mix of a telescope: mostly scans without payload,
+ * some mid-sized packets and some full frames. */
+static inline uint16_t synth_len(uint64_t *state) {
+    uint32_t r = synth_rand(state) % 100;
+
+    if (r < 60) {
+        return 80 + synth_rand(state) % 32;
+    }
+    if (r < 85) {
+        return 128 + synth_rand(state) % 512;
+    }
+    return 1518;
+}
+
+/* Write one TCP SYN record of about len bytes, at least 80 so the headers
+ * of every kind fit, to buf. Returns its rlen. */
+static inline uint16_t synth_record(uint8_t *buf, int kind, uint32_t src,
+        uint32_t dst, uint16_t len) {
+    uint8_t *ptr = buf + ERF_HEADER_LEN;
+    uint8_t type = ERF_TYPE_ETH;
+    uint16_t rlen = ERF_ALIGN(len), l3len;
+    uint8_t *ip;
+
+    memset(buf, 0, rlen);
+    if (kind == SYNTH_EXT) {
+        type |= ERF_TYPE_EXT;
+        ptr += ERF_EXT_LEN;
+    }
+    if (kind == SYNTH_IPV4) {
+        type = ERF_TYPE_IPV4;
+    } else {
+        ptr += ERF_ETH_PAD + 12;
+        switch (kind) {
+            case SYNTH_QINQ:
+                *ptr++ = ETHERTYPE_QINQ >> 8;
+                *ptr++ = ETHERTYPE_QINQ & 0xff;
+                ptr += 2;
+                /* Fall through. */
+            case SYNTH_VLAN:
+                *ptr++ = ETHERTYPE_VLAN >> 8;
+                *ptr++ = ETHERTYPE_VLAN & 0xff;
+                ptr += 2;
+                break;
+            case SYNTH_MPLS:
+                *ptr++ = ETHERTYPE_MPLS >> 8;
+                *ptr++ = ETHERTYPE_MPLS & 0xff;
+                ptr[2] = 0x01; // bottom of the stack
+                ptr += MPLS_LABEL_LEN;
+                goto l3;
+        }
+        *ptr++ = ETHERTYPE_IPV4 >> 8;
+        *ptr++ = ETHERTYPE_IPV4 & 0xff;
+    }
+
+l3:
+    ip = ptr;
+    l3len = buf + rlen - ip;
+    ip[0] = 0x45;
+    ip[2] = l3len >> 8;
+    ip[3] = l3len & 0xff;
+    ip[8] = 64;
+    ip[9] = IPPROTO_TCP;
+    src = htonl(src);
+    dst = htonl(dst);
+    memcpy(ip + IPV4_SRC_OFFSET, &src, 4);
+    memcpy(ip + IPV4_DST_OFFSET, &dst, 4);
+    ip[IPV4_HEADER_LEN + 2] = 0;
+    ip[IPV4_HEADER_LEN + 3] = 23;
+    ip[IPV4_HEADER_LEN + 12] = 0x50;
+    ip[IPV4_HEADER_LEN + 13] = 0x02; // SYN
+
+    buf[8] = type;
+    buf[10] = rlen >> 8;
+    buf[11] = rlen & 0xff;
+    buf[14] = (rlen - ERF_HEADER_LEN) >> 8;
+    buf[15] = (rlen - ERF_HEADER_LEN) & 0xff;
+    return rlen;
+}
+
+/* Fill size bytes of buf with records of mixed lengths, of kind or of all
+ * kinds if kind is SYNTH_KINDS. A share of darkpct percent goes to the /8
+ * of darkoctet, the others to random addresses. Returns the bytes used,
+ * which end on a record boundary, and the number of records in cnt. */
+static inline size_t synth_buffer(uint8_t *buf, size_t size, int kind,
+        int darkoctet, int darkpct, uint64_t seed, uint32_t *cnt) {
+    uint64_t state = seed | 1;
+    size_t used = 0;
+    uint32_t dst;
+    uint16_t len;
+
+    *cnt = 0;
+    for (;;) {
+        len = synth_len(&state);
+        if (used + ERF_ALIGN(len) > size) {
+            break;
+        }
+        dst = synth_rand(&state);
+        if ((int)(synth_rand(&state) % 100) < darkpct) {
+            dst = ((uint32_t)darkoctet << 24) | (dst & 0xffffff);
+        }
+        used += synth_record(buf + used,
+                kind == SYNTH_KINDS ? (int)(*cnt % SYNTH_KINDS) : kind,
+                synth_rand(&state), dst, len);
+        ++*cnt;
+    }
+    return used;
+}
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,288 @@
+/* Benchmark of the record walker: the two-pass walker of telescope.c
+ * against the single-pass walker it replaced, on a synthetic buffer of ERF
+ * records with mixed lengths. Both see the same darkfilter, which drops the
+ * records outside the darknet and sends part of the darknet to a second
+ * sink. Datagrams are built but not sent.
+ *
+ *   walkbench [buffer MiB] [rounds]
+ */
+#define main telescope_main
+#include "../src/telescope.c"
+#undef main
+
+#include <time.h>
+
+#include "synth.h"
+
+#define BENCH_DARKNET 12
+
+/* The single-pass walker as it was, kept here to compare against. */
+static void old_append(iov_data_t *iov, uint16_t curiov, char *bottom,
+        uint16_t len, uint32_t *collected) {
+    if (iov->vec[curiov].iov_base == NULL) {
+        iov->vec[curiov].iov_base = bottom;
+    }
+    iov->vec[curiov].iov_len += len;
+    *collected += len;
+}
+
+static void old_end(iov_data_t *iov, uint16_t *curiov) {
+    if (iov->vec[*curiov].iov_len != 0) {
+        *curiov = *curiov + 1;
+        if (*curiov == iov->len) {
+            iov->vec = (struct iovec *) realloc(iov->vec,
+                    sizeof(struct iovec) * (iov->len + 10));
+            iov->len += 10;
+        }
+        iov->vec[*curiov].iov_base = NULL;
+        iov->vec[*curiov].iov_len = 0;
+    }
+}
+
+static char *old_walk_stream_buffer(char *bottom, char *top,
+        uint16_t *total_reccount, uint16_t *curiov,
+        dagstreamthread_t *dst, darkfilter_t *filter,
+        uint16_t* reccounts) {
+    uint32_t collected[DAG_COLOR_SLOTS];
+    uint32_t tx[DAG_COLOR_SLOTS];
+    uint32_t txw[DAG_COLOR_SLOTS];
+    uint32_t walked = 0;
+    uint32_t wwalked = 0;
+    int i;
+    color_t color = 1;
+    int non_default_open = 0;
+
+    memset(collected, 0, sizeof(collected));
+    memset(tx, 0, sizeof(tx));
+    memset(txw, 0, sizeof(txw));
+
+    for (i = 0; i < dst->inuse; ++i) {
+        dst->iovs[i].vec[curiov[i]].iov_base = NULL;
+        dst->iovs[i].vec[curiov[i]].iov_len = 0;
+    }
+
+    while (bottom < top) {
+        dag_record_t *erfhdr = (dag_record_t *)bottom;
+        uint16_t len = ntohs(erfhdr->rlen);
+        uint16_t wlen = ntohs(erfhdr->wlen);
+        uint16_t lctr = ntohs(erfhdr->lctr);
+
+        if (lctr != 0) {
+            dst->stats.dropped_records += lctr;
+        }
+
+        if (top - bottom < len) {
+            break;
+        }
+
+        if (filter) {
+            if (apply_darkfilter(filter, bottom, &color) != 0) {
+                return bottom;
+            }
+            if (color == 0) {
+                bottom += len;
+                dst->stats.walked_records++;
+                dst->stats.walked_bytes += len;
+                dst->stats.walked_wbytes += wlen;
+                dst->stats.filtered_out.tx_records++;
+                dst->stats.filtered_out.tx_bytes += len;
+                dst->stats.filtered_out.tx_wbytes += wlen;
+                for (i = 0; i < dst->inuse; ++i) {
+                    old_end(&dst->iovs[i], &curiov[i]);
+                }
+                continue;
+            }
+        }
+
+        if (color == 1) {
+            i = 0;
+            if (collected[i] > 0 && collected[i] + len > dst->iovs[i].maxsize) {
+                break;
+            }
+            tx[i] += len;
+            txw[i] += wlen;
+            reccounts[i] += 1;
+            old_append(&dst->iovs[i], curiov[i], bottom, len, &collected[i]);
+            if (non_default_open) {
+                for (i = 1; i < dst->inuse; ++i) {
+                    old_end(&dst->iovs[i], &curiov[i]);
+                }
+            }
+            non_default_open = 0;
+        } else {
+            for (i = 0; i < dst->inuse; ++i) {
+                if (IS_SET(color, i) && collected[i] > 0
+                        && collected[i] + len > dst->iovs[i].maxsize) {
+                    goto stopwalking;
+                }
+            }
+            for (i = 0; i < dst->inuse; ++i) {
+                if (IS_SET(color, i)) {
+                    tx[i] += len;
+                    txw[i] += wlen;
+                    reccounts[i] += 1;
+                    old_append(&dst->iovs[i], curiov[i], bottom, len,
+                            &collected[i]);
+                } else {
+                    old_end(&dst->iovs[i], &curiov[i]);
+                }
+            }
+            non_default_open = 1;
+        }
+
+        walked += len;
+        wwalked += wlen;
+        bottom += len;
+        ++(*total_reccount);
+        dst->stats.walked_records++;
+    }
+
+stopwalking:
+    dst->stats.walked_bytes += walked;
+    dst->stats.walked_wbytes += wwalked;
+    for (i = 0; i < dst->inuse; ++i) {
+        dst->stats.sinks[i].tx_bytes += tx[i];
+        dst->stats.sinks[i].tx_wbytes += txw[i];
+    }
+    return bottom;
+}
+
+typedef char *(*walker_t)(char *, char *, uint16_t *, uint16_t *,
+        dagstreamthread_t *, darkfilter_t *, uint16_t *);
+
+/* Walk the whole buffer once, datagram by datagram. Returns the number of
+ * nanoseconds it took, or 0 if the walker got stuck. */
+static uint64_t walk_all(walker_t walker, char *buf, size_t size,
+        dagstreamthread_t *dst, darkfilter_t *filter, uint64_t *sent) {
+    uint16_t curiov[DAG_COLOR_SLOTS];
+    uint16_t reccounts[DAG_COLOR_SLOTS];
+    uint16_t total;
+    struct timespec start, stop;
+    char *bottom = buf, *next;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (bottom < buf + size) {
+        memset(curiov, 0, sizeof(curiov));
+        memset(reccounts, 0, sizeof(reccounts));
+        total = 0;
+        next = walker(bottom, buf + size, &total, curiov, dst, filter,
+                reccounts);
+        if (next == bottom) {
+            return 0;
+        }
+        for (i = 0; i < dst->inuse; ++i) {
+            *sent += reccounts[i];
+        }
+        bottom = next;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    return (stop.tv_sec - start.tv_sec) * 1000000000ULL +
+        stop.tv_nsec - start.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    static capture_ops_t ops = { .name = "bench" };
+    static capture_source_t src = { .ops = &ops };
+    char filterpath[] = "/tmp/walkbench.XXXXXX";
+    darkfilter_file_t files[1];
+    darkfilter_filter_t *filterfilter;
+    darkfilter_t *filter;
+    dagstreamthread_t *dst;
+    workermem_t *mem;
+    struct iovec *oldvec[2], *newvec[2];
+    size_t mib = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    uint64_t best[2] = {UINT64_MAX, UINT64_MAX}, sent[2] = {0, 0}, ns;
+    uint32_t cnt;
+    size_t size;
+    char *buf;
+    FILE *f;
+    int i, r, fd;
+
+    /* The second sink gets a sixteenth of the darknet. */
+    if ((fd = mkstemp(filterpath)) < 0 || (f = fdopen(fd, "w")) == NULL) {
+        perror("walkbench: filter file");
+        return 1;
+    }
+    for (i = 0; i < 16; ++i) {
+        fprintf(f, "%d.%d.0.0/16\n", BENCH_DARKNET, i * 16);
+    }
+    fclose(f);
+    memset(files, 0, sizeof(files));
+    files[0].color = 2;
+    files[0].excl_file = filterpath;
+    files[0].exclude = 1;
+    filterfilter = create_darkfilter_filter(BENCH_DARKNET, NULL, 0, NULL, 0,
+            1, files, BLOCKLIST_DEFAULT_SIZE);
+    unlink(filterpath);
+    if (filterfilter == NULL ||
+            (filter = (darkfilter_t *)create_darkfilter(filterfilter)) == NULL) {
+        fprintf(stderr, "walkbench: failed to create the darkfilter\n");
+        return 1;
+    }
+
+    buf = (char *)malloc(mib << 20);
+    mem = workermem_create(1 << 24, -1, 0);
+    dst = (dagstreamthread_t *)calloc(1, sizeof(dagstreamthread_t));
+    if (buf == NULL || mem == NULL || dst == NULL) {
+        fprintf(stderr, "walkbench: out of memory\n");
+        return 1;
+    }
+    size = synth_buffer((uint8_t *)buf, mib << 20, SYNTH_ETH, BENCH_DARKNET,
+            60, 1, &cnt);
+
+    dst->capture.src = &src;
+    dst->params.sinkcnt = 2;
+    dst->inuse = 2;
+    for (i = 0; i < 2; ++i) {
+        dst->iovs[i].len = DAG_IOV_CAPACITY;
+        dst->iovs[i].maxsize = 8960 - ENCAP_OVERHEAD;
+        dst->iovs[i].mem = mem;
+        oldvec[i] = (struct iovec *)calloc(DAG_IOV_CAPACITY,
+                sizeof(struct iovec));
+        newvec[i] = (struct iovec *)workermem_alloc(mem,
+                sizeof(struct iovec) * DAG_IOV_CAPACITY);
+    }
+
+    for (r = 0; r < rounds; ++r) {
+        for (i = 0; i < 2; ++i) {
+            dst->iovs[i].vec = oldvec[i];
+            dst->iovs[i].len = DAG_IOV_CAPACITY;
+        }
+        sent[0] = 0;
+        ns = walk_all(old_walk_stream_buffer, buf, size, dst, filter,
+                &sent[0]);
+        for (i = 0; i < 2; ++i) {
+            oldvec[i] = dst->iovs[i].vec;
+        }
+        if (ns != 0 && ns < best[0]) {
+            best[0] = ns;
+        }
+
+        for (i = 0; i < 2; ++i) {
+            dst->iovs[i].vec = newvec[i];
+            dst->iovs[i].len = DAG_IOV_CAPACITY;
+        }
+        sent[1] = 0;
+        ns = walk_all(walk_stream_buffer, buf, size, dst, filter, &sent[1]);
+        if (ns != 0 && ns < best[1]) {
+            best[1] = ns;
+        }
+    }
+
+    if (best[0] == UINT64_MAX || best[1] == UINT64_MAX || sent[0] != sent[1]) {
+        fprintf(stderr, "walkbench: walkers disagree or got stuck (%"PRIu64
+                " and %"PRIu64" records sent)\n", sent[0], sent[1]);
+        return 1;
+    }
+    printf("%u records, %zu bytes, %"PRIu64" sent to sinks, best of %d\n",
+            cnt, size, sent[1], rounds);
+    printf("single-pass walker: %6.2f ns/record %7.2f Mrecords/s\n",
+            (double)best[0] / cnt, cnt * 1000.0 / best[0]);
+    printf("two-pass walker:    %6.2f ns/record %7.2f Mrecords/s\n",
+            (double)best[1] / cnt, cnt * 1000.0 / best[1]);
+    return 0;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
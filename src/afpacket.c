@@ -0,0 +1,356 @@
+/* Capture backend that reads from AF_PACKET TPACKET_V3 block rings.
+ *
+ * Each stream is one member of a PACKET_FANOUT_HASH group on the configured
+ * interface. When a block is handed to the stream loop, its frames are
+ * rewritten in place into contiguous ERF records so that the walker and the
+ * darkfilter do not need to know that the packets did not come from a DAG.
+ */
+
+#ifdef __linux__
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <linux/if_packet.h>
+
+#include <dagapi.h>
+
+#include "byteswap.h"
+#include "capture.h"
+#include "erf.h"
+
+#define AFPACKET_BLOCK_SIZE (1 << 20)
+#define AFPACKET_FRAME_SIZE 2048
+#define AFPACKET_MIN_BLOCKS 4
+
+typedef struct afpacket_source {
+    int ifindex;
+    int fanoutid;
+} afpacket_source_t;
+
+typedef struct afpacket_stream {
+    int fd;
+    uint8_t *ring;
+    size_t ringlen;
+    uint32_t blockcnt;
+    uint32_t curblock;
+    uint8_t *top; // end of the converted records, NULL if we hold no block
+    uint32_t window;
+    int maxwait; // milliseconds
+} afpacket_stream_t;
+
+static int afpacket_open(capture_source_t *src) {
+    capture_options_t *opts = src->opts;
+    afpacket_source_t *afp;
+
+    if (opts->interface == NULL) {
+        fprintf(stderr, "AF_PACKET capture requires an interface.\n");
+        return -1;
+    }
+
+    afp = (afpacket_source_t *)malloc(sizeof(afpacket_source_t));
+    if (afp == NULL) {
+        fprintf(stderr, "Failed to allocate memory for AF_PACKET capture\n");
+        return -1;
+    }
+
+    afp->ifindex = if_nametoindex(opts->interface);
+    if (afp->ifindex == 0) {
+        fprintf(stderr, "Unknown interface %s: %s\n", opts->interface,
+                strerror(errno));
+        free(afp);
+        return -1;
+    }
+    afp->fanoutid = getpid() & 0xFFFF;
+    src->data = afp;
+
+    fprintf(stderr, "Capturing from %s with %d AF_PACKET fanout member(s)\n",
+            opts->interface, opts->fanout);
+    return 0;
+}
+
+static void afpacket_close(capture_source_t *src) {
+    free(src->data);
+    src->data = NULL;
+}
+
+static int afpacket_stream_count(capture_source_t *src) {
+    return src->opts->fanout;
+}
+
+static int afpacket_memnode(capture_source_t *src, int streamnum) {
+    char path[256];
+    FILE *f;
+    int node = -1;
+
+    (void) streamnum;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node",
+            src->opts->interface);
+    if ((f = fopen(path, "r")) != NULL) {
+        if (fscanf(f, "%d", &node) != 1) {
+            node = -1;
+        }
+        fclose(f);
+    }
+    return node;
+}
+
+/* Rings are sized by the attach window, so every stream has a buffer. */
+static int64_t afpacket_stream_size(capture_source_t *src, int streamnum) {
+    (void) src;
+    (void) streamnum;
+    return CAPTURE_DEFAULT_WINDOW;
+}
+
+static int afpacket_attach(capture_stream_t *cs, uint32_t window) {
+    afpacket_stream_t *as;
+
+    as = (afpacket_stream_t *)calloc(1, sizeof(afpacket_stream_t));
+    if (as == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    as->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (as->fd < 0) {
+        free(as);
+        return -1;
+    }
+    as->window = window;
+    cs->data = as;
+    return 0;
+}
+
+static int64_t afpacket_buffer_size(capture_stream_t *cs) {
+    afpacket_stream_t *as = (afpacket_stream_t *)cs->data;
+
+    return as->window;
+}
+
+static int afpacket_set_poll(capture_stream_t *cs, uint32_t mindata,
+        struct timeval *maxwait, struct timeval *poll) {
+    afpacket_stream_t *as = (afpacket_stream_t *)cs->data;
+
+    (void) mindata;
+    (void) poll;
+
+    as->maxwait = maxwait->tv_sec * 1000 + maxwait->tv_usec / 1000;
+    return 0;
+}
+
+static int afpacket_start(capture_stream_t *cs) {
+    afpacket_stream_t *as = (afpacket_stream_t *)cs->data;
+    afpacket_source_t *afp = (afpacket_source_t *)cs->src->data;
+    struct tpacket_req3 req;
+    struct sockaddr_ll sll;
+    struct packet_mreq mreq;
+    int version = TPACKET_V3;
+    int fanout;
+
+    if (setsockopt(as->fd, SOL_PACKET, PACKET_VERSION, &version,
+            sizeof(version)) != 0) {
+        return -1;
+    }
+
+    /* The ring is sized by the attach window, like a DAG stream buffer. */
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = AFPACKET_BLOCK_SIZE;
+    req.tp_block_nr = as->window / AFPACKET_BLOCK_SIZE;
+    if (req.tp_block_nr < AFPACKET_MIN_BLOCKS) {
+        req.tp_block_nr = AFPACKET_MIN_BLOCKS;
+    }
+    req.tp_frame_size = AFPACKET_FRAME_SIZE;
+    req.tp_frame_nr = (req.tp_block_size * req.tp_block_nr) /
+            req.tp_frame_size;
+    req.tp_retire_blk_tov = as->maxwait > 0 ? as->maxwait : 1;
+
+    if (setsockopt(as->fd, SOL_PACKET, PACKET_RX_RING, &req,
+            sizeof(req)) != 0) {
+        return -1;
+    }
+
+    as->ringlen = (size_t)req.tp_block_size * req.tp_block_nr;
+    as->ring = mmap(NULL, as->ringlen, PROT_READ | PROT_WRITE,
+            MAP_SHARED, as->fd, 0);
+    if (as->ring == MAP_FAILED) {
+        as->ring = NULL;
+        return -1;
+    }
+    as->blockcnt = req.tp_block_nr;
+    as->curblock = 0;
+    as->top = NULL;
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = afp->ifindex;
+    if (bind(as->fd, (struct sockaddr *)&sll, sizeof(sll)) != 0) {
+        return -1;
+    }
+
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = afp->ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(as->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+            sizeof(mreq)) != 0) {
+        return -1;
+    }
+
+    fanout = afp->fanoutid | (PACKET_FANOUT_HASH << 16);
+    if (setsockopt(as->fd, SOL_PACKET, PACKET_FANOUT, &fanout,
+            sizeof(fanout)) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Number of packets the kernel dropped since we last asked. */
+static uint16_t afpacket_drops(afpacket_stream_t *as) {
+    struct tpacket_stats_v3 st;
+    socklen_t len = sizeof(st);
+
+    if (getsockopt(as->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) != 0) {
+        return 0;
+    }
+    return st.tp_drops > 0xFFFF ? 0xFFFF : st.tp_drops;
+}
+
+/* Rewrite the frames of a block into back-to-back ERF records, starting at
+ * the first frame. Every frame is preceded by at least a tpacket3_hdr and a
+ * sockaddr_ll, which is more than the ERF header we put in its place, so
+ * the output never catches up with a frame we have not read yet.
+ */
+static uint8_t *afpacket_convert_block(afpacket_stream_t *as,
+        struct tpacket_block_desc *bd) {
+    uint8_t *out = (uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt;
+    struct tpacket3_hdr *pkt = (struct tpacket3_hdr *)out;
+    uint32_t i, num = bd->hdr.bh1.num_pkts;
+    uint16_t drops = afpacket_drops(as);
+
+    for (i = 0; i < num; ++i) {
+        dag_record_t *erfhdr = (dag_record_t *)out;
+        uint8_t *data = (uint8_t *)pkt + pkt->tp_mac;
+        uint32_t next = pkt->tp_next_offset;
+        uint32_t caplen = pkt->tp_snaplen;
+        uint32_t wlen = pkt->tp_len;
+        uint64_t ts = ((uint64_t)pkt->tp_sec << 32) +
+                (((uint64_t)pkt->tp_nsec << 32) / 1000000000);
+        uint16_t rlen;
+
+        if (caplen > 0xFFFF - ERF_HEADER_LEN - ERF_ETH_PAD - 7) {
+            caplen = 0xFFFF - ERF_HEADER_LEN - ERF_ETH_PAD - 7;
+        }
+        rlen = ERF_ALIGN(ERF_HEADER_LEN + ERF_ETH_PAD + caplen);
+
+        memmove(out + ERF_HEADER_LEN + ERF_ETH_PAD, data, caplen);
+        memset(out, 0, ERF_HEADER_LEN + ERF_ETH_PAD);
+        memset(out + ERF_HEADER_LEN + ERF_ETH_PAD + caplen, 0,
+                rlen - ERF_HEADER_LEN - ERF_ETH_PAD - caplen);
+
+        erfhdr->ts = bswap_host_to_le64(ts);
+        erfhdr->type = ERF_TYPE_ETH;
+        erfhdr->rlen = htons(rlen);
+        erfhdr->wlen = htons(wlen > 0xFFFF ? 0xFFFF : wlen);
+        /* Attribute the drops since the last block to its first record. */
+        erfhdr->lctr = htons(i == 0 ? drops : 0);
+
+        out += rlen;
+        pkt = (struct tpacket3_hdr *)((uint8_t *)pkt + next);
+    }
+
+    return out;
+}
+
+static uint8_t *afpacket_advance(capture_stream_t *cs, uint8_t **bottom) {
+    afpacket_stream_t *as = (afpacket_stream_t *)cs->data;
+    struct tpacket_block_desc *bd;
+    struct pollfd pfd;
+
+    bd = (struct tpacket_block_desc *)(as->ring +
+            (size_t)as->curblock * AFPACKET_BLOCK_SIZE);
+
+    if (as->top != NULL) {
+        if (*bottom != NULL && *bottom < as->top) {
+            /* Still walking the current block. */
+            return as->top;
+        }
+
+        /* Give the block back to the kernel and move on. */
+        __sync_synchronize();
+        bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        as->curblock = (as->curblock + 1) % as->blockcnt;
+        as->top = NULL;
+        bd = (struct tpacket_block_desc *)(as->ring +
+                (size_t)as->curblock * AFPACKET_BLOCK_SIZE);
+    }
+
+    if ((bd->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
+        pfd.fd = as->fd;
+        pfd.events = POLLIN | POLLERR;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, as->maxwait) < 0 && errno != EINTR) {
+            return NULL;
+        }
+        if ((bd->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
+            /* Nothing arrived before the timeout. */
+            *bottom = (uint8_t *)bd;
+            return *bottom;
+        }
+    }
+    __sync_synchronize();
+
+    *bottom = (uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt;
+    as->top = afpacket_convert_block(as, bd);
+    return as->top;
+}
+
+static int afpacket_stop(capture_stream_t *cs) {
+    (void) cs;
+    return 0;
+}
+
+static int afpacket_detach(capture_stream_t *cs) {
+    afpacket_stream_t *as = (afpacket_stream_t *)cs->data;
+
+    if (as == NULL) {
+        return 0;
+    }
+    if (as->ring) {
+        munmap(as->ring, as->ringlen);
+    }
+    close(as->fd);
+    free(as);
+    cs->data = NULL;
+    return 0;
+}
+
+const capture_ops_t afpacket_ops = {
+    .name = "afpacket",
+    .concurrent = 1,
+    .open = afpacket_open,
+    .close = afpacket_close,
+    .stream_count = afpacket_stream_count,
+    .memnode = afpacket_memnode,
+    .stream_size = afpacket_stream_size,
+    .attach = afpacket_attach,
+    .buffer_size = afpacket_buffer_size,
+    .set_poll = afpacket_set_poll,
+    .start = afpacket_start,
+    .advance = afpacket_advance,
+    .stop = afpacket_stop,
+    .detach = afpacket_detach,
+};
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,544 @@
+/* Capture backend that reads from AF_XDP sockets, one per NIC queue.
+ *
+ * A small XDP program redirects every packet on the interface to the
+ * socket bound to its receive queue. Each socket owns a UMEM that is filled
+ * by the kernel (or by the NIC in zero-copy mode). Packets are never copied:
+ * an ERF header is written into the headroom in front of each frame and the
+ * stream loop is handed a window over the resulting record pointers, which
+ * the walker turns directly into iovecs for the nDAG encapsulation.
+ *
+ * Frames go back to the fill ring on the next advance after they have been
+ * walked, i.e. once the datagrams referencing them have been sent.
+ */
+
+#ifdef __linux__
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#include <dagapi.h>
+
+#include "byteswap.h"
+#include "capture.h"
+#include "erf.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define AFXDP_FRAME_SIZE 4096
+#define AFXDP_MIN_FRAMES 256
+#define AFXDP_COMP_RING_SIZE 64
+
+typedef struct afxdp_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    void *descs;
+    uint32_t mask;
+    void *map;
+    size_t maplen;
+} afxdp_ring_t;
+
+typedef struct afxdp_source {
+    int ifindex;
+    int mapfd;
+    int progfd;
+    int linkfd;
+    uint16_t bindflags;
+} afxdp_source_t;
+
+typedef struct afxdp_stream {
+    int fd;
+    int queue;
+    uint8_t *umem;
+    size_t umemlen;
+    uint32_t framecnt;
+    afxdp_ring_t fill;
+    afxdp_ring_t comp;
+    afxdp_ring_t rx;
+
+    /* The current window: one ERF record pointer per received frame. */
+    char **recs;
+    uint64_t *addrs;
+    uint32_t reccnt;
+
+    uint64_t drops; // kernel drop counters at the last advance
+    int maxwait; // milliseconds
+} afxdp_stream_t;
+
+static inline int sys_bpf(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* Load the XDP program: redirect to the socket registered for the receive
+ * queue and let the packet through to the stack if there is none.
+ *
+ *   r2 = ctx->rx_queue_index
+ *   r1 = xsks_map
+ *   r3 = XDP_PASS
+ *   return bpf_redirect_map(r1, r2, r3)
+ */
+static int load_xdp_program(int mapfd) {
+    struct bpf_insn prog[] = {
+        { .code = BPF_LDX | BPF_MEM | BPF_W, .dst_reg = BPF_REG_2,
+          .src_reg = BPF_REG_1,
+          .off = offsetof(struct xdp_md, rx_queue_index) },
+        { .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1,
+          .src_reg = BPF_PSEUDO_MAP_FD, .imm = mapfd },
+        { .code = 0 },
+        { .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3,
+          .imm = XDP_PASS },
+        { .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map },
+        { .code = BPF_JMP | BPF_EXIT },
+    };
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uint64_t)(uintptr_t)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uint64_t)(uintptr_t)"Dual BSD/GPL";
+    return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+static void afxdp_close(capture_source_t *src) {
+    afxdp_source_t *xdp = (afxdp_source_t *)src->data;
+
+    if (xdp == NULL) {
+        return;
+    }
+    /* Closing the link detaches the program from the interface. */
+    if (xdp->linkfd >= 0) {
+        close(xdp->linkfd);
+    }
+    if (xdp->progfd >= 0) {
+        close(xdp->progfd);
+    }
+    if (xdp->mapfd >= 0) {
+        close(xdp->mapfd);
+    }
+    free(xdp);
+    src->data = NULL;
+}
+
+static int afxdp_open(capture_source_t *src) {
+    capture_options_t *opts = src->opts;
+    afxdp_source_t *xdp;
+    union bpf_attr attr;
+
+    if (opts->interface == NULL) {
+        fprintf(stderr, "AF_XDP capture requires an interface.\n");
+        return -1;
+    }
+
+    xdp = (afxdp_source_t *)malloc(sizeof(afxdp_source_t));
+    if (xdp == NULL) {
+        fprintf(stderr, "Failed to allocate memory for AF_XDP capture\n");
+        return -1;
+    }
+    xdp->mapfd = -1;
+    xdp->progfd = -1;
+    xdp->linkfd = -1;
+    xdp->bindflags = 0;
+    src->data = xdp;
+
+    if (opts->xdpmode == NULL) {
+        /* Let the kernel use zero-copy if the driver supports it. */
+    } else if (strcmp(opts->xdpmode, "copy") == 0) {
+        xdp->bindflags = XDP_COPY;
+    } else if (strcmp(opts->xdpmode, "zerocopy") == 0) {
+        xdp->bindflags = XDP_ZEROCOPY;
+    } else {
+        fprintf(stderr, "Unknown AF_XDP mode: %s\n", opts->xdpmode);
+        goto xdpopenfail;
+    }
+
+    xdp->ifindex = if_nametoindex(opts->interface);
+    if (xdp->ifindex == 0) {
+        fprintf(stderr, "Unknown interface %s: %s\n", opts->interface,
+                strerror(errno));
+        goto xdpopenfail;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = opts->queues;
+    if ((xdp->mapfd = sys_bpf(BPF_MAP_CREATE, &attr)) < 0) {
+        fprintf(stderr, "Failed to create XSK map: %s\n", strerror(errno));
+        goto xdpopenfail;
+    }
+
+    if ((xdp->progfd = load_xdp_program(xdp->mapfd)) < 0) {
+        fprintf(stderr, "Failed to load XDP program: %s\n", strerror(errno));
+        goto xdpopenfail;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = xdp->progfd;
+    attr.link_create.target_ifindex = xdp->ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    if ((xdp->linkfd = sys_bpf(BPF_LINK_CREATE, &attr)) < 0) {
+        fprintf(stderr, "Failed to attach XDP program to %s: %s\n",
+                opts->interface, strerror(errno));
+        goto xdpopenfail;
+    }
+
+    fprintf(stderr, "Capturing from %s with AF_XDP on %d queue(s)\n",
+            opts->interface, opts->queues);
+    return 0;
+
+xdpopenfail:
+    afxdp_close(src);
+    return -1;
+}
+
+static int afxdp_stream_count(capture_source_t *src) {
+    return src->opts->queues;
+}
+
+static int afxdp_memnode(capture_source_t *src, int streamnum) {
+    char path[256];
+    FILE *f;
+    int node = -1;
+
+    (void) streamnum;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node",
+            src->opts->interface);
+    if ((f = fopen(path, "r")) != NULL) {
+        if (fscanf(f, "%d", &node) != 1) {
+            node = -1;
+        }
+        fclose(f);
+    }
+    return node;
+}
+
+static int map_ring(afxdp_ring_t *ring, int fd, struct xdp_ring_offset *off,
+        uint32_t size, size_t descsize, off_t pgoff) {
+    ring->maplen = off->desc + size * descsize;
+    ring->map = mmap(NULL, ring->maplen, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (ring->map == MAP_FAILED) {
+        ring->map = NULL;
+        return -1;
+    }
+    ring->producer = (uint32_t *)((uint8_t *)ring->map + off->producer);
+    ring->consumer = (uint32_t *)((uint8_t *)ring->map + off->consumer);
+    ring->descs = (uint8_t *)ring->map + off->desc;
+    ring->mask = size - 1;
+    return 0;
+}
+
+static void unmap_ring(afxdp_ring_t *ring) {
+    if (ring->map) {
+        munmap(ring->map, ring->maplen);
+        ring->map = NULL;
+    }
+}
+
+/* Hand frames back to the kernel. The fill ring is as large as the UMEM,
+ * so there is always room for every frame we own. */
+static void afxdp_refill(afxdp_stream_t *xs, uint64_t *addrs, uint32_t cnt) {
+    uint32_t prod = *xs->fill.producer;
+    uint64_t *descs = (uint64_t *)xs->fill.descs;
+    uint32_t i;
+
+    if (cnt == 0) {
+        return;
+    }
+    for (i = 0; i < cnt; ++i) {
+        descs[(prod + i) & xs->fill.mask] = addrs[i];
+    }
+    __atomic_store_n(xs->fill.producer, prod + cnt, __ATOMIC_RELEASE);
+}
+
+static int afxdp_detach(capture_stream_t *cs) {
+    afxdp_stream_t *xs = (afxdp_stream_t *)cs->data;
+
+    if (xs == NULL) {
+        return 0;
+    }
+    unmap_ring(&xs->rx);
+    unmap_ring(&xs->comp);
+    unmap_ring(&xs->fill);
+    if (xs->fd >= 0) {
+        close(xs->fd);
+    }
+    if (xs->umem) {
+        munmap(xs->umem, xs->umemlen);
+    }
+    free(xs->recs);
+    free(xs->addrs);
+    free(xs);
+    cs->data = NULL;
+    return 0;
+}
+
+/* The UMEM plays the part of the stream buffer. Ring sizes must be a power
+ * of two, so round the frame count down to one. */
+static uint32_t umem_frames(uint32_t window) {
+    uint32_t framecnt = AFXDP_MIN_FRAMES;
+
+    while ((uint64_t)framecnt * 2 * AFXDP_FRAME_SIZE <= window) {
+        framecnt *= 2;
+    }
+    return framecnt;
+}
+
+static int64_t afxdp_stream_size(capture_source_t *src, int streamnum) {
+    (void) src;
+    (void) streamnum;
+    return (int64_t)umem_frames(CAPTURE_DEFAULT_WINDOW) * AFXDP_FRAME_SIZE;
+}
+
+static int afxdp_attach(capture_stream_t *cs, uint32_t window) {
+    afxdp_stream_t *xs;
+    struct xdp_umem_reg reg;
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    uint32_t compsize = AFXDP_COMP_RING_SIZE;
+    uint32_t i;
+
+    xs = (afxdp_stream_t *)calloc(1, sizeof(afxdp_stream_t));
+    if (xs == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    cs->data = xs;
+    xs->queue = cs->streamnum / 2;
+
+    xs->framecnt = umem_frames(window);
+    xs->umemlen = (size_t)xs->framecnt * AFXDP_FRAME_SIZE;
+
+    xs->recs = (char **)malloc(sizeof(char *) * xs->framecnt);
+    xs->addrs = (uint64_t *)malloc(sizeof(uint64_t) * xs->framecnt);
+    if (xs->recs == NULL || xs->addrs == NULL) {
+        errno = ENOMEM;
+        goto xdpattachfail;
+    }
+
+    xs->umem = mmap(NULL, xs->umemlen, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (xs->umem == MAP_FAILED) {
+        xs->umem = NULL;
+        goto xdpattachfail;
+    }
+
+    if ((xs->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0) {
+        goto xdpattachfail;
+    }
+
+    /* The kernel leaves XDP_PACKET_HEADROOM in front of every packet, which
+     * is where the ERF header goes. */
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uint64_t)(uintptr_t)xs->umem;
+    reg.len = xs->umemlen;
+    reg.chunk_size = AFXDP_FRAME_SIZE;
+    reg.headroom = 0;
+    if (setsockopt(xs->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) != 0 ||
+            setsockopt(xs->fd, SOL_XDP, XDP_UMEM_FILL_RING, &xs->framecnt,
+                sizeof(xs->framecnt)) != 0 ||
+            setsockopt(xs->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &compsize,
+                sizeof(compsize)) != 0 ||
+            setsockopt(xs->fd, SOL_XDP, XDP_RX_RING, &xs->framecnt,
+                sizeof(xs->framecnt)) != 0) {
+        goto xdpattachfail;
+    }
+
+    if (getsockopt(xs->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) != 0) {
+        goto xdpattachfail;
+    }
+
+    if (map_ring(&xs->fill, xs->fd, &off.fr, xs->framecnt, sizeof(uint64_t),
+                XDP_UMEM_PGOFF_FILL_RING) != 0 ||
+            map_ring(&xs->comp, xs->fd, &off.cr, compsize, sizeof(uint64_t),
+                XDP_UMEM_PGOFF_COMPLETION_RING) != 0 ||
+            map_ring(&xs->rx, xs->fd, &off.rx, xs->framecnt,
+                sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) != 0) {
+        goto xdpattachfail;
+    }
+
+    for (i = 0; i < xs->framecnt; ++i) {
+        xs->addrs[i] = (uint64_t)i * AFXDP_FRAME_SIZE;
+    }
+    afxdp_refill(xs, xs->addrs, xs->framecnt);
+    xs->reccnt = 0;
+    return 0;
+
+xdpattachfail:
+    i = errno;
+    afxdp_detach(cs);
+    errno = i;
+    return -1;
+}
+
+static int64_t afxdp_buffer_size(capture_stream_t *cs) {
+    return ((afxdp_stream_t *)cs->data)->umemlen;
+}
+
+static int afxdp_set_poll(capture_stream_t *cs, uint32_t mindata,
+        struct timeval *maxwait, struct timeval *poll) {
+    afxdp_stream_t *xs = (afxdp_stream_t *)cs->data;
+
+    (void) mindata;
+    (void) poll;
+
+    xs->maxwait = maxwait->tv_sec * 1000 + maxwait->tv_usec / 1000;
+    return 0;
+}
+
+static int afxdp_start(capture_stream_t *cs) {
+    afxdp_stream_t *xs = (afxdp_stream_t *)cs->data;
+    afxdp_source_t *xdp = (afxdp_source_t *)cs->src->data;
+    struct sockaddr_xdp sxdp;
+    union bpf_attr attr;
+    uint32_t key = xs->queue;
+    uint32_t value = xs->fd;
+
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = xdp->ifindex;
+    sxdp.sxdp_queue_id = xs->queue;
+    sxdp.sxdp_flags = xdp->bindflags;
+    if (bind(xs->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) != 0) {
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xdp->mapfd;
+    attr.key = (uint64_t)(uintptr_t)&key;
+    attr.value = (uint64_t)(uintptr_t)&value;
+    attr.flags = BPF_ANY;
+    return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0 ? -1 : 0;
+}
+
+/* Number of packets the kernel dropped since we last asked. */
+static uint16_t afxdp_drops(afxdp_stream_t *xs) {
+    struct xdp_statistics st;
+    socklen_t len = sizeof(st);
+    uint64_t total, delta;
+
+    if (getsockopt(xs->fd, SOL_XDP, XDP_STATISTICS, &st, &len) != 0) {
+        return 0;
+    }
+    total = st.rx_dropped + st.rx_ring_full + st.rx_fill_ring_empty_descs;
+    delta = total - xs->drops;
+    xs->drops = total;
+    return delta > 0xFFFF ? 0xFFFF : delta;
+}
+
+static uint8_t *afxdp_advance(capture_stream_t *cs, uint8_t **bottom) {
+    afxdp_stream_t *xs = (afxdp_stream_t *)cs->data;
+    uint8_t *start = (uint8_t *)xs->recs;
+    uint8_t *end = (uint8_t *)(xs->recs + xs->reccnt);
+    struct xdp_desc *descs = (struct xdp_desc *)xs->rx.descs;
+    struct timespec now;
+    struct pollfd pfd;
+    uint32_t cons, avail, i;
+    uint64_t ts;
+    uint16_t drops;
+
+    if (*bottom != NULL && *bottom >= start && *bottom < end) {
+        /* Still walking the current window. */
+        return end;
+    }
+
+    /* Everything in the previous window was walked and sent. */
+    afxdp_refill(xs, xs->addrs, xs->reccnt);
+    xs->reccnt = 0;
+    *bottom = start;
+
+    cons = *xs->rx.consumer;
+    avail = __atomic_load_n(xs->rx.producer, __ATOMIC_ACQUIRE) - cons;
+    if (avail == 0) {
+        pfd.fd = xs->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, xs->maxwait) < 0 && errno != EINTR) {
+            return NULL;
+        }
+        avail = __atomic_load_n(xs->rx.producer, __ATOMIC_ACQUIRE) - cons;
+        if (avail == 0) {
+            return start;
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    ts = ((uint64_t)now.tv_sec << 32) +
+            (((uint64_t)now.tv_nsec << 32) / 1000000000);
+    drops = afxdp_drops(xs);
+
+    for (i = 0; i < avail; ++i) {
+        struct xdp_desc *desc = &descs[(cons + i) & xs->rx.mask];
+        char *rec = (char *)xs->umem + desc->addr - ERF_HEADER_LEN -
+                ERF_ETH_PAD;
+        dag_record_t *erfhdr = (dag_record_t *)rec;
+        uint32_t caplen = desc->len;
+
+        if (caplen > 0xFFFF - ERF_HEADER_LEN - ERF_ETH_PAD) {
+            caplen = 0xFFFF - ERF_HEADER_LEN - ERF_ETH_PAD;
+        }
+
+        memset(rec, 0, ERF_HEADER_LEN + ERF_ETH_PAD);
+        erfhdr->ts = bswap_host_to_le64(ts);
+        erfhdr->type = ERF_TYPE_ETH;
+        erfhdr->rlen = htons(ERF_HEADER_LEN + ERF_ETH_PAD + caplen);
+        erfhdr->wlen = htons(desc->len > 0xFFFF ? 0xFFFF : desc->len);
+        erfhdr->lctr = htons(i == 0 ? drops : 0);
+
+        xs->recs[i] = rec;
+        xs->addrs[i] = desc->addr - (desc->addr % AFXDP_FRAME_SIZE);
+    }
+    __atomic_store_n(xs->rx.consumer, cons + avail, __ATOMIC_RELEASE);
+
+    xs->reccnt = avail;
+    return (uint8_t *)(xs->recs + xs->reccnt);
+}
+
+static int afxdp_stop(capture_stream_t *cs) {
+    (void) cs;
+    return 0;
+}
+
+const capture_ops_t afxdp_ops = {
+    .name = "afxdp",
+    .reclist = 1,
+    .concurrent = 1,
+    .open = afxdp_open,
+    .close = afxdp_close,
+    .stream_count = afxdp_stream_count,
+    .memnode = afxdp_memnode,
+    .stream_size = afxdp_stream_size,
+    .attach = afxdp_attach,
+    .buffer_size = afxdp_buffer_size,
+    .set_poll = afxdp_set_poll,
+    .start = afxdp_start,
+    .advance = afxdp_advance,
+    .stop = afxdp_stop,
+    .detach = afxdp_detach,
+};
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
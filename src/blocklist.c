@@ -0,0 +1,181 @@
+/* Source address blocklists for sinks. A blocklist file has an address or
+ * prefix per line, e.g. 192.0.2.1 or 198.51.100.0/24, and packets from
+ * them are no longer sent to the sink. The table has a fixed size, set by
+ * the blocklistsize option, so millions of entries take bounded memory and
+ * reloading never allocates.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <wandio.h>
+
+#include "blocklist.h"
+
+#define BLOCKLIST_BATCH 64
+
+int blocklist_init(blocklist_t *bl, uint32_t size) {
+    uint32_t slots = 4;
+
+    /* At most half full, so probes stay short. */
+    while (slots < size * 2ULL) {
+        slots <<= 1;
+    }
+    bl->slots = calloc(slots, sizeof(blocklist_slot_t));
+    if (bl->slots == NULL) {
+        fprintf(stderr, "Failed to allocate memory for blocklists\n");
+        return -1;
+    }
+    bl->slotmask = slots - 1;
+    bl->size = size;
+    blocklist_reset(bl);
+    return 0;
+}
+
+void blocklist_free(blocklist_t *bl) {
+    free(bl->slots);
+    bl->slots = NULL;
+}
+
+void blocklist_reset(blocklist_t *bl) {
+    memset(bl->slots, 0, (bl->slotmask + 1ULL) * sizeof(blocklist_slot_t));
+    bl->used = 0;
+    bl->lengthcnt = 0;
+}
+
+/* Keep the prefix lengths in use sorted, longest first. */
+static void add_length(blocklist_t *bl, int len) {
+    int i;
+
+    for (i = 0; i < bl->lengthcnt; ++i) {
+        if (bl->lengths[i] == len) {
+            return;
+        }
+        if (bl->lengths[i] < len) {
+            break;
+        }
+    }
+    memmove(&bl->lengths[i + 1], &bl->lengths[i],
+            (bl->lengthcnt - i) * sizeof(int));
+    bl->lengths[i] = len;
+    ++bl->lengthcnt;
+}
+
+static int add_entry(blocklist_t *bl, uint32_t addr, int len, color_t color) {
+    blocklist_slot_t *slot;
+    uint32_t i;
+
+    for (i = blocklist_index(bl, addr, len + 1); bl->slots[i].len != 0;
+            i = (i + 1) & bl->slotmask) {
+        slot = &bl->slots[i];
+        if (slot->addr == addr && slot->len == len + 1) {
+            slot->clear |= color;
+            return 0;
+        }
+    }
+    if (bl->used >= bl->size) {
+        fprintf(stderr, "ERROR: Blocklists have more than %u entries, raise "
+                "blocklistsize\n", bl->size);
+        return -1;
+    }
+    slot = &bl->slots[i];
+    slot->addr = addr;
+    slot->len = len + 1;
+    slot->clear = color;
+    ++bl->used;
+    add_length(bl, len);
+    return 0;
+}
+
+int blocklist_parse_file(blocklist_t *bl, const char *path, color_t color) {
+    io_t *file;
+    char buf[1024];
+    char line[1024];
+    char *start, *mask_str;
+    struct in_addr in;
+    uint32_t addr;
+    int len, cnt = 0;
+
+    if ((file = wandio_create(path)) == NULL) {
+        fprintf(stderr, "Failed to open blocklist file %s\n", path);
+        return -1;
+    }
+
+    while (wandio_fgets(file, buf, sizeof(buf), 1) != 0) {
+        if ((start = strchr(buf, '#')) != NULL) {
+            *start = '\0';
+        }
+        start = buf + strspn(buf, " \t");
+        start[strcspn(start, " \t\r")] = '\0';
+        if (*start == '\0') {
+            continue;
+        }
+
+        snprintf(line, sizeof(line), "%s", start);
+        len = 32;
+        if ((mask_str = strchr(start, '/')) != NULL) {
+            *mask_str = '\0';
+            len = atoi(mask_str + 1);
+        }
+        if (inet_pton(AF_INET, start, &in) != 1 || len < 0 || len > 32) {
+            fprintf(stderr, "ERROR: Malformed entry in blocklist %s: %s\n",
+                    path, line);
+            goto err;
+        }
+        addr = len == 0 ? 0 : ntohl(in.s_addr) & (~0U << (32 - len));
+        if (add_entry(bl, addr, len, color) != 0) {
+            goto err;
+        }
+        ++cnt;
+    }
+
+    fprintf(stderr, "[darkfilter] INFO: Blocklist %s\n", path);
+    fprintf(stderr, "[darkfilter] INFO: Blocking %d sources, %u entries in "
+            "use, %d prefix lengths\n", cnt, bl->used, bl->lengthcnt);
+    wandio_destroy(file);
+    return 0;
+
+err:
+    wandio_destroy(file);
+    return -1;
+}
+
+void blocklist_lookup_batch(const blocklist_t *bl, const uint32_t *srcs,
+        color_t *clear, int cnt) {
+    uint32_t idx[BLOCKLIST_BATCH];
+    uint32_t addr, i;
+    int done, n, j, l;
+    uint8_t len;
+
+    for (done = 0; done < cnt; done += n) {
+        n = cnt - done < BLOCKLIST_BATCH ? cnt - done : BLOCKLIST_BATCH;
+        for (j = 0; j < n; ++j) {
+            clear[done + j] = 0;
+        }
+        for (l = 0; l < bl->lengthcnt; ++l) {
+            len = bl->lengths[l] + 1;
+            for (j = 0; j < n; ++j) {
+                addr = bl->lengths[l] == 0 ? 0 :
+                        srcs[done + j] & (~0U << (32 - bl->lengths[l]));
+                idx[j] = blocklist_index(bl, addr, len);
+                __builtin_prefetch(&bl->slots[idx[j]]);
+            }
+            for (j = 0; j < n; ++j) {
+                addr = bl->lengths[l] == 0 ? 0 :
+                        srcs[done + j] & (~0U << (32 - bl->lengths[l]));
+                for (i = idx[j]; bl->slots[i].len != 0;
+                        i = (i + 1) & bl->slotmask) {
+                    if (bl->slots[i].addr == addr && bl->slots[i].len == len) {
+                        clear[done + j] |= bl->slots[i].clear;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
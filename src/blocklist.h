@@ -0,0 +1,76 @@
+#ifndef BLOCKLIST_H_
+#define BLOCKLIST_H_
+
+#include <stdint.h>
+
+#include "dagmultiplexer.h"
+
+/* Source addresses and prefixes that sinks don't want, e.g. known scanners.
+ * All of them are kept in one open-addressing hash table keyed by the
+ * masked address and prefix length. A lookup probes the table once for
+ * each prefix length in use, which is just /32 for plain addresses. */
+#define BLOCKLIST_DEFAULT_SIZE (1 << 20) // entries
+#define BLOCKLIST_MAX_SIZE (1 << 24)
+
+typedef struct blocklist_slot {
+    uint32_t addr; // masked, in host byte order
+    color_t clear; // colors of the sinks that don't want the source
+    uint8_t len; // prefix length + 1, 0 if the slot is empty
+} blocklist_slot_t;
+
+typedef struct blocklist {
+    blocklist_slot_t *slots;
+    uint32_t slotmask; // number of slots - 1
+    uint32_t size; // entries at most, half of the slots
+    uint32_t used;
+    int lengths[33]; // prefix lengths in use, longest first
+    int lengthcnt;
+} blocklist_t;
+
+int blocklist_init(blocklist_t *bl, uint32_t size);
+void blocklist_free(blocklist_t *bl);
+void blocklist_reset(blocklist_t *bl);
+
+/* Add the addresses and prefixes of a blocklist file for the sinks in
+ * color. Returns 0, or -1 if the file could not be read, does not parse or
+ * holds more entries than fit. */
+int blocklist_parse_file(blocklist_t *bl, const char *path, color_t color);
+
+static inline uint32_t blocklist_index(const blocklist_t *bl, uint32_t addr,
+        uint8_t len) {
+    uint64_t hash = (((uint64_t)addr << 8) | len) * 0x9e3779b97f4a7c15ULL;
+
+    return (uint32_t)(hash >> 32) & bl->slotmask;
+}
+
+/* Colors of the sinks that don't want packets from src. */
+static inline color_t blocklist_lookup(const blocklist_t *bl, uint32_t src) {
+    const blocklist_slot_t *slot;
+    color_t clear = 0;
+    uint32_t addr, i;
+    int l;
+    uint8_t len;
+
+    for (l = 0; l < bl->lengthcnt; ++l) {
+        len = bl->lengths[l] + 1;
+        addr = bl->lengths[l] == 0 ? 0 : src & (~0U << (32 - bl->lengths[l]));
+        for (i = blocklist_index(bl, addr, len); bl->slots[i].len != 0;
+                i = (i + 1) & bl->slotmask) {
+            slot = &bl->slots[i];
+            if (slot->addr == addr && slot->len == len) {
+                clear |= slot->clear;
+                break;
+            }
+        }
+    }
+    return clear;
+}
+
+/* The same for a batch of sources. The slots of all of them are fetched
+ * ahead, so the cache misses of a large blocklist overlap. */
+void blocklist_lookup_batch(const blocklist_t *bl, const uint32_t *srcs,
+        color_t *clear, int cnt);
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
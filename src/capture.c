@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "capture.h"
+
+static const capture_ops_t *backends[] = {
+    &dag_capture_ops,
+    &erf_replay_ops,
+#ifdef __linux__
+    &afpacket_ops,
+    &afxdp_ops,
+#endif
+    NULL
+};
+
+capture_source_t *capture_open(capture_options_t *opts) {
+    capture_source_t *src = NULL;
+    const capture_ops_t **ops;
+    const char *type = "dag";
+
+    if (opts->type != NULL) {
+        type = opts->type;
+    }
+
+    for (ops = backends; *ops != NULL; ++ops) {
+        if (strcmp((*ops)->name, type) == 0) {
+            break;
+        }
+    }
+    if (*ops == NULL) {
+        fprintf(stderr, "Unknown capture type: %s\n", type);
+        return NULL;
+    }
+
+    src = (capture_source_t *)malloc(sizeof(capture_source_t));
+    if (src == NULL) {
+        fprintf(stderr, "Failed to allocate memory for capture source\n");
+        return NULL;
+    }
+
+    src->ops = *ops;
+    src->opts = opts;
+    src->fd = -1;
+    src->data = NULL;
+    src->streams = NULL;
+    src->streamcnt = 0;
+
+    if (src->ops->open(src) != 0) {
+        free(src);
+        return NULL;
+    }
+
+    /* Spread the records of each stream over several in software. */
+    if (opts->softfanout > 1) {
+        return softfanout_wrap(src);
+    }
+    return src;
+}
+
+/* Find the buffer size of a stream by attaching to it, for backends that
+ * cannot tell otherwise. Streams that cannot be attached for lack of memory
+ * are not usable, like those without a buffer. */
+static int64_t probe_stream_size(capture_source_t *src, int streamnum) {
+    capture_stream_t cs;
+    int64_t size;
+
+    cs.src = src;
+    cs.streamnum = streamnum;
+    cs.data = NULL;
+
+    if (src->ops->attach(&cs, CAPTURE_DEFAULT_WINDOW) != 0) {
+        if (errno == ENOMEM) {
+            return 0;
+        }
+        fprintf(stderr, "Failed to attach to %s stream %d: %s\n",
+                src->ops->name, streamnum, strerror(errno));
+        return -1;
+    }
+    size = src->ops->buffer_size(&cs);
+    src->ops->detach(&cs);
+    return size < 0 ? 0 : size;
+}
+
+int capture_enumerate(capture_source_t *src) {
+    int count, i;
+    int64_t size;
+
+    if (src->streams) {
+        return src->streamcnt;
+    }
+
+    count = src->ops->stream_count(src);
+    if (count < 0) {
+        fprintf(stderr, "Failed to get RX stream count from %s source: %s\n",
+                src->ops->name, strerror(errno));
+        return -1;
+    }
+
+    src->streams = (capture_streaminfo_t *)calloc(count > 0 ? count : 1,
+            sizeof(capture_streaminfo_t));
+    if (src->streams == NULL) {
+        fprintf(stderr, "Failed to allocate memory for stream info\n");
+        return -1;
+    }
+
+    for (i = 0; i < count; ++i) {
+        size = -1;
+        if (src->ops->stream_size) {
+            size = src->ops->stream_size(src, i * 2);
+        }
+        if (size < 0) {
+            size = probe_stream_size(src, i * 2);
+        }
+        if (size < 0) {
+            free(src->streams);
+            src->streams = NULL;
+            return -1;
+        }
+        src->streams[i].buffersize = size;
+        src->streams[i].memnode = src->ops->memnode(src, i * 2);
+    }
+    src->streamcnt = count;
+    return count;
+}
+
+void capture_close(capture_source_t *src) {
+    if (src == NULL) {
+        return;
+    }
+    src->ops->close(src);
+    free(src->streams);
+    free(src);
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
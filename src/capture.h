@@ -0,0 +1,112 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#define CAPTURE_DEFAULT_WINDOW (8 * 1024 * 1024)
+
+typedef struct capture_source capture_source_t;
+typedef struct capture_stream capture_stream_t;
+
+/* Options that select and configure a capture backend. */
+typedef struct capture_options {
+    char *type;         // backend name, "dag" if NULL
+    char *device;       // DAG device name
+    char **files;       // ERF files to replay, one per stream
+    int filecnt;
+    double speed;       // replay speed multiplier, 0 is as fast as possible
+    int loops;          // number of times to replay each file
+    char *interface;    // interface to capture from
+    int fanout;         // number of AF_PACKET fanout members (streams)
+    int queues;         // number of AF_XDP queues (streams)
+    char *xdpmode;      // "copy" or "zerocopy", kernel's choice if NULL
+    int softfanout;     // spread each stream over this many, 1 to disable
+} capture_options_t;
+
+/* What is known about a stream before attaching to it. */
+typedef struct capture_streaminfo {
+    int memnode; // negative if not tied to a NUMA node
+    int64_t buffersize; // bytes, 0 if the stream will not receive anything
+} capture_streaminfo_t;
+
+/* Operations provided by a capture backend. These mirror the subset of the
+ * DAG API used by the multiplexer, so the stream loop can be driven by
+ * anything that hands out [bottom, top) windows of ERF records.
+ *
+ * Streams are numbered like DAG receive streams, i.e. 0, 2, 4, ...
+ * set_poll is called before start and again whenever the poll controller
+ * re-tunes a running stream.
+ *
+ * Backends that set reclist hand out windows over an array of pointers to
+ * ERF records rather than over the records themselves, for sources where
+ * records are not laid out back to back.
+ *
+ * Backends that set concurrent allow different streams to be attached,
+ * started, stopped and detached from different threads at the same time.
+ * stream_size is optional and returns the buffer size of a stream without
+ * attaching to it, or a negative value if that is not possible.
+ */
+typedef struct capture_ops {
+    const char *name;
+    uint8_t reclist;
+    uint8_t concurrent;
+
+    /* Source-wide operations. */
+    int (*open)(capture_source_t *src);
+    void (*close)(capture_source_t *src);
+    int (*stream_count)(capture_source_t *src);
+    int (*memnode)(capture_source_t *src, int streamnum);
+    int64_t (*stream_size)(capture_source_t *src, int streamnum);
+
+    /* Per-stream operations. */
+    int (*attach)(capture_stream_t *cs, uint32_t window);
+    int64_t (*buffer_size)(capture_stream_t *cs);
+    int (*set_poll)(capture_stream_t *cs, uint32_t mindata,
+            struct timeval *maxwait, struct timeval *poll);
+    int (*start)(capture_stream_t *cs);
+    uint8_t *(*advance)(capture_stream_t *cs, uint8_t **bottom);
+    int (*stop)(capture_stream_t *cs);
+    int (*detach)(capture_stream_t *cs);
+} capture_ops_t;
+
+struct capture_source {
+    const capture_ops_t *ops;
+    capture_options_t *opts; // non-owning reference, owned by config
+    int fd;
+    void *data; // backend specific
+
+    /* Filled in once by capture_enumerate() and kept while the source is
+     * open, so restarting the streams does not probe them again. */
+    capture_streaminfo_t *streams;
+    int streamcnt;
+};
+
+struct capture_stream {
+    capture_source_t *src;
+    int streamnum;
+    void *data; // backend specific
+};
+
+extern const capture_ops_t dag_capture_ops;
+extern const capture_ops_t erf_replay_ops;
+#ifdef __linux__
+extern const capture_ops_t afpacket_ops;
+extern const capture_ops_t afxdp_ops;
+#endif
+
+capture_source_t *capture_open(capture_options_t *opts);
+int capture_enumerate(capture_source_t *src);
+capture_source_t *softfanout_wrap(capture_source_t *inner);
+void capture_close(capture_source_t *src);
+
+static inline int capture_memnode(capture_source_t *src, int streamnum) {
+    if (src->streams && streamnum / 2 < src->streamcnt) {
+        return src->streams[streamnum / 2].memnode;
+    }
+    return src->ops->memnode(src, streamnum);
+}
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -4,6 +4,9 @@
 #include <assert.h>
 
 #include "telescope.h"
+#include "dgramcompress.h"
+#include "blocklist.h"
+#include "erf.h"
 
 static int parse_onoff_option(char *value, uint8_t *opt) {
     if (strcmp(value, "yes") == 0 || strcmp(value, "true") == 0 ||
@@ -18,11 +21,47 @@ static int parse_onoff_option(char *value, uint8_t *opt) {
     return 0;
 }
 
+/* Sizes in bytes, optionally with a K, M or G suffix (powers of 1024). */
+static int parse_size_option(char *value, uint64_t *opt) {
+    char *end;
+    uint64_t size = strtoull(value, &end, 10);
+
+    if (end == value) {
+        return -1;
+    }
+    switch (*end) {
+        case 'k': case 'K':
+            size <<= 10;
+            end++;
+            break;
+        case 'm': case 'M':
+            size <<= 20;
+            end++;
+            break;
+        case 'g': case 'G':
+            size <<= 30;
+            end++;
+            break;
+    }
+    if (*end == 'i' || *end == 'B') {
+        end++;
+    }
+    if (*end == 'B') {
+        end++;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    *opt = size;
+    return 0;
+}
+
 static int parse_torrents(telescope_global_t *glob,
         yaml_document_t *doc, yaml_node_t *torrentlist) {
 
     yaml_node_item_t *item;
     int needsdefaults;
+    int hasfilter;
     int torrentcount = 0;
     int nostreamcount = 0;
     int nofiltercount = 0;
@@ -66,6 +105,9 @@ static int parse_torrents(telescope_global_t *glob,
         new->mcastaddr = NULL;
         new->srcaddr = NULL;
         new->filterfile = NULL;
+        new->filterfile6 = NULL;
+        new->rulefile = NULL;
+        new->blocklist = NULL;
         new->mcastport = 0;
         new->mtu = 0;
         new->monitorid = 0;
@@ -73,6 +115,12 @@ static int parse_torrents(telescope_global_t *glob,
         new->name = NULL;
         new->ttl = 1;
         new->exclude = 1; // true
+        new->copythreshold = 0;
+        new->snaplen = 0;
+        new->headersonly = 0;
+        new->compressflag = 0;
+        new->samplerate = 0;
+        new->sampleflows = 1;
 
         /* Make sure save the list in the global state. */
         if (glob->torrents == NULL) {
@@ -124,6 +172,60 @@ static int parse_torrents(telescope_global_t *glob,
                 needsdefaults = 1;
             }
 
+            else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                         && !strcmp((char *)key->data.scalar.value, "copythreshold")) {
+                current->copythreshold =
+                    (uint16_t) strtoul((char *)value->data.scalar.value, NULL, 10);
+            }
+
+            else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                         && !strcmp((char *)key->data.scalar.value, "snaplen")) {
+                if (!strcmp((char *)value->data.scalar.value, "headers")) {
+                    current->headersonly = 1;
+                } else {
+                    current->snaplen = (uint16_t) strtoul(
+                            (char *)value->data.scalar.value, NULL, 10);
+                    if (current->snaplen > 0 &&
+                            current->snaplen <= ERF_HEADER_LEN) {
+                        fprintf(stderr, "Not a viable option 'snaplen': %s, "
+                            "records need more than their %d byte ERF header."
+                            "\n", (char *)value->data.scalar.value,
+                            ERF_HEADER_LEN);
+                        goto torrentparseerror;
+                    }
+                }
+            }
+
+            else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                         && !strcmp((char *)key->data.scalar.value, "compress")) {
+                if (parse_onoff_option((char *)value->data.scalar.value,
+                                       &current->compressflag) != 0) {
+                    fprintf(stderr, "Not a viable option 'compress': %s.\n",
+                        (char *)value->data.scalar.value);
+                    goto torrentparseerror;
+                }
+            }
+
+            else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                         && !strcmp((char *)key->data.scalar.value, "samplerate")) {
+                current->samplerate = (uint32_t) strtoul(
+                        (char *)value->data.scalar.value, NULL, 10);
+            }
+
+            else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                         && !strcmp((char *)key->data.scalar.value, "sampleby")) {
+                if (!strcmp((char *)value->data.scalar.value, "flow")) {
+                    current->sampleflows = 1;
+                } else if (!strcmp((char *)value->data.scalar.value, "packet")) {
+                    current->sampleflows = 0;
+                } else {
+                    fprintf(stderr, "Not a viable option 'sampleby': %s, "
+                        "use flow or packet.\n",
+                        (char *)value->data.scalar.value);
+                    goto torrentparseerror;
+                }
+            }
+
             else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
                          && !strcmp((char *)key->data.scalar.value, "ttl")) {
                 current->ttl =
@@ -136,6 +238,21 @@ static int parse_torrents(telescope_global_t *glob,
                 current->filterfile = strdup((char *)value->data.scalar.value);
             }
 
+            else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                         && !strcmp((char *)key->data.scalar.value, "filterfile6")) {
+                current->filterfile6 = strdup((char *)value->data.scalar.value);
+            }
+
+            else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                         && !strcmp((char *)key->data.scalar.value, "rulefile")) {
+                current->rulefile = strdup((char *)value->data.scalar.value);
+            }
+
+            else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                         && !strcmp((char *)key->data.scalar.value, "blocklist")) {
+                current->blocklist = strdup((char *)value->data.scalar.value);
+            }
+
             else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
                          && !strcmp((char *)key->data.scalar.value, "name")) {
                 current->name = strdup((char *)value->data.scalar.value);
@@ -178,16 +295,28 @@ static int parse_torrents(telescope_global_t *glob,
         }
 
         /* Assign color to filter, see telescope.h for rules. */
-        if (current->filterfile != NULL && current->mcastaddr !=  NULL) {
-            if (nextcolorshift >= 8) {
+        hasfilter = current->filterfile != NULL ||
+            current->filterfile6 != NULL || current->rulefile != NULL;
+        if (hasfilter && current->mcastaddr !=  NULL) {
+            if (nextcolorshift >= (int)DAG_COLOR_SLOTS) {
                 fprintf(stderr,
-                    "Too many streams. Cannot handle more than eight multicast "
-                    "groups.\n");
+                    "Too many streams. Cannot handle more than %d multicast "
+                    "groups.\n", (int)DAG_COLOR_SLOTS);
                 goto torrentparseerror;
             }
-            current->color = 0x1 << nextcolorshift;
+            current->color = (color_t)0x1 << nextcolorshift;
             ++nextcolorshift;
-        } else if (current->filterfile != NULL && current->mcastaddr == NULL) {
+        } else if (hasfilter && current->mcastaddr == NULL) {
+            if (current->blocklist != NULL) {
+                fprintf(stderr,
+                    "A blocklist needs a sink with an mcastaddr.\n");
+                goto torrentparseerror;
+            }
+            if (current->samplerate > 1) {
+                fprintf(stderr,
+                    "A samplerate needs a sink with an mcastaddr.\n");
+                goto torrentparseerror;
+            }
             current->color = 0x0;
             ++nostreamcount;
             if (current->exclude == 0) {
@@ -196,7 +325,7 @@ static int parse_torrents(telescope_global_t *glob,
                     "the default sink, enabling flag.\n");
                 current->exclude = 1;
             }
-        } else if (current->filterfile == NULL && current->mcastaddr != NULL) {
+        } else if (!hasfilter && current->mcastaddr != NULL) {
             current->color = 0x1;
             ++nofiltercount;
             if (current->exclude == 0) {
@@ -257,15 +386,478 @@ torrentparseerror:
     return -1;
 }
 
+static int parse_erf_files(telescope_global_t *glob,
+        yaml_document_t *doc, yaml_node_t *filelist) {
+
+    yaml_node_item_t *item;
+    yaml_node_t *node;
+    capture_options_t *opts = &glob->capture;
+    int filecnt = filelist->data.sequence.items.top -
+            filelist->data.sequence.items.start;
+
+    if (opts->files != NULL) {
+        fprintf(stderr, "ERF files specified more than once.\n");
+        return -1;
+    }
+
+    if (filecnt == 0) {
+        fprintf(stderr, "'erffiles' must list at least one ERF file.\n");
+        return -1;
+    }
+
+    opts->files = (char **)calloc(filecnt, sizeof(char *));
+    if (opts->files == NULL) {
+        fprintf(stderr, "Failed to allocate memory for ERF file list.\n");
+        return -1;
+    }
+
+    for (item = filelist->data.sequence.items.start;
+            item != filelist->data.sequence.items.top;
+                ++item) {
+        node = yaml_document_get_node(doc, *item);
+        if (node == NULL || node->type != YAML_SCALAR_NODE) {
+            fprintf(stderr, "Entries in 'erffiles' must be file names.\n");
+            return -1;
+        }
+        opts->files[opts->filecnt] = strdup((char *)node->data.scalar.value);
+        ++opts->filecnt;
+    }
+
+    return opts->filecnt;
+}
+
+/* Parse a list of darknet prefixes, for the darknets or darknet6 option.
+ * They are checked when the darkfilter is created. */
+static int parse_darknets(yaml_document_t *doc, yaml_node_t *netlist,
+        const char *option, char ***nets, int *netcnt) {
+    yaml_node_item_t *item;
+    yaml_node_t *node;
+    int cnt = netlist->data.sequence.items.top -
+            netlist->data.sequence.items.start;
+
+    if (*nets != NULL) {
+        fprintf(stderr, "'%s' specified more than once.\n", option);
+        return -1;
+    }
+
+    *nets = (char **)calloc(cnt, sizeof(char *));
+    if (*nets == NULL && cnt > 0) {
+        fprintf(stderr, "Failed to allocate memory for darknet list.\n");
+        return -1;
+    }
+
+    for (item = netlist->data.sequence.items.start;
+            item != netlist->data.sequence.items.top;
+                ++item) {
+        node = yaml_document_get_node(doc, *item);
+        if (node == NULL || node->type != YAML_SCALAR_NODE) {
+            fprintf(stderr, "Entries in '%s' must be prefixes.\n", option);
+            return -1;
+        }
+        (*nets)[*netcnt] = strdup((char *)node->data.scalar.value);
+        ++*netcnt;
+    }
+
+    return *netcnt;
+}
+
+/* Parse a polling option. Returns 1 if the key was a polling option, 0 if it
+ * was not and -1 if the value was invalid. */
+static int parse_poll_option(pollctl_params_t *poll, yaml_node_t *key,
+        yaml_node_t *value) {
+    char *name, *val;
+    uint8_t onoff;
+
+    if (key->type != YAML_SCALAR_NODE || value->type != YAML_SCALAR_NODE) {
+        return 0;
+    }
+    name = (char *)key->data.scalar.value;
+    val = (char *)value->data.scalar.value;
+
+    if (!strcmp(name, "adaptivepoll")) {
+        if (parse_onoff_option(val, &onoff) != 0) {
+            fprintf(stderr, "Not a viable option 'adaptivepoll': %s.\n", val);
+            return -1;
+        }
+        poll->adaptive = onoff;
+    }
+
+    else if (!strcmp(name, "pollmindata")) {
+        poll->mindata = atoi(val);
+        if (poll->mindata < 0) {
+            fprintf(stderr, "Poll mindata cannot be negative.\n");
+            return -1;
+        }
+    }
+
+    else if (!strcmp(name, "pollmaxwait")) {
+        poll->maxwait = atoi(val);
+        if (poll->maxwait <= 0) {
+            fprintf(stderr, "Poll maxwait must be positive.\n");
+            return -1;
+        }
+    }
+
+    else if (!strcmp(name, "pollfreq")) {
+        poll->pollfreq = atoi(val);
+        if (poll->pollfreq <= 0) {
+            fprintf(stderr, "Poll frequency must be positive.\n");
+            return -1;
+        }
+    }
+
+    else if (!strcmp(name, "maxlatency")) {
+        poll->maxlatency = atoi(val);
+        if (poll->maxlatency < 2 * POLLCTL_MIN_POLL) {
+            fprintf(stderr, "Max latency must be at least %d microseconds.\n",
+                    2 * POLLCTL_MIN_POLL);
+            return -1;
+        }
+    }
+
+    else if (!strcmp(name, "targetfill")) {
+        poll->targetfill = atoi(val);
+        if (poll->targetfill < 0 || poll->targetfill > 100) {
+            fprintf(stderr, "Target fill must be a percentage.\n");
+            return -1;
+        }
+    }
+
+    else {
+        return 0;
+    }
+
+    return 1;
+}
+
+static int parse_streams(telescope_global_t *glob,
+        yaml_document_t *doc, yaml_node_t *streamlist) {
+
+    yaml_node_item_t *item;
+    yaml_node_pair_t *pair;
+    yaml_node_t *node, *key, *value;
+    streamconf_t *current;
+    uint8_t onoff;
+    uint64_t size;
+    int streamcnt = streamlist->data.sequence.items.top -
+            streamlist->data.sequence.items.start;
+
+    if (glob->streams != NULL) {
+        fprintf(stderr, "Streams specified more than once.\n");
+        return -1;
+    }
+
+    glob->streams = (streamconf_t *)calloc(streamcnt, sizeof(streamconf_t));
+    if (glob->streams == NULL) {
+        fprintf(stderr, "Failed to allocate memory for stream config.\n");
+        return -1;
+    }
+
+    for (item = streamlist->data.sequence.items.start;
+            item != streamlist->data.sequence.items.top;
+                ++item) {
+        node = yaml_document_get_node(doc, *item);
+        if (node == NULL || node->type != YAML_MAPPING_NODE) {
+            fprintf(stderr, "Entries in 'streams' must be mappings.\n");
+            return -1;
+        }
+
+        /* Everything not set here is inherited from the global options. */
+        current = &glob->streams[glob->streamcnt];
+        current->streamnum = -1;
+        current->dedicated = -1;
+        current->pipeline = -1;
+        current->cpu = -1;
+        current->txcpu = -1;
+        current->attachwindow = -1;
+        memset(&current->poll, -1, sizeof(pollctl_params_t));
+        ++glob->streamcnt;
+
+        for (pair = node->data.mapping.pairs.start;
+                pair < node->data.mapping.pairs.top;
+                    ++pair) {
+            key = yaml_document_get_node(doc, pair->key);
+            value = yaml_document_get_node(doc, pair->value);
+
+            if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                    && !strcmp((char *)key->data.scalar.value, "stream")) {
+                current->streamnum = atoi((char *)value->data.scalar.value);
+            } else if (key->type == YAML_SCALAR_NODE
+                    && value->type == YAML_SCALAR_NODE
+                    && !strcmp((char *)key->data.scalar.value, "dedicated")) {
+                if (parse_onoff_option((char *)value->data.scalar.value,
+                                       &onoff) != 0) {
+                    fprintf(stderr, "Not a viable option 'dedicated': %s.\n",
+                        (char *)value->data.scalar.value);
+                    return -1;
+                }
+                current->dedicated = onoff;
+            } else if (key->type == YAML_SCALAR_NODE
+                    && value->type == YAML_SCALAR_NODE
+                    && !strcmp((char *)key->data.scalar.value, "pipeline")) {
+                if (parse_onoff_option((char *)value->data.scalar.value,
+                                       &onoff) != 0) {
+                    fprintf(stderr, "Not a viable option 'pipeline': %s.\n",
+                        (char *)value->data.scalar.value);
+                    return -1;
+                }
+                current->pipeline = onoff;
+            } else if (key->type == YAML_SCALAR_NODE
+                    && value->type == YAML_SCALAR_NODE
+                    && !strcmp((char *)key->data.scalar.value, "cpu")) {
+                current->cpu = atoi((char *)value->data.scalar.value);
+                if (current->cpu < 0) {
+                    fprintf(stderr, "Stream CPU cannot be negative.\n");
+                    return -1;
+                }
+            } else if (key->type == YAML_SCALAR_NODE
+                    && value->type == YAML_SCALAR_NODE
+                    && !strcmp((char *)key->data.scalar.value, "txcpu")) {
+                current->txcpu = atoi((char *)value->data.scalar.value);
+                if (current->txcpu < 0) {
+                    fprintf(stderr, "Stream TX CPU cannot be negative.\n");
+                    return -1;
+                }
+            } else if (key->type == YAML_SCALAR_NODE
+                    && value->type == YAML_SCALAR_NODE
+                    && !strcmp((char *)key->data.scalar.value,
+                        "attachwindow")) {
+                if (parse_size_option((char *)value->data.scalar.value,
+                                      &size) != 0 || size > UINT32_MAX) {
+                    fprintf(stderr, "Not a viable option 'attachwindow': "
+                        "%s.\n", (char *)value->data.scalar.value);
+                    return -1;
+                }
+                current->attachwindow = size;
+            } else if (parse_poll_option(&current->poll, key, value) < 0) {
+                return -1;
+            }
+        }
+
+        if (current->streamnum < 0) {
+            fprintf(stderr, "Entries in 'streams' need a stream number.\n");
+            return -1;
+        }
+    }
+
+    return glob->streamcnt;
+}
+
 static int parse_option(telescope_global_t *glob, yaml_document_t *doc,
         yaml_node_t *key, yaml_node_t *value) {
     int torrentcount = 0;
+    uint64_t size;
+    int ret;
+
+    if ((ret = parse_poll_option(&glob->poll, key, value)) != 0) {
+        return ret;
+    }
 
     if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
             && !strcmp((char *)key->data.scalar.value, "dagdev")) {
         glob->dagdev = strdup((char *)value->data.scalar.value);
     }
 
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value, "capture")) {
+        /* A later key wins. */
+        if (glob->capture.type) {
+            free(glob->capture.type);
+        }
+        glob->capture.type = strdup((char *)value->data.scalar.value);
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value, "replayspeed")) {
+        if (strcmp((char *)value->data.scalar.value, "max") == 0) {
+            glob->capture.speed = 0;
+        } else {
+            glob->capture.speed = strtod((char *)value->data.scalar.value, NULL);
+            if (glob->capture.speed <= 0) {
+                fprintf(stderr, "Replay speed must be positive or 'max'.\n");
+                return -1;
+            }
+        }
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value, "replayloops")) {
+        glob->capture.loops = atoi((char *)value->data.scalar.value);
+        if (glob->capture.loops < 0) {
+            fprintf(stderr, "Replay loops cannot be negative.\n");
+            return -1;
+        }
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value, "interface")) {
+        glob->capture.interface = strdup((char *)value->data.scalar.value);
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value, "fanout")) {
+        glob->capture.fanout = atoi((char *)value->data.scalar.value);
+        if (glob->capture.fanout <= 0) {
+            fprintf(stderr, "Fanout must be at least one.\n");
+            return -1;
+        }
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value, "queues")) {
+        glob->capture.queues = atoi((char *)value->data.scalar.value);
+        if (glob->capture.queues <= 0) {
+            fprintf(stderr, "Number of queues must be at least one.\n");
+            return -1;
+        }
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value, "xdpmode")) {
+        glob->capture.xdpmode = strdup((char *)value->data.scalar.value);
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value, "softfanout")) {
+        glob->capture.softfanout = atoi((char *)value->data.scalar.value);
+        if (glob->capture.softfanout <= 0) {
+            fprintf(stderr, "Software fanout must be at least one.\n");
+            return -1;
+        }
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value, "streamspercore")) {
+        glob->streamspercore = atoi((char *)value->data.scalar.value);
+        if (glob->streamspercore <= 0) {
+            fprintf(stderr, "Streams per core must be at least one.\n");
+            return -1;
+        }
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value, "pipeline")) {
+        if (parse_onoff_option((char *)value->data.scalar.value,
+                               &glob->pipeline) != 0) {
+            fprintf(stderr, "Not a viable option 'pipeline': %s.\n",
+                (char *)value->data.scalar.value);
+            return -1;
+        }
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value, "pipelinedepth")) {
+        glob->pipelinedepth = atoi((char *)value->data.scalar.value);
+        if (glob->pipelinedepth <= 0) {
+            fprintf(stderr, "Pipeline depth must be at least one.\n");
+            return -1;
+        }
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value, "attachwindow")) {
+        if (parse_size_option((char *)value->data.scalar.value,
+                              &size) != 0 || size > UINT32_MAX) {
+            fprintf(stderr, "Not a viable option 'attachwindow': %s.\n",
+                (char *)value->data.scalar.value);
+            return -1;
+        }
+        glob->attachwindow = size;
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value, "iovcapacity")) {
+        glob->iovcapacity = atoi((char *)value->data.scalar.value);
+        if (glob->iovcapacity < 2 || glob->iovcapacity > 4096) {
+            fprintf(stderr, "iovcapacity must be between 2 and 4096.\n");
+            return -1;
+        }
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value, "workermem")) {
+        if (parse_size_option((char *)value->data.scalar.value,
+                              &size) != 0) {
+            fprintf(stderr, "Not a viable option 'workermem': %s.\n",
+                (char *)value->data.scalar.value);
+            return -1;
+        }
+        glob->workermem = size;
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value, "hugepages")) {
+        if (parse_onoff_option((char *)value->data.scalar.value,
+                               &glob->hugepages) != 0) {
+            fprintf(stderr, "Not a viable option 'hugepages': %s.\n",
+                (char *)value->data.scalar.value);
+            return -1;
+        }
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value,
+                     "experimentalcompress")) {
+        if (parse_onoff_option((char *)value->data.scalar.value,
+                               &glob->experimentalcompress) != 0) {
+            fprintf(stderr, "Not a viable option 'experimentalcompress': "
+                "%s.\n", (char *)value->data.scalar.value);
+            return -1;
+        }
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value, "dedupwindow")) {
+        glob->dedupwindow = (uint32_t) strtoul(
+                (char *)value->data.scalar.value, NULL, 10);
+        if (glob->dedupwindow > DAG_DEDUP_MAX_WINDOW) {
+            fprintf(stderr, "dedupwindow must be at most %d microseconds.\n",
+                DAG_DEDUP_MAX_WINDOW);
+            return -1;
+        }
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value, "blocklistsize")) {
+        glob->blocklistsize = (uint32_t) strtoul(
+                (char *)value->data.scalar.value, NULL, 10);
+        if (glob->blocklistsize == 0 ||
+                glob->blocklistsize > BLOCKLIST_MAX_SIZE) {
+            fprintf(stderr, "blocklistsize must be between 1 and %d.\n",
+                BLOCKLIST_MAX_SIZE);
+            return -1;
+        }
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value, "streamcpus")) {
+        if (cpulist_parse((char *)value->data.scalar.value,
+                          &glob->streamcpus) != 0) {
+            return -1;
+        }
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value, "txcpus")) {
+        if (cpulist_parse((char *)value->data.scalar.value,
+                          &glob->txcpus) != 0) {
+            return -1;
+        }
+    }
+
+    else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                 && !strcmp((char *)key->data.scalar.value,
+                     "housekeepingcpus")) {
+        if (cpulist_parse((char *)value->data.scalar.value,
+                          &glob->housekeepingcpus) != 0) {
+            return -1;
+        }
+        if (glob->housekeepingcpus.cnt == 0) {
+            fprintf(stderr, "Housekeeping threads need at least one CPU.\n");
+            return -1;
+        }
+    }
+
     else if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
                  && !strcmp((char *)key->data.scalar.value, "darknetoctet")) {
         glob->darknetoctet= atoi((char *)value->data.scalar.value);
@@ -290,6 +882,36 @@ static int parse_option(telescope_global_t *glob, yaml_document_t *doc,
         glob->torrentcount = torrentcount;
     }
 
+    if (key->type == YAML_SCALAR_NODE && value->type == YAML_SEQUENCE_NODE
+            && !strcmp((char *)key->data.scalar.value, "erffiles")) {
+        if (parse_erf_files(glob, doc, value) < 0) {
+            return -1;
+        }
+    }
+
+    if (key->type == YAML_SCALAR_NODE && value->type == YAML_SEQUENCE_NODE
+            && !strcmp((char *)key->data.scalar.value, "darknets")) {
+        if (parse_darknets(doc, value, "darknets", &glob->darknets,
+                           &glob->darknetcnt) < 0) {
+            return -1;
+        }
+    }
+
+    if (key->type == YAML_SCALAR_NODE && value->type == YAML_SEQUENCE_NODE
+            && !strcmp((char *)key->data.scalar.value, "darknet6")) {
+        if (parse_darknets(doc, value, "darknet6", &glob->darknet6,
+                           &glob->darknet6cnt) < 0) {
+            return -1;
+        }
+    }
+
+    if (key->type == YAML_SCALAR_NODE && value->type == YAML_SEQUENCE_NODE
+            && !strcmp((char *)key->data.scalar.value, "streams")) {
+        if (parse_streams(glob, doc, value) < 0) {
+            return -1;
+        }
+    }
+
     return 1;
 }
 
@@ -359,6 +981,8 @@ yamlfail:
 
 telescope_global_t *telescope_init_global(char *configfile) {
     telescope_global_t *glob = NULL;
+    torrent_t *itr;
+    int i;
 
     if (configfile == NULL) {
         return NULL;
@@ -372,9 +996,48 @@ telescope_global_t *telescope_init_global(char *configfile) {
 
     /* Initialization. */
     glob->dagdev = NULL;
+    glob->capture.type = NULL;
+    glob->capture.device = NULL;
+    glob->capture.files = NULL;
+    glob->capture.filecnt = 0;
+    glob->capture.speed = 1.0;
+    glob->capture.loops = 1;
+    glob->capture.interface = NULL;
+    glob->capture.fanout = 1;
+    glob->capture.queues = 1;
+    glob->capture.xdpmode = NULL;
+    glob->capture.softfanout = 1;
     glob->statdir = NULL;
     glob->darknetoctet = -1;
+    glob->darknets = NULL;
+    glob->darknetcnt = 0;
+    glob->darknet6 = NULL;
+    glob->darknet6cnt = 0;
     glob->statinterval = 0;
+    glob->poll.adaptive = 1;
+    glob->poll.mindata = DAG_POLL_MINDATA;
+    glob->poll.maxwait = DAG_POLL_MAXWAIT;
+    glob->poll.pollfreq = DAG_POLL_FREQ;
+    glob->poll.maxlatency = DAG_POLL_MAXWAIT;
+    glob->poll.targetfill = DAG_POLL_TARGETFILL;
+    glob->streamspercore = 1;
+    glob->pipeline = 0;
+    glob->pipelinedepth = TXPIPELINE_DEFAULT_DEPTH;
+    glob->attachwindow = DAG_ATTACH_WINDOW;
+    glob->iovcapacity = DAG_IOV_CAPACITY;
+    glob->workermem = DAG_WORKER_MEM;
+    glob->hugepages = 1;
+    glob->dedupwindow = 0;
+    glob->blocklistsize = BLOCKLIST_DEFAULT_SIZE;
+    glob->experimentalcompress = 0;
+    glob->streamcpus.cpus = NULL;
+    glob->streamcpus.cnt = 0;
+    glob->txcpus.cpus = NULL;
+    glob->txcpus.cnt = 0;
+    glob->housekeepingcpus.cpus = NULL;
+    glob->housekeepingcpus.cnt = 0;
+    glob->streamcnt = 0;
+    glob->streams = NULL;
     glob->torrentcount = 0;
     glob->torrents = NULL;
 
@@ -388,6 +1051,37 @@ telescope_global_t *telescope_init_global(char *configfile) {
     if (glob->dagdev == NULL) {
         glob->dagdev = strdup("/dev/dag0");
     }
+    glob->capture.device = glob->dagdev;
+    if (glob->housekeepingcpus.cnt == 0 &&
+            cpulist_parse("0", &glob->housekeepingcpus) != 0) {
+        telescope_cleanup_global(glob);
+        return NULL;
+    }
+    for (i = 0; i < glob->streamcnt; ++i) {
+        pollctl_merge_params(&glob->streams[i].poll, &glob->poll);
+    }
+
+    /* Compressed datagrams are not part of the nDAG protocol, so they must
+     * be asked for knowing that the receivers read them. */
+    for (itr = glob->torrents; itr != NULL; itr = itr->next) {
+#ifndef HAVE_LZ4
+        if (itr->compressflag) {
+            fprintf(stderr, "Sink %s has 'compress' set, but the telescope "
+                    "was built without liblz4.\n",
+                    itr->name ? itr->name : "(unnamed)");
+            telescope_cleanup_global(glob);
+            return NULL;
+        }
+#endif
+        if (itr->compressflag && !glob->experimentalcompress) {
+            fprintf(stderr, "Sink %s has 'compress' set, but nDAG receivers "
+                    "only read compressed datagrams if they were extended "
+                    "for them. Set 'experimentalcompress: yes' if they "
+                    "were.\n", itr->name ? itr->name : "(unnamed)");
+            telescope_cleanup_global(glob);
+            return NULL;
+        }
+    }
 
     /* All done. */
     return glob;
@@ -410,6 +1104,18 @@ void telescope_cleanup_torrent(torrent_t *torr) {
         free(torr->filterfile);
     }
 
+    if (torr->filterfile6) {
+        free(torr->filterfile6);
+    }
+
+    if (torr->rulefile) {
+        free(torr->rulefile);
+    }
+
+    if (torr->blocklist) {
+        free(torr->blocklist);
+    }
+
     if (torr->name) {
         free(torr->name);
     }
@@ -418,6 +1124,8 @@ void telescope_cleanup_torrent(torrent_t *torr) {
 }
 
 void telescope_cleanup_global(telescope_global_t *glob) {
+    int i;
+
     /* Clean up torrent list. */
     torrent_t *itr = glob->torrents;
     while (itr != NULL) {
@@ -439,6 +1147,47 @@ void telescope_cleanup_global(telescope_global_t *glob) {
         free(glob->statdir);
     }
 
+    if (glob->capture.type) {
+        free(glob->capture.type);
+    }
+
+    if (glob->capture.interface) {
+        free(glob->capture.interface);
+    }
+
+    if (glob->capture.xdpmode) {
+        free(glob->capture.xdpmode);
+    }
+
+    if (glob->streams) {
+        free(glob->streams);
+    }
+
+    cpulist_free(&glob->streamcpus);
+    cpulist_free(&glob->txcpus);
+    cpulist_free(&glob->housekeepingcpus);
+
+    if (glob->capture.files) {
+        for (i = 0; i < glob->capture.filecnt; ++i) {
+            free(glob->capture.files[i]);
+        }
+        free(glob->capture.files);
+    }
+
+    if (glob->darknets) {
+        for (i = 0; i < glob->darknetcnt; ++i) {
+            free(glob->darknets[i]);
+        }
+        free(glob->darknets);
+    }
+
+    if (glob->darknet6) {
+        for (i = 0; i < glob->darknet6cnt; ++i) {
+            free(glob->darknet6[i]);
+        }
+        free(glob->darknet6);
+    }
+
     free(glob);
 }
 
@@ -0,0 +1,130 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "cpulist.h"
+
+static int cpulist_add(cpulist_t *list, int cpu) {
+    int *cpus;
+
+    if (cpulist_contains(list, cpu)) {
+        return 0;
+    }
+    cpus = (int *)realloc(list->cpus, sizeof(int) * (list->cnt + 1));
+    if (cpus == NULL) {
+        fprintf(stderr, "Failed to allocate memory for CPU list\n");
+        return -1;
+    }
+    cpus[list->cnt++] = cpu;
+    list->cpus = cpus;
+    return 0;
+}
+
+int cpulist_parse(const char *str, cpulist_t *list) {
+    const char *ptr = str;
+    char *end;
+    long first, last, cpu;
+
+    cpulist_free(list);
+
+    while (*ptr != '\0') {
+        first = strtol(ptr, &end, 10);
+        if (end == ptr || first < 0) {
+            goto parsefail;
+        }
+        last = first;
+        ptr = end;
+        if (*ptr == '-') {
+            ptr++;
+            last = strtol(ptr, &end, 10);
+            if (end == ptr || last < first) {
+                goto parsefail;
+            }
+            ptr = end;
+        }
+        if (last >= CPU_SETSIZE) {
+            goto parsefail;
+        }
+        for (cpu = first; cpu <= last; ++cpu) {
+            if (cpulist_add(list, cpu) != 0) {
+                cpulist_free(list);
+                return -1;
+            }
+        }
+
+        while (*ptr == ' ') {
+            ptr++;
+        }
+        if (*ptr == ',') {
+            ptr++;
+        } else if (*ptr != '\0') {
+            goto parsefail;
+        }
+    }
+    return 0;
+
+parsefail:
+    fprintf(stderr, "Invalid CPU list: %s\n", str);
+    cpulist_free(list);
+    return -1;
+}
+
+void cpulist_free(cpulist_t *list) {
+    free(list->cpus);
+    list->cpus = NULL;
+    list->cnt = 0;
+}
+
+int cpulist_contains(const cpulist_t *list, int cpu) {
+    int i;
+
+    for (i = 0; i < list->cnt; ++i) {
+        if (list->cpus[i] == cpu) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void cpulist_format(const cpulist_t *list, char *buf, size_t len) {
+    size_t used = 0;
+    int i;
+
+    if (list->cnt == 0) {
+        snprintf(buf, len, "any");
+        return;
+    }
+    buf[0] = '\0';
+    for (i = 0; i < list->cnt && used < len; ++i) {
+        used += snprintf(buf + used, len - used, "%s%d", i ? "," : "",
+                list->cpus[i]);
+    }
+}
+
+int cpulist_thread_create(pthread_t *tid, const cpulist_t *list,
+        void *(*func)(void *), void *data) {
+    int ret;
+#ifdef __linux__
+    pthread_attr_t attrib;
+    cpu_set_t cpus;
+    int i;
+
+    pthread_attr_init(&attrib);
+    if (list->cnt > 0) {
+        CPU_ZERO(&cpus);
+        for (i = 0; i < list->cnt; ++i) {
+            CPU_SET(list->cpus[i], &cpus);
+        }
+        pthread_attr_setaffinity_np(&attrib, sizeof(cpus), &cpus);
+    }
+    ret = pthread_create(tid, &attrib, func, data);
+    pthread_attr_destroy(&attrib);
+#else
+    ret = pthread_create(tid, NULL, func, data);
+#endif
+    return ret;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
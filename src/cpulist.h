@@ -0,0 +1,27 @@
+#ifndef CPULIST_H_
+#define CPULIST_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* A list of CPUs, written as in /sys/devices/system/cpu, e.g. "0-3,8". */
+typedef struct cpulist {
+    int *cpus;
+    int cnt;
+} cpulist_t;
+
+int cpulist_parse(const char *str, cpulist_t *list);
+void cpulist_free(cpulist_t *list);
+int cpulist_contains(const cpulist_t *list, int cpu);
+
+/* Write the list back out for logging. Empty lists are written as "any". */
+void cpulist_format(const cpulist_t *list, char *buf, size_t len);
+
+/* Create a thread that may run on any CPU in the list, or anywhere if the
+ * list is empty. */
+int cpulist_thread_create(pthread_t *tid, const cpulist_t *list,
+        void *(*func)(void *), void *data);
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <dagapi.h>
+#include <dag_config_api.h>
+
+#include "capture.h"
+
+/* Every stream is attached through its own handle on the card, so streams
+ * can be attached and started from their worker threads at the same time
+ * rather than one after the other through the handle of the source. The
+ * memory node of each stream is read once when the card is opened, as
+ * looking it up means loading the card configuration. */
+typedef struct dag_capture {
+    int *memnodes;
+    int streamcnt;
+} dag_capture_t;
+
+static int load_memnodes(capture_source_t *src, dag_capture_t *dag) {
+    dag_card_ref_t cardref = NULL;
+    dag_component_t root = NULL;
+    dag_component_t streamconf = NULL;
+    attr_uuid_t any;
+    void *ptr;
+    int i;
+
+    dag->streamcnt = dag_rx_get_stream_count(src->fd);
+    if (dag->streamcnt < 0) {
+        return -1;
+    }
+    dag->memnodes = (int *)malloc(sizeof(int) *
+            (dag->streamcnt > 0 ? dag->streamcnt : 1));
+    if (dag->memnodes == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    cardref = dag_config_init(src->opts->device);
+    if (cardref == NULL) {
+        for (i = 0; i < dag->streamcnt; ++i) {
+            dag->memnodes[i] = -1;
+        }
+        return 0;
+    }
+    root = dag_config_get_root_component(cardref);
+
+    for (i = 0; i < dag->streamcnt; ++i) {
+        dag->memnodes[i] = -1;
+        streamconf = dag_component_get_subcomponent(root, kComponentStream,
+                i * 2);
+        if (streamconf == NULL) {
+            continue;
+        }
+        any = dag_component_get_attribute_uuid(streamconf,
+                kStructAttributeMemNode);
+        if (dag_config_get_struct_attribute(cardref, any, &ptr) == 0) {
+            dag->memnodes[i] = ((mem_node_t *)ptr)->node;
+        }
+    }
+
+    dag_config_dispose(cardref);
+    return 0;
+}
+
+static void dag_capture_close(capture_source_t *src);
+
+static int dag_capture_open(capture_source_t *src) {
+    char *devname = src->opts->device;
+    dag_capture_t *dag;
+
+    fprintf(stderr, "Attempting to open DAG device: %s\n", devname);
+
+    src->fd = dag_open(devname);
+    if (src->fd < 0) {
+        fprintf(stderr, "Failed to open DAG device: %s\n", strerror(errno));
+        return -1;
+    }
+
+    dag = (dag_capture_t *)calloc(1, sizeof(dag_capture_t));
+    if (dag == NULL) {
+        fprintf(stderr, "Failed to allocate memory for DAG device state\n");
+        dag_capture_close(src);
+        return -1;
+    }
+    src->data = dag;
+
+    if (load_memnodes(src, dag) != 0) {
+        fprintf(stderr, "Failed to read stream configuration of DAG device "
+                "%s: %s\n", devname, strerror(errno));
+        dag_capture_close(src);
+        return -1;
+    }
+    return 0;
+}
+
+static void dag_capture_close(capture_source_t *src) {
+    dag_capture_t *dag = (dag_capture_t *)src->data;
+
+    if (dag) {
+        free(dag->memnodes);
+        free(dag);
+        src->data = NULL;
+    }
+    if (src->fd >= 0) {
+        dag_close(src->fd);
+        src->fd = -1;
+    }
+}
+
+static int dag_capture_stream_count(capture_source_t *src) {
+    return ((dag_capture_t *)src->data)->streamcnt;
+}
+
+static int dag_capture_memnode(capture_source_t *src, int streamnum) {
+    dag_capture_t *dag = (dag_capture_t *)src->data;
+
+    if (streamnum / 2 >= dag->streamcnt) {
+        return -1;
+    }
+    return dag->memnodes[streamnum / 2];
+}
+
+static int64_t dag_capture_stream_size(capture_source_t *src, int streamnum) {
+    return dag_get_stream_buffer_size64(src->fd, streamnum);
+}
+
+/* Handle a stream is attached through, stored in the stream data. */
+static inline int stream_fd(capture_stream_t *cs) {
+    return *(int *)cs->data;
+}
+
+static int dag_capture_attach(capture_stream_t *cs, uint32_t window) {
+    int *fd, err;
+
+    fd = (int *)malloc(sizeof(int));
+    if (fd == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    *fd = dag_open(cs->src->opts->device);
+    if (*fd < 0) {
+        err = errno;
+        free(fd);
+        errno = err;
+        return -1;
+    }
+    if (dag_attach_stream64(*fd, cs->streamnum, 0, window) != 0) {
+        err = errno;
+        dag_close(*fd);
+        free(fd);
+        errno = err;
+        return -1;
+    }
+    cs->data = fd;
+    return 0;
+}
+
+static int64_t dag_capture_buffer_size(capture_stream_t *cs) {
+    return dag_get_stream_buffer_size64(stream_fd(cs), cs->streamnum);
+}
+
+static int dag_capture_set_poll(capture_stream_t *cs, uint32_t mindata,
+        struct timeval *maxwait, struct timeval *poll) {
+    return dag_set_stream_poll64(stream_fd(cs), cs->streamnum, mindata,
+            maxwait, poll);
+}
+
+static int dag_capture_start(capture_stream_t *cs) {
+    return dag_start_stream(stream_fd(cs), cs->streamnum);
+}
+
+static uint8_t *dag_capture_advance(capture_stream_t *cs, uint8_t **bottom) {
+    return dag_advance_stream(stream_fd(cs), cs->streamnum, bottom);
+}
+
+static int dag_capture_stop(capture_stream_t *cs) {
+    return dag_stop_stream(stream_fd(cs), cs->streamnum);
+}
+
+static int dag_capture_detach(capture_stream_t *cs) {
+    int ret;
+
+    if (cs->data == NULL) {
+        return 0;
+    }
+    ret = dag_detach_stream(stream_fd(cs), cs->streamnum);
+    dag_close(stream_fd(cs));
+    free(cs->data);
+    cs->data = NULL;
+    return ret;
+}
+
+const capture_ops_t dag_capture_ops = {
+    .name = "dag",
+    .concurrent = 1,
+    .open = dag_capture_open,
+    .close = dag_capture_close,
+    .stream_count = dag_capture_stream_count,
+    .memnode = dag_capture_memnode,
+    .stream_size = dag_capture_stream_size,
+    .attach = dag_capture_attach,
+    .buffer_size = dag_capture_buffer_size,
+    .set_poll = dag_capture_set_poll,
+    .start = dag_capture_start,
+    .advance = dag_capture_advance,
+    .stop = dag_capture_stop,
+    .detach = dag_capture_detach,
+};
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sched.h>
 #include <signal.h>
 #include <assert.h>
 #include <sys/socket.h>
@@ -11,8 +12,6 @@
 #include <netdb.h>
 
 #include <pthread.h>
-#include <dagapi.h>
-#include <dag_config_api.h>
 #include <libtrace.h>
 #include <numa.h>
 
@@ -20,7 +19,9 @@
 
 #include "byteswap.h"
 #include "dagmultiplexer.h"
+#include "erf.h"
 #include "ndagmulticaster.h"
+#include "txpipeline.h"
 
 volatile int halted = 0;
 volatile int paused = 0;
@@ -56,92 +57,203 @@ static int get_nb_cores() {
         return numCPU <= 0 ? 1 : numCPU;
 }
 
-static int get_next_thread_cpu(char *dagdevname, uint8_t *cpumap,
-        uint16_t streamnum) {
+static int numa_usable(void) {
+    static int usable = -1;
 
-    int i, cpuid = -1;
-    dag_card_ref_t cardref = NULL;
-    dag_component_t root = NULL;
-    dag_component_t streamconf = NULL;
-    attr_uuid_t any;
-    void *ptr;
-    mem_node_t *meminfo;
-
-    cardref = dag_config_init(dagdevname);
-    root = dag_config_get_root_component(cardref);
-    streamconf = dag_component_get_subcomponent(root, kComponentStream,
-            streamnum);
+    if (usable < 0) {
+        usable = numa_available() >= 0;
+    }
+    return usable;
+}
 
-    any = dag_component_get_attribute_uuid(streamconf,
-            kStructAttributeMemNode);
+void *dag_alloc_onnode(size_t size, int node) {
+    if (!numa_usable()) {
+        return calloc(1, size);
+    }
+    /* Fresh pages from libnuma are already zeroed. */
+    if (node < 0) {
+        return numa_alloc_local(size);
+    }
+    return numa_alloc_onnode(size, node);
+}
 
-    if (dag_config_get_struct_attribute(cardref, any, &ptr) != 0) {
-        cpuid = -1;
-        goto endcpucheck;
+void dag_free_onnode(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (!numa_usable()) {
+        free(ptr);
+        return;
     }
+    numa_free(ptr, size);
+}
 
-    meminfo = (mem_node_t *)ptr;
+/* Pick a free core for a thread of a stream. With a CPU list, only cores on
+ * the list are used, preferring those on the node of the stream's memory.
+ * Otherwise any core on that node will do, except for the reserved ones. */
+static int get_next_thread_cpu(capture_source_t *src, uint8_t *cpumap,
+        uint16_t streamnum, const cpulist_t *cpus,
+        const cpulist_t *reserved) {
+
+    int i, cpu, pass;
+    int nbcores = get_nb_cores();
+    int node = capture_memnode(src, streamnum);
+
+    if (cpus->cnt > 0) {
+        for (pass = 0; pass < 2; ++pass) {
+            for (i = 0; i < cpus->cnt; ++i) {
+                cpu = cpus->cpus[i];
+                if (cpu >= nbcores || cpumap[cpu] != 0) {
+                    continue;
+                }
+                if (pass == 0 && node >= 0 && numa_node_of_cpu(cpu) != node) {
+                    continue;
+                }
+                cpumap[cpu] = 1;
+                return cpu;
+            }
+        }
+        return -1;
+    }
 
-    for (i = 1; i < get_nb_cores(); i++) {
-        if (numa_node_of_cpu(i) == meminfo->node && cpumap[i] == 0) {
+    /* A negative node means the stream memory is not tied to a node. */
+    for (i = 0; i < nbcores; i++) {
+        if (cpulist_contains(reserved, i)) {
+            continue;
+        }
+        if ((node < 0 || numa_node_of_cpu(i) == node) && cpumap[i] == 0) {
             cpumap[i] = 1;
-            cpuid = i;
-            goto endcpucheck;
+            return i;
         }
     }
 
-endcpucheck:
-    dag_config_dispose(cardref);
-    return cpuid;
+    return -1;
 }
 
-int init_dag_stream(dagstreamthread_t *dst) {
+static int set_stream_poll(dagstreamthread_t *dst) {
     struct timeval maxwait, poll;
-    dag_size_t mindata;
+    uint32_t mindata;
+    capture_stream_t *cs = &dst->capture;
+    pollctl_t *pc = &dst->pollctl;
+
+    maxwait.tv_sec = pc->maxwait / 1000000;
+    maxwait.tv_usec = pc->maxwait % 1000000;
+    poll.tv_sec = pc->pollfreq / 1000000;
+    poll.tv_usec = pc->pollfreq % 1000000;
+    mindata = pc->mindata;
+
+    /* Don't let one stream block the others on a shared worker. */
+    if (dst->shared) {
+        mindata = 0;
+        timerclear(&maxwait);
+    }
 
-    /* Set polling parameters.
-     * TODO: are these worth making configurable?
-     * Currently defined in dagmultiplexer.h.
+    if (cs->src->ops->set_poll(cs, mindata, &maxwait, &poll) != 0) {
+        return -1;
+    }
+
+    dst->stats.poll_mindata = pc->mindata;
+    dst->stats.poll_maxwait = pc->maxwait;
+    dst->stats.poll_freq = pc->pollfreq;
+    return 0;
+}
+
+/* Let the poll controller look at what happened since its last update and
+ * apply new polling parameters if it picked any. */
+static void update_stream_poll(dagstreamthread_t *dst, struct timeval *now) {
+    uint64_t dgrambytes = 0, dgramcap = 0;
+    uint32_t batchbytes = 0;
+    int i, changed;
+
+    for (i = 0; i < dst->inuse; ++i) {
+        dgrambytes += dst->stats.sinks[i].tx_bytes;
+        dgramcap += dst->stats.sinks[i].tx_datagrams *
+                (dst->iovs[i].maxsize + ENCAP_OVERHEAD);
+        /* One wakeup never sends more than a batch per sink. */
+        if (dst->iovs[i].maxsize * NDAG_BATCH_SIZE > batchbytes) {
+            batchbytes = dst->iovs[i].maxsize * NDAG_BATCH_SIZE;
+        }
+    }
+
+    changed = pollctl_update(&dst->pollctl, now, dst->stats.walked_bytes,
+            dgrambytes, dgramcap, dst->stats.dropped_records, batchbytes);
+    dst->stats.poll_rate = dst->pollctl.rate;
+    dst->stats.poll_fill = dst->pollctl.fill;
+    if (!changed) {
+        return;
+    }
+
+    if (set_stream_poll(dst) != 0) {
+        fprintf(stderr, "Failed to update polling parameters for DAG stream %d: %s\n",
+                dst->params.streamnum, strerror(errno));
+        return;
+    }
+    dst->stats.poll_adjustments++;
+}
+
+/* Backends that cannot attach and start streams from several threads at
+ * once are serialised through the mutex shared by all streams. */
+static inline void lock_capture(dagstreamthread_t *dst) {
+    if (!dst->capture.src->ops->concurrent) {
+        pthread_mutex_lock(dst->dagmutex);
+    }
+}
+
+static inline void unlock_capture(dagstreamthread_t *dst) {
+    if (!dst->capture.src->ops->concurrent) {
+        pthread_mutex_unlock(dst->dagmutex);
+    }
+}
+
+int init_dag_stream(dagstreamthread_t *dst) {
+    struct timeval now, done;
+    capture_stream_t *cs = &dst->capture;
+    int ret = -1;
+
+    /* Set initial polling parameters. If the stream is configured to be
+     * adaptive, these will be re-tuned by the poll controller from within
+     * dag_stream_loop().
      */
-    mindata = DAG_POLL_MINDATA;
-    maxwait.tv_sec = 0;
-    maxwait.tv_usec = DAG_POLL_MAXWAIT;
-    poll.tv_sec = 0;
-    poll.tv_usec = DAG_POLL_FREQ;
-
-    pthread_mutex_lock(dst->dagmutex);
-    if (dag_attach_stream64(dst->params.dagfd,
-            dst->params.streamnum, 0, 8 * 1024 * 1024) != 0) {
+    gettimeofday(&now, NULL);
+    pollctl_init(&dst->pollctl, &dst->params.poll, &now);
+
+    lock_capture(dst);
+    if (cs->src->ops->attach(cs, dst->params.attachwindow) != 0) {
         if (errno == ENOMEM) {
-            pthread_mutex_unlock(dst->dagmutex);
-            return 0;
+            ret = 0;
+            goto initstreamdone;
         }
 
         fprintf(stderr, "Failed to attach to DAG stream %d: %s\n",
                 dst->params.streamnum, strerror(errno));
-        pthread_mutex_unlock(dst->dagmutex);
-        return -1;
+        goto initstreamdone;
     }
 
-    if (dag_set_stream_poll64(dst->params.dagfd, dst->params.streamnum,
-            mindata, &maxwait, &poll) != 0) {
+    if (set_stream_poll(dst) != 0) {
         fprintf(stderr, "Failed to set polling parameters for DAG stream %d: %s\n",
                 dst->params.streamnum, strerror(errno));
-        pthread_mutex_unlock(dst->dagmutex);
-        return -1;
+        goto initstreamdone;
     }
 
     /* Start stream. */
-    if (dag_start_stream(dst->params.dagfd, dst->params.streamnum) != 0) {
+    if (cs->src->ops->start(cs) != 0) {
         fprintf(stderr, "Failed to start DAG stream %d: %s\n",
                 dst->params.streamnum, strerror(errno));
-        pthread_mutex_unlock(dst->dagmutex);
-        return -1;
+        goto initstreamdone;
     }
 
-    pthread_mutex_unlock(dst->dagmutex);
     dst->streamstarted = 1;
-    return 0;
+    ret = 0;
+
+initstreamdone:
+    unlock_capture(dst);
+    gettimeofday(&done, NULL);
+    timersub(&done, &now, &dst->attachtime);
+    return ret;
+}
+
+void dag_worker_started(dagworker_t *worker) {
+    __atomic_store_n(&worker->started, 1, __ATOMIC_RELEASE);
 }
 
 int init_dag_sink(ndag_encap_params_t *state, streamsink_t *params, int streamnum,
@@ -159,13 +271,15 @@ int init_dag_sink(ndag_encap_params_t *state, streamsink_t *params, int streamnu
     }
 
     ndag_init_encap(state, sock, targetinfo, params->monitorid, streamnum,
-        globalstart, params->mtu, NDAG_PKT_ENCAPERF, 0);
+        globalstart, params->mtu, params->compressflag ?
+        NDAG_PKT_ENCAPERF_LZ4 : NDAG_PKT_ENCAPERF, 0);
     return sock;
 }
 
 static inline void log_stats(dagstreamthread_t *dst, struct timeval now) {
     iow_t *logf = NULL;
     char buf[1024];
+    dgramcompress_t *comp;
     int i;
 
     if (dst->params.statdir) {
@@ -187,8 +301,21 @@ static inline void log_stats(dagstreamthread_t *dst, struct timeval now) {
                  "filtered_out_records %"PRIu64"\n"
                  "filtered_out_bytes %"PRIu64"\n"
                  "filtered_out_wire_bytes %"PRIu64"\n"
+                 "sampled_out_records %"PRIu64"\n"
+                 "sampled_out_bytes %"PRIu64"\n"
+                 "sampled_out_wire_bytes %"PRIu64"\n"
                  "dropped_records %"PRIu64"\n"
-                 "truncated_records %"PRIu64"\n",
+                 "truncated_records %"PRIu64"\n"
+                 "suppressed_records %"PRIu64"\n"
+                 "suppressed_bytes %"PRIu64"\n"
+                 "poll_mindata %"PRIu32"\n"
+                 "poll_maxwait %"PRIu32"\n"
+                 "poll_freq %"PRIu32"\n"
+                 "poll_rate %"PRIu64"\n"
+                 "poll_fill %"PRIu32"\n"
+                 "poll_adjustments %"PRIu64"\n"
+                 "pipeline_batches %"PRIu64"\n"
+                 "pipeline_stalls %"PRIu64"\n",
                  (int)now.tv_sec,
                  dst->params.statinterval,
                  dst->params.streamnum,
@@ -199,14 +326,36 @@ static inline void log_stats(dagstreamthread_t *dst, struct timeval now) {
                  dst->stats.filtered_out.tx_records,
                  dst->stats.filtered_out.tx_bytes,
                  dst->stats.filtered_out.tx_wbytes,
+                 dst->stats.sampled_out.tx_records,
+                 dst->stats.sampled_out.tx_bytes,
+                 dst->stats.sampled_out.tx_wbytes,
                  dst->stats.dropped_records,
-                 dst->stats.truncated_records);
+                 dst->stats.truncated_records,
+                 dst->stats.suppressed_records,
+                 dst->stats.suppressed_bytes,
+                 dst->stats.poll_mindata,
+                 dst->stats.poll_maxwait,
+                 dst->stats.poll_freq,
+                 dst->stats.poll_rate,
+                 dst->stats.poll_fill,
+                 dst->stats.poll_adjustments,
+                 dst->stats.pipeline_batches,
+                 dst->stats.pipeline_stalls);
         for (i = 0; i < dst->inuse; ++i) {
+            comp = dst->compress[i];
             wandio_printf(logf,
                  "sink=%s tx_datagrams %"PRIu64"\n"
                  "sink=%s tx_records %"PRIu64"\n"
                  "sink=%s tx_bytes %"PRIu64"\n"
-                 "sink=%s tx_wire_bytes %"PRIu64"\n",
+                 "sink=%s tx_wire_bytes %"PRIu64"\n"
+                 "sink=%s tx_iovecs %"PRIu64"\n"
+                 "sink=%s tx_copied_bytes %"PRIu64"\n"
+                 "sink=%s tx_referenced_bytes %"PRIu64"\n"
+                 "sink=%s tx_saved_bytes %"PRIu64"\n"
+                 "sink=%s sampled_out_records %"PRIu64"\n"
+                 "sink=%s tx_compress_raw_bytes %"PRIu64"\n"
+                 "sink=%s tx_compressed_bytes %"PRIu64"\n"
+                 "sink=%s compress_usecs %"PRIu64"\n",
                  dst->stats.sinks[i].name,
                  dst->stats.sinks[i].tx_datagrams,
                  dst->stats.sinks[i].name,
@@ -214,7 +363,23 @@ static inline void log_stats(dagstreamthread_t *dst, struct timeval now) {
                  dst->stats.sinks[i].name,
                  dst->stats.sinks[i].tx_bytes,
                  dst->stats.sinks[i].name,
-                 dst->stats.sinks[i].tx_wbytes);
+                 dst->stats.sinks[i].tx_wbytes,
+                 dst->stats.sinks[i].name,
+                 dst->stats.sinks[i].tx_iovecs,
+                 dst->stats.sinks[i].name,
+                 dst->stats.sinks[i].tx_copied_bytes,
+                 dst->stats.sinks[i].name,
+                 dst->stats.sinks[i].tx_referenced_bytes,
+                 dst->stats.sinks[i].name,
+                 dst->stats.sinks[i].tx_saved_bytes,
+                 dst->stats.sinks[i].name,
+                 dst->stats.sinks[i].sampled_out_records,
+                 dst->stats.sinks[i].name,
+                 comp ? comp->rawbytes : 0,
+                 dst->stats.sinks[i].name,
+                 comp ? comp->compressedbytes : 0,
+                 dst->stats.sinks[i].name,
+                 comp ? comp->nsecs / 1000 : 0);
         }
         wandio_wdestroy(logf);
     } else {
@@ -227,8 +392,21 @@ static inline void log_stats(dagstreamthread_t *dst, struct timeval now) {
                 "filtered_out_records %"PRIu64" "
                 "filtered_out_bytes %"PRIu64" "
                 "filtered_out_wire_bytes %"PRIu64" "
+                "sampled_out_records %"PRIu64" "
+                "sampled_out_bytes %"PRIu64" "
+                "sampled_out_wire_bytes %"PRIu64" "
                 "dropped_records:%"PRIu64" "
-                "truncated_records %"PRIu64"\n",
+                "truncated_records %"PRIu64" "
+                "suppressed_records %"PRIu64" "
+                "suppressed_bytes %"PRIu64" "
+                "poll_mindata:%"PRIu32" "
+                "poll_maxwait:%"PRIu32" "
+                "poll_freq:%"PRIu32" "
+                "poll_rate:%"PRIu64" "
+                "poll_fill:%"PRIu32" "
+                "poll_adjustments:%"PRIu64" "
+                "pipeline_batches:%"PRIu64" "
+                "pipeline_stalls:%"PRIu64"\n",
                 (int)now.tv_sec,
                 dst->params.streamnum,
                 dst->stats.walked_buffers,
@@ -238,14 +416,36 @@ static inline void log_stats(dagstreamthread_t *dst, struct timeval now) {
                 dst->stats.filtered_out.tx_records,
                 dst->stats.filtered_out.tx_bytes,
                 dst->stats.filtered_out.tx_wbytes,
+                dst->stats.sampled_out.tx_records,
+                dst->stats.sampled_out.tx_bytes,
+                dst->stats.sampled_out.tx_wbytes,
                 dst->stats.dropped_records,
-                dst->stats.truncated_records);
+                dst->stats.truncated_records,
+                dst->stats.suppressed_records,
+                dst->stats.suppressed_bytes,
+                dst->stats.poll_mindata,
+                dst->stats.poll_maxwait,
+                dst->stats.poll_freq,
+                dst->stats.poll_rate,
+                dst->stats.poll_fill,
+                dst->stats.poll_adjustments,
+                dst->stats.pipeline_batches,
+                dst->stats.pipeline_stalls);
         for (i = 0; i < dst->inuse; ++i) {
+            comp = dst->compress[i];
             fprintf(stderr,
                  "%s_tx_datagrams %"PRIu64"\n"
                  "%s_tx_records %"PRIu64"\n"
                  "%s_tx_bytes %"PRIu64"\n"
-                 "%s_tx_wire_bytes %"PRIu64"\n",
+                 "%s_tx_wire_bytes %"PRIu64"\n"
+                 "%s_tx_iovecs %"PRIu64"\n"
+                 "%s_tx_copied_bytes %"PRIu64"\n"
+                 "%s_tx_referenced_bytes %"PRIu64"\n"
+                 "%s_tx_saved_bytes %"PRIu64"\n"
+                 "%s_sampled_out_records %"PRIu64"\n"
+                 "%s_tx_compress_raw_bytes %"PRIu64"\n"
+                 "%s_tx_compressed_bytes %"PRIu64"\n"
+                 "%s_compress_usecs %"PRIu64"\n",
                  dst->stats.sinks[i].name,
                  dst->stats.sinks[i].tx_datagrams,
                  dst->stats.sinks[i].name,
@@ -253,116 +453,286 @@ static inline void log_stats(dagstreamthread_t *dst, struct timeval now) {
                  dst->stats.sinks[i].name,
                  dst->stats.sinks[i].tx_bytes,
                  dst->stats.sinks[i].name,
-                 dst->stats.sinks[i].tx_wbytes);
+                 dst->stats.sinks[i].tx_wbytes,
+                 dst->stats.sinks[i].name,
+                 dst->stats.sinks[i].tx_iovecs,
+                 dst->stats.sinks[i].name,
+                 dst->stats.sinks[i].tx_copied_bytes,
+                 dst->stats.sinks[i].name,
+                 dst->stats.sinks[i].tx_referenced_bytes,
+                 dst->stats.sinks[i].name,
+                 dst->stats.sinks[i].tx_saved_bytes,
+                 dst->stats.sinks[i].name,
+                 dst->stats.sinks[i].sampled_out_records,
+                 dst->stats.sinks[i].name,
+                 comp ? comp->rawbytes : 0,
+                 dst->stats.sinks[i].name,
+                 comp ? comp->compressedbytes : 0,
+                 dst->stats.sinks[i].name,
+                 comp ? comp->nsecs / 1000 : 0);
         }
     }
 }
 
+static inline uint64_t usec_since(struct timeval *then, struct timeval *now) {
+    struct timeval diff;
+
+    if (timercmp(now, then, <)) {
+        return 0;
+    }
+    timersub(now, then, &diff);
+    return diff.tv_sec * 1000000ULL + diff.tv_usec;
+}
+
+/* Advance one stream and forward whatever the capture source handed out.
+ * Returns 1 if records were walked, 0 if there was nothing (yet) to walk and
+ * -1 on error. */
 /* MAYBE: Don't assume DAG_COLOR_SLOTS and pass an argument instead? */
-void dag_stream_loop(dagstreamthread_t *dst, ndag_encap_params_t *state,
+static int dag_stream_step(dagstreamthread_t *dst, struct timeval *now,
         void(*walk_records)(char **, char *, dagstreamthread_t *,
-            uint16_t *, uint16_t *, ndag_encap_params_t *)) {
-    void *bottom, *top;
-    struct timeval timetaken, endtime, starttime, now;
-    uint32_t nextstat = 0;
+            uint16_t *, uint16_t *)) {
+    void *top;
+    char *walk, *walkstart;
+    uint64_t idle, released;
     int i;
-
-    bottom = NULL;
-    top = NULL;
-
-    fprintf(stderr, "In main per-thread loop: %d\n", dst->params.streamnum);
-    gettimeofday(&starttime, NULL);
-    if (dst->params.statinterval) {
-        nextstat = ((starttime.tv_sec / dst->params.statinterval) *
-                    dst->params.statinterval) + dst->params.statinterval;
-    }
+    capture_stream_t *cs = &dst->capture;
 
     /* Count datagrams and records. */
     uint16_t savedtosend[DAG_COLOR_SLOTS];
     uint16_t records_walked[DAG_COLOR_SLOTS];
 
-    /* DO dag_advance_stream WHILE not interrupted and not error */
-    while (!halted && !paused) {
+    /* Reset stats in each loop. */
+    memset(savedtosend, 0, sizeof(savedtosend));
+    memset(records_walked, 0, sizeof(records_walked));
+
+    // Should we log stats now?
+    if (dst->nextstat > 0 && now->tv_sec >= dst->nextstat) {
+        log_stats(dst, *now);
+        dst->nextstat += dst->params.statinterval;
+    }
 
-        /* Reset stats in each loop. */
-        memset(savedtosend, 0, sizeof(savedtosend));
-        memset(records_walked, 0, sizeof(records_walked));
+    if (pollctl_due(&dst->pollctl, now)) {
+        update_stream_poll(dst, now);
+    }
 
-        // Should we log stats now?
-        // TODO: consider checking the time every N iterations
-        gettimeofday(&now, NULL);
-        if (nextstat > 0 && now.tv_sec >= nextstat) {
-            log_stats(dst, now);
-            nextstat += dst->params.statinterval;
-        }
+    idle = usec_since(&dst->lastpoll, now);
+    dst->lastpoll = *now;
+
+    /* Give back the part of the buffer the TX thread is done with. */
+    if (dst->pipeline) {
+        released = txpipeline_released(dst->pipeline);
+        dst->bottom = (char *)dst->bottom + (released - dst->bottomoff);
+        dst->bottomoff = released;
+    }
 
-        top = dag_advance_stream(dst->params.dagfd, dst->params.streamnum,
-                (uint8_t **)(&bottom));
-        if (top == NULL) {
-            fprintf(stderr, "Error while advancing DAG stream %d: %s\n",
-                    dst->params.streamnum, strerror(errno));
-            break;
+    top = cs->src->ops->advance(cs, (uint8_t **)(&dst->bottom));
+    if (top == NULL) {
+        fprintf(stderr, "Error while advancing DAG stream %d: %s\n",
+                dst->params.streamnum, strerror(errno));
+        return -1;
+    }
+
+    /* The capture source may have moved bottom, e.g. when wrapping around
+     * the end of the stream buffer, so walk relative to it. */
+    walk = (char *)dst->bottom + (dst->walkoff - dst->bottomoff);
+
+    if (walk == (char *)top) {
+        /* Waiting for the TX thread is not idle. */
+        if (dst->walkoff != dst->bottomoff) {
+            sched_yield();
+            return 0;
         }
 
-        if (bottom == top) {
-            dst->idletime += DAG_POLL_MAXWAIT;
+        dst->idletime += idle;
 
-            if (dst->idletime > 5 * 1000000) {
+        if (dst->idletime > 5 * 1000000) {
+            if (dst->pipeline) {
+                dst->batch = txpipeline_next(dst->pipeline);
+                if (dst->batch) {
+                    dst->batch->keepalive = 1;
+                    txpipeline_publish(dst->pipeline);
+                    dst->batch = NULL;
+                }
+            } else {
                 for (i = 0; i < dst->inuse; ++i) {
-                    if (ndag_send_keepalive(&state[i]) < 0) {
+                    if (ndag_send_keepalive(&dst->state[i]) < 0) {
                         break;
                     }
                 }
-                dst->idletime = 0;
             }
-            continue;
+            dst->idletime = 0;
         }
+        return 0;
+    }
 
+    /* Shared streams don't block in the capture source, so hold off until
+     * mindata has arrived or maxwait has passed like the DAG would. */
+    if (dst->shared && !cs->src->ops->reclist &&
+            (char *)top - walk < dst->pollctl.mindata &&
+            usec_since(&dst->lastwalk, now) < dst->pollctl.maxwait) {
+        return 0;
+    }
+
+    if (dst->pipeline) {
+        dst->batch = txpipeline_next(dst->pipeline);
+        if (dst->batch == NULL) {
+            /* Ring is full, leave the records in the buffer for now. */
+            dst->stats.pipeline_stalls++;
+            sched_yield();
+            return 0;
+        }
+        /* The TX thread is done with the batch, and so with the staging
+         * segment that goes with it. */
         for (i = 0; i < dst->inuse; ++i) {
-            ndag_reset_encap_state(&state[i]);
+            dst->iovs[i].staging = dst->iovs[i].stagingmem +
+                (size_t)dst->iovs[i].stagingsize *
+                (dst->batch - dst->pipeline->batches);
+            dst->iovs[i].stagingused = 0;
+        }
+    } else {
+        for (i = 0; i < dst->inuse; ++i) {
+            ndag_reset_encap_state(&dst->state[i]);
+            dst->iovs[i].stagingused = 0;
+            if (dst->compress[i]) {
+                dgramcompress_reset(dst->compress[i]);
+            }
         }
+    }
+    dst->lastwalk = *now;
+
+    walkstart = walk;
+    walk_records(&walk, (char *)top, dst, savedtosend, records_walked);
+    dst->walkoff += walk - walkstart;
+
+    /* Record stats. */
+    dst->stats.walked_buffers++;
+    for (i = 0; i < dst->inuse; ++i) {
+        dst->stats.sinks[i].tx_records += records_walked[i];
+        dst->stats.sinks[i].tx_datagrams += savedtosend[i];
+        /* Account for message headers. */
+        dst->stats.sinks[i].tx_bytes += savedtosend[i] * ENCAP_OVERHEAD;
+    }
 
-        walk_records((char **)(&bottom), (char *)top, dst, savedtosend,
-                records_walked, state);
 
-        /* Record stats. */
-        dst->stats.walked_buffers++;
-        for (i = 0; i < dst->inuse; ++i) {
-            dst->stats.sinks[i].tx_records += records_walked[i];
-            dst->stats.sinks[i].tx_datagrams += savedtosend[i];
-            /* Account for message headers. */
-            dst->stats.sinks[i].tx_bytes += savedtosend[i] * ENCAP_OVERHEAD;
+    if (dst->pipeline) {
+        dst->batch->end = dst->walkoff;
+        memcpy(dst->batch->sendcnt, savedtosend,
+                sizeof(uint16_t) * dst->inuse);
+        txpipeline_publish(dst->pipeline);
+        dst->batch = NULL;
+        dst->stats.pipeline_batches++;
+        return 1;
+    }
+
+    for (i = 0; i < dst->inuse; ++i) {
+        if (savedtosend[i] > 0) {
+            if (ndag_send_encap_records(&dst->state[i], savedtosend[i]) == 0) {
+                break;
+            }
+        }
+    }
+    dst->bottom = walk;
+    dst->bottomoff = dst->walkoff;
+    return 1;
+}
+
+void dag_worker_loop(dagworker_t *worker,
+        void(*walk_records)(char **, char *, dagstreamthread_t *,
+            uint16_t *, uint16_t *)) {
+    struct timeval timetaken, endtime, now;
+    dagstreamthread_t *dst;
+    uint32_t idlesleep;
+    double secs;
+    int i, ret, busy = 0;
+
+    gettimeofday(&now, NULL);
+    for (i = 0; i < worker->streamcnt; ++i) {
+        dst = worker->streams[i];
+        fprintf(stderr, "In main per-thread loop: %d\n", dst->params.streamnum);
+        dst->bottom = NULL;
+        dst->bottomoff = 0;
+        dst->walkoff = 0;
+        dst->batch = NULL;
+        if (dst->pipeline) {
+            if (txpipeline_start(dst->pipeline, dst->txcpu) != 0) {
+                fprintf(stderr, "Failed to start TX thread for stream %d\n",
+                        dst->params.streamnum);
+                busy = -1;
+            }
+        }
+        dst->starttime = now;
+        dst->lastpoll = now;
+        dst->lastwalk = now;
+        dst->nextstat = 0;
+        if (dst->params.statinterval) {
+            dst->nextstat = ((now.tv_sec / dst->params.statinterval) *
+                    dst->params.statinterval) + dst->params.statinterval;
         }
+    }
 
+    /* DO dag_advance_stream WHILE not interrupted and not error */
+    while (!halted && !paused && busy >= 0) {
+        busy = 0;
+        for (i = 0; i < worker->streamcnt; ++i) {
+            // TODO: consider checking the time every N iterations
+            gettimeofday(&now, NULL);
+            ret = dag_stream_step(worker->streams[i], &now, walk_records);
+            if (ret < 0) {
+                busy = -1;
+                break;
+            }
+            busy |= ret;
+        }
 
-        for (i = 0; i < dst->inuse; ++i) {
-            if (savedtosend[i] > 0) {
-                if (ndag_send_encap_records(&state[i], savedtosend[i]) == 0) {
-                    break;
+        /* Shared streams don't block, so sleep until the next poll if none of
+         * them had anything to walk. */
+        if (busy == 0 && worker->streamcnt > 1) {
+            idlesleep = DAG_POLL_FREQ;
+            for (i = 0; i < worker->streamcnt; ++i) {
+                if (worker->streams[i]->pollctl.pollfreq < idlesleep) {
+                    idlesleep = worker->streams[i]->pollctl.pollfreq;
                 }
             }
+            usleep(idlesleep);
+        }
+    }
+
+    /* Let the TX threads finish sending before the sinks are closed. */
+    for (i = 0; i < worker->streamcnt; ++i) {
+        if (worker->streams[i]->pipeline) {
+            txpipeline_stop(worker->streams[i]->pipeline);
         }
     }
 
     gettimeofday(&endtime, NULL);
-    timersub(&endtime, &starttime, &timetaken);
-    fprintf(stderr, "Halting stream %d after processing %lu records in %d.%d seconds\n",
-            dst->params.streamnum, dst->stats.walked_records, (int)timetaken.tv_sec,
-            (int)timetaken.tv_usec);
+    for (i = 0; i < worker->streamcnt; ++i) {
+        dst = worker->streams[i];
+        timersub(&endtime, &dst->starttime, &timetaken);
+        secs = timetaken.tv_sec + timetaken.tv_usec / 1000000.0;
+        fprintf(stderr, "Halting stream %d after processing %lu records in %d.%06d seconds "
+                "(%.0f records/sec)\n",
+                dst->params.streamnum, dst->stats.walked_records,
+                (int)timetaken.tv_sec, (int)timetaken.tv_usec,
+                secs > 0 ? dst->stats.walked_records / secs : 0.0);
+    }
 }
 
 void halt_dag_stream(dagstreamthread_t *dst) {
+    capture_stream_t *cs = &dst->capture;
+
+    lock_capture(dst);
     if (dst->streamstarted) {
-        if (dag_stop_stream(dst->params.dagfd, dst->params.streamnum) != 0) {
+        if (cs->src->ops->stop(cs) != 0) {
             fprintf(stderr, "Error while stopping DAG stream %d: %s\n",
                 dst->params.streamnum, strerror(errno));
         }
     }
 
-    if (dag_detach_stream(dst->params.dagfd, dst->params.streamnum) != 0) {
+    if (cs->src->ops->detach(cs) != 0) {
         fprintf(stderr, "Error while detaching DAG stream %d: %s\n",
                 dst->params.streamnum, strerror(errno));
     }
+    unlock_capture(dst);
 }
 
 void halt_dag_sink(ndag_encap_params_t *state) {
@@ -371,103 +741,404 @@ void halt_dag_sink(ndag_encap_params_t *state) {
     }
 }
 
-int create_multiplex_beaconer(beaconthread_t *bthread) {
+int create_multiplex_beaconer(beaconthread_t *bthread, const cpulist_t *cpus) {
 
-    int ret;
+    /* This thread is low impact so goes with the other housekeeping. */
+    if (cpulist_thread_create(&(bthread->tid), cpus, ndag_start_beacon,
+            (void *)(bthread->params)) != 0) {
+        return -1;
+    }
 
-#ifdef __linux__
-    pthread_attr_t attrib;
-    cpu_set_t cpus;
-    //int i;
-#endif
+    return 1;
 
-#ifdef __linux__
+}
 
-    /* This thread is low impact so can be bound to core 0 */
-    CPU_ZERO(&cpus);
-    CPU_SET(0, &cpus);
-    pthread_attr_init(&attrib);
-    pthread_attr_setaffinity_np(&attrib, sizeof(cpus), &cpus);
-    ret = pthread_create(&(bthread->tid), &attrib, ndag_start_beacon,
-            (void *)(bthread->params));
-    pthread_attr_destroy(&attrib);
+/* Wait for every worker to attach and start its streams, which they do in
+ * parallel. Returns -1 if halted first. */
+static int wait_dag_workers(dagworker_t *workers, int workercnt,
+        struct timeval *slowest, int *slowstream) {
+    int i, j;
 
-#else
-    ret = pthread_create(&(bthread->tid), NULL, ndag_start_beacon,
-            (void *)(bthread->params));
-#endif
+    for (i = 0; i < workercnt; i++) {
+        while (!__atomic_load_n(&workers[i].started, __ATOMIC_ACQUIRE)) {
+            if (is_halted()) {
+                return -1;
+            }
+            usleep(1000);
+        }
+    }
 
+    timerclear(slowest);
+    for (i = 0; i < workercnt; i++) {
+        for (j = 0; j < workers[i].streamcnt; j++) {
+            if (timercmp(&workers[i].streams[j]->attachtime, slowest, >)) {
+                *slowest = workers[i].streams[j]->attachtime;
+                *slowstream = workers[i].streams[j]->params.streamnum;
+            }
+        }
+    }
+    return 0;
+}
 
-    if (ret != 0) {
-        return -1;
+static inline double elapsed_ms(struct timeval *from, struct timeval *to) {
+    struct timeval diff;
+
+    timersub(to, from, &diff);
+    return diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0;
+}
+
+static void report_startup(struct timeval *started, struct timeval *enumerated,
+        struct timeval *placed, struct timeval *running,
+        struct timeval *slowest, int slowstream) {
+
+    fprintf(stderr, "Startup took %.1f ms: enumeration %.1f ms, placement "
+            "%.1f ms, attach and start %.1f ms (slowest stream %d: %.1f ms)\n",
+            elapsed_ms(started, running), elapsed_ms(started, enumerated),
+            elapsed_ms(enumerated, placed), elapsed_ms(placed, running),
+            slowstream, slowest->tv_sec * 1000.0 + slowest->tv_usec / 1000.0);
+}
+
+static dagworker_t *add_dag_worker(dagworker_t *workers, int *workercnt,
+        int maxstreams, int cpu) {
+    dagworker_t *worker = &workers[*workercnt];
+
+    worker->streams = (dagstreamthread_t **)calloc(maxstreams,
+            sizeof(dagstreamthread_t *));
+    if (worker->streams == NULL) {
+        fprintf(stderr, "Failed to allocate memory for DAG worker\n");
+        return NULL;
     }
+    worker->cpu = cpu;
+    worker->node = cpu >= 0 ? numa_node_of_cpu(cpu) : -1;
+    worker->streamcnt = 0;
+    worker->threadstarted = 0;
+    *workercnt += 1;
+    return worker;
+}
 
-    return 1;
+/* Pick a worker for a stream once there are no free cores left: the least
+ * loaded one, or a new one that is not bound to any core if we could not get
+ * a core at all. */
+static dagworker_t *share_dag_worker(dagworker_t *workers, int *workercnt,
+        int maxstreams) {
+    dagworker_t *best = NULL;
+    int i;
 
+    for (i = 0; i < *workercnt; ++i) {
+        if (best == NULL || workers[i].streamcnt < best->streamcnt) {
+            best = &workers[i];
+        }
+    }
+    if (best == NULL) {
+        best = add_dag_worker(workers, workercnt, maxstreams, -1);
+    }
+    return best;
 }
 
-static int start_dag_thread(dagstreamthread_t *nextslot,
-        uint8_t *cpumap, void *(*processfunc)(void *)) {
+/* Spread the streams over workers. Streams pinned to a core get that core,
+ * sharing it with any other stream pinned to the same one. Dedicated streams
+ * get a worker and core of their own, the others are packed streamspercore
+ * to a worker on the NUMA node of their memory. Rather than giving up when
+ * we run out of cores, streams are added to the least loaded worker.
+ * Returns the number of workers or -1 on error. */
+static int assign_dag_workers(capture_source_t *src, dagstreamthread_t **dsts,
+        int streamcount, dagworker_t *workers, uint8_t *cpumap) {
+    dagworker_t *worker, *open = NULL;
+    int workercnt = 0, warned = 0;
+    int pass, kind, i, j, cpu;
+
+    /* Pinned streams first, then dedicated ones so they get the cores on
+     * their node. */
+    for (pass = 0; pass < 3; ++pass) {
+        for (i = 0; i < streamcount; ++i) {
+            dagstreamthread_t *dst = dsts[i];
+            int dedicated = dst->params.dedicated ||
+                    dst->params.streamspercore <= 1;
+
+            kind = dst->params.cpu >= 0 ? 0 : (dedicated ? 1 : 2);
+            if (kind != pass) {
+                continue;
+            }
 
-    int ret, nextdagcpu;
-#ifdef __linux__
-    pthread_attr_t attrib;
-    cpu_set_t cpus;
-    //int i;
-#endif
+            worker = NULL;
+            if (kind == 0) {
+                if (dst->params.cpu >= get_nb_cores()) {
+                    fprintf(stderr, "Cannot pin stream %d to core %d, it is "
+                            "not online\n", dst->params.streamnum,
+                            dst->params.cpu);
+                    return -1;
+                }
+                for (j = 0; j < workercnt; ++j) {
+                    if (workers[j].cpu == dst->params.cpu) {
+                        worker = &workers[j];
+                    }
+                }
+                if (worker == NULL) {
+                    cpumap[dst->params.cpu] = 1;
+                    worker = add_dag_worker(workers, &workercnt, streamcount,
+                            dst->params.cpu);
+                }
+            } else if (kind == 2 && open != NULL &&
+                    open->streamcnt < dst->params.streamspercore &&
+                    capture_memnode(src, open->streams[0]->params.streamnum)
+                        == capture_memnode(src, dst->params.streamnum)) {
+                worker = open;
+            } else {
+                cpu = get_next_thread_cpu(src, cpumap, dst->params.streamnum,
+                        &dst->params.streamcpus,
+                        &dst->params.housekeepingcpus);
+                if (cpu != -1) {
+                    worker = add_dag_worker(workers, &workercnt, streamcount,
+                            cpu);
+                    if (kind == 2) {
+                        open = worker;
+                    }
+                } else {
+                    if (!warned) {
+                        fprintf(stderr, "Not enough CPUs for the number of "
+                                "threads requested, sharing workers\n");
+                        warned = 1;
+                    }
+                    worker = share_dag_worker(workers, &workercnt,
+                            streamcount);
+                }
+            }
+            if (worker == NULL) {
+                return -1;
+            }
+            worker->streams[worker->streamcnt++] = dst;
+
+            /* The TX thread goes on another core on the same node. */
+            if (dst->params.pipeline) {
+                if (dst->params.txcpu >= 0) {
+                    dst->txcpu = dst->params.txcpu;
+                    if (dst->txcpu < get_nb_cores()) {
+                        cpumap[dst->txcpu] = 1;
+                    }
+                } else {
+                    dst->txcpu = get_next_thread_cpu(src, cpumap,
+                            dst->params.streamnum, &dst->params.txcpus,
+                            &dst->params.housekeepingcpus);
+                }
+            }
+        }
+    }
 
-    pthread_mutex_lock(nextslot->dagmutex);
-    /* Attach to a stream */
-    if (dag_attach_stream64(nextslot->params.dagfd,
-            nextslot->params.streamnum, 0, 8 * 1024 * 1024) != 0) {
-        if (errno == ENOMEM) {
-            pthread_mutex_unlock(nextslot->dagmutex);
-            return 0;
+    for (i = 0; i < workercnt; ++i) {
+        for (j = 0; j < workers[i].streamcnt; ++j) {
+            workers[i].streams[j]->shared = workers[i].streamcnt > 1;
         }
+    }
+    return workercnt;
+}
 
-        fprintf(stderr, "Failed to attach to DAG stream %d: %s\n",
-                nextslot->params.streamnum, strerror(errno));
-        pthread_mutex_unlock(nextslot->dagmutex);
-        return -1;
+/* Whether a sink needs a staging buffer to copy records into. */
+static inline int sink_copies(const streamsink_t *sink) {
+    return sink->copythreshold > 0 || sink->snaplen > 0 || sink->headersonly;
+}
+
+/* Move a stream's state into worker memory on the node of the worker that
+ * runs it, and give it the memory it needs to run. Nothing may point into
+ * the state yet. */
+static int place_dag_stream(dagstreamthread_t **dstp, dagworker_t *worker) {
+    dagstreamthread_t *dst = *dstp, *moved;
+    int node = worker->node >= 0 ? worker->node : dst->node;
+    size_t iovsize = sizeof(struct iovec) * dst->params.iovcapacity;
+    size_t size, maxiovs = 0, staging = 0, batches = 0, compress = 0;
+    uint32_t maxdgrams = dst->params.sinkcnt * NDAG_BATCH_SIZE;
+    int segments = dst->params.pipeline ? dst->params.pipelinedepth : 1;
+    workermem_t *mem;
+    streamsink_t *sink;
+    int i, slot;
+
+    /* A datagram never needs more than one iovec per record. Leave room for
+     * every sink's iovecs to keep doubling up to that, which adds up to
+     * less than four times as many, so growing them cannot fail. */
+    for (i = 0; i < dst->params.sinkcnt; ++i) {
+        if ((size_t)dst->params.sinks[i].mtu / ERF_HEADER_LEN + 2 > maxiovs) {
+            maxiovs = (size_t)dst->params.sinks[i].mtu / ERF_HEADER_LEN + 2;
+        }
     }
 
-    /* Check buffer size: if zero, we can save ourselves a thread because
-     * we're not going to get any packets on this stream.
-     */
-    if (dag_get_stream_buffer_size64(nextslot->params.dagfd,
-            nextslot->params.streamnum) <= 0) {
-        dag_detach_stream(nextslot->params.dagfd, nextslot->params.streamnum);
-        pthread_mutex_unlock(nextslot->dagmutex);
-        return 0;
+    /* Copied records are sent at the end of each walk, which fills at most
+     * a batch of datagrams per sink. With a TX pipeline they have to last
+     * until the TX thread is done with them, so there is a segment for each
+     * batch in the ring. */
+    for (i = 0; i < dst->params.sinkcnt; ++i) {
+        if (sink_copies(&dst->params.sinks[i])) {
+            staging += (size_t)dst->params.sinks[i].mtu * NDAG_BATCH_SIZE *
+                segments + WORKERMEM_ALIGN;
+        }
     }
 
-    dag_detach_stream(nextslot->params.dagfd, nextslot->params.streamnum);
-    nextdagcpu = get_next_thread_cpu(nextslot->params.dagdevname, cpumap,
-            nextslot->params.streamnum);
-    pthread_mutex_unlock(nextslot->dagmutex);
-    if (nextdagcpu == -1) {
-        /* TODO better error handling */
-        /* TODO allow users to decide that they want more than one stream per
-         * CPU */
-        fprintf(stderr,
-                "Not enough CPUs for the number of threads requested?\n");
+    /* Compressed datagrams are kept until the end of the batch, whether it
+     * is sent by the worker or by the TX thread. */
+    for (i = 0; i < dst->params.sinkcnt; ++i) {
+        if (dst->params.sinks[i].compressflag) {
+            compress += dgramcompress_memsize(dst->params.sinks[i].mtu);
+        }
+    }
+
+    /* Each batch of the TX ring has room for a walk's datagrams of every
+     * sink at their most scattered, so it never has to grow. */
+    if (dst->params.pipeline) {
+        batches = dst->params.pipelinedepth * (sizeof(txbatch_t) +
+                sizeof(uint16_t) * dst->params.sinkcnt +
+                sizeof(txdatagram_t) * maxdgrams +
+                sizeof(struct iovec) * maxdgrams * maxiovs +
+                3 * WORKERMEM_ALIGN) + sizeof(txpipeline_t) +
+                2 * WORKERMEM_ALIGN;
+    }
+
+    size = sizeof(dagstreamthread_t) + WORKERMEM_ALIGN + dst->params.sinkcnt *
+            (iovsize + sizeof(struct iovec) * maxiovs * 4 +
+             16 * WORKERMEM_ALIGN) + staging + batches + compress;
+    if (dst->params.dedupwindow > 0) {
+        size += dedup_memsize();
+    }
+    if (size < dst->params.workermem) {
+        size = dst->params.workermem;
+    }
+
+    mem = workermem_create(size, node, dst->params.hugepages);
+    if (mem == NULL) {
         return -1;
     }
+    moved = (dagstreamthread_t *)workermem_alloc(mem,
+            sizeof(dagstreamthread_t));
+    memcpy(moved, dst, sizeof(dagstreamthread_t));
+    dag_free_onnode(dst, sizeof(dagstreamthread_t));
+    moved->node = node;
+    moved->mem = mem;
+    *dstp = dst = moved;
+
+    /* Sinks use the slots of their color bits, which are handed out from
+     * the bottom, so only the first sinkcnt slots need iovecs. */
+    for (i = 0; i < dst->params.sinkcnt; ++i) {
+        dst->iovs[i].vec = (struct iovec *)workermem_alloc(mem, iovsize);
+        dst->iovs[i].len = dst->params.iovcapacity;
+        dst->iovs[i].mem = mem;
+    }
+
+    for (i = 0; i < dst->params.sinkcnt && staging > 0; ++i) {
+        sink = &dst->params.sinks[i];
+        if (!sink_copies(sink)) {
+            continue;
+        }
+        /* The same slot the sink's color gives it in the walker. */
+        slot = __builtin_ctz(sink->color);
+        dst->iovs[slot].stagingsize = (uint32_t)sink->mtu * NDAG_BATCH_SIZE;
+        dst->iovs[slot].stagingmem = (char *)workermem_alloc(mem,
+                (size_t)dst->iovs[slot].stagingsize * segments);
+        dst->iovs[slot].staging = dst->iovs[slot].stagingmem;
+        dst->iovs[slot].stagingused = 0;
+        dst->iovs[slot].copythreshold = sink->copythreshold;
+        dst->iovs[slot].snaplen = sink->snaplen;
+        dst->iovs[slot].headersonly = sink->headersonly;
+        if (sink->snaplen > 0 || sink->headersonly) {
+            dst->truncmask |= (color_t)1 << slot;
+        }
+        if (sink->headersonly) {
+            dst->headersmask |= (color_t)1 << slot;
+        }
+    }
+
+    for (i = 0; i < dst->params.sinkcnt; ++i) {
+        sink = &dst->params.sinks[i];
+        if (!sink->compressflag) {
+            continue;
+        }
+        slot = __builtin_ctz(sink->color);
+        dst->compress[slot] = dgramcompress_create(mem,
+                sink->mtu - ENCAP_OVERHEAD - sizeof(dgramcompress_hdr_t));
+        if (dst->compress[slot] == NULL) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < dst->params.sinkcnt; ++i) {
+        sink = &dst->params.sinks[i];
+        if (sink->samplerate <= 1) {
+            continue;
+        }
+        slot = __builtin_ctz(sink->color);
+        dst->samplerate[slot] = sink->samplerate;
+        dst->samplemask |= (color_t)1 << slot;
+        if (sink->sampleflows) {
+            dst->sampleflowmask |= (color_t)1 << slot;
+        }
+    }
+
+    if (dst->params.dedupwindow > 0) {
+        dst->dedup = dedup_create(mem, dst->params.dedupwindow);
+        if (dst->dedup == NULL) {
+            return -1;
+        }
+    }
+
+    if (dst->params.pipeline) {
+        dst->pipeline = txpipeline_create(dst->params.pipelinedepth,
+                dst->params.sinkcnt, dst->state, dst->compress, mem,
+                maxdgrams, maxdgrams * maxiovs);
+        if (dst->pipeline == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void report_placement(dagworker_t *workers, int workercnt,
+        const cpulist_t *housekeeping) {
+    dagstreamthread_t *dst;
+    char cpus[256];
+    int i, j;
+
+    for (i = 0; i < workercnt; ++i) {
+        for (j = 0; j < workers[i].streamcnt; ++j) {
+            dst = workers[i].streams[j];
+            fprintf(stderr, "Stream %d on worker %d (core %d, node %d), "
+                    "state on node %d (%zu KiB%s%s)\n", dst->params.streamnum,
+                    i, workers[i].cpu, workers[i].node, dst->node,
+                    dst->mem->size / 1024,
+                    dst->mem->hugepages ? ", hugepages" : "",
+                    dst->mem->locked ? ", locked" : "");
+            if (dst->pipeline) {
+                fprintf(stderr, "Stream %d TX thread on core %d (node %d)\n",
+                        dst->params.streamnum, dst->txcpu,
+                        dst->txcpu >= 0 ? numa_node_of_cpu(dst->txcpu) : -1);
+            }
+        }
+    }
+    cpulist_format(housekeeping, cpus, sizeof(cpus));
+    fprintf(stderr, "Housekeeping threads on cores %s\n", cpus);
+}
+
+static int start_dag_worker(dagworker_t *worker,
+        void *(*processfunc)(void *)) {
+
+    int ret;
+#ifdef __linux__
+    pthread_attr_t attrib;
+    cpu_set_t cpus;
+    //int i;
+#endif
 
 #ifdef __linux__
 
     /* Control which core this thread is bound to */
-    CPU_ZERO(&cpus);
-    CPU_SET(nextdagcpu, &cpus);
     pthread_attr_init(&attrib);
-    pthread_attr_setaffinity_np(&attrib, sizeof(cpus), &cpus);
-    ret = pthread_create(&nextslot->tid, &attrib, processfunc,
-            (void *)nextslot);
+    if (worker->cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        pthread_attr_setaffinity_np(&attrib, sizeof(cpus), &cpus);
+    }
+    ret = pthread_create(&worker->tid, &attrib, processfunc,
+            (void *)worker);
     pthread_attr_destroy(&attrib);
 
 #else
-    ret = pthread_create(&nextslot->tid, NULL, processfunc,
-            (void *)nextslot);
+    ret = pthread_create(&worker->tid, NULL, processfunc,
+            (void *)worker);
 #endif
 
     if (ret != 0) {
@@ -479,26 +1150,26 @@ static int start_dag_thread(dagstreamthread_t *nextslot,
 
 static void dst_destroy(dagstreamthread_t *dst,
                         void (*destroyfunc)(void *)) {
-    int i;
-
     if (dst->params.sinks != NULL) {
         free(dst->params.sinks);
         dst->params.sinkcnt = 0;
     }
 
-    for (i = 0; i < DAG_COLOR_SLOTS; ++i) {
-        if (dst->iovs[i].vec != NULL) {
-            free(dst->iovs[i].vec);
-            dst->iovs[i].vec = NULL;
-            dst->iovs[i].len = 0;
-        }
-    }
+    /* A TX pipeline lives in the worker memory, like the iovecs. */
+    dst->pipeline = NULL;
     if (destroyfunc) {
         destroyfunc(dst->extra);
     }
+
+    /* Once placed, the state and its iovecs live in the worker memory. */
+    if (dst->mem) {
+        workermem_destroy(dst->mem);
+    } else {
+        dag_free_onnode(dst, sizeof(dagstreamthread_t));
+    }
 }
 
-int run_dag_streams(int dagfd, uint16_t firstport,
+int run_dag_streams(capture_source_t *src, uint16_t firstport,
         int beaconcnt, ndag_beacon_params_t *bparams,
         streamparams_t *sparams,
         void *initdata,
@@ -506,49 +1177,62 @@ int run_dag_streams(int dagfd, uint16_t firstport,
         void *(*processfunc)(void *),
         void (*destroyfunc)(void *)) {
 
-    dagstreamthread_t *dagthreads = NULL;
+    dagstreamthread_t **dagthreads = NULL;
+    dagworker_t *workers = NULL;
     int maxstreams = 0, errorstate = 0;
     sigset_t sig_before, sig_block_all;
     int ret, i, j;
-    int threadcount = 0;
+    int streamcount = 0;
+    int workercount = 0;
     int filteroffset = 0;
     beaconthread_t *beacons = NULL;
     uint8_t *cpumap = NULL;
     pthread_mutex_t dagmutex;
+    struct timeval started, enumerated, placed, running, slowest;
+    int slowstream = -1;
 
 
+    gettimeofday(&started, NULL);
     pthread_mutex_init(&dagmutex, NULL);
     cpumap = (uint8_t *)malloc(sizeof(uint8_t) * get_nb_cores());
     memset(cpumap, 0, sizeof(uint8_t) * get_nb_cores());
 
     fprintf(stderr, "Starting DAG streams.\n");
-    /* Determine maximum stream count and allocate memory for threads */
-    maxstreams = dag_rx_get_stream_count(dagfd);
+    /* Determine maximum stream count and allocate memory for threads. The
+     * streams are only enumerated the first time, after a pause the cached
+     * configuration is used. */
+    maxstreams = capture_enumerate(src);
     if (maxstreams < 0) {
-        fprintf(stderr, "Failed to get RX stream count from DAG device: %s\n",
-                strerror(errno));
         errorstate = 1;
         goto halteverything;
     }
+    gettimeofday(&enumerated, NULL);
 
     /* TODO: Might need a better approach here. */
     filteroffset = maxstreams * 4;
 
-    beacons = (beaconthread_t *)(malloc(sizeof(beaconthread_t) * beaconcnt));
+    beacons = (beaconthread_t *)(calloc(beaconcnt, sizeof(beaconthread_t)));
     if (beacons == NULL) {
         fprintf(stderr, "Failed to alloce memory for beacon threads\n");
         errorstate = 1;
         goto halteverything;
     }
 
-    dagthreads = (dagstreamthread_t *)(
-            malloc(sizeof(dagstreamthread_t) * maxstreams));
+    dagthreads = (dagstreamthread_t **)(
+            calloc(maxstreams, sizeof(dagstreamthread_t *)));
     if (dagthreads == NULL) {
         fprintf(stderr, "Failed to alloce memory for dag threads\n");
         errorstate = 1;
         goto halteverything;
     }
 
+    workers = (dagworker_t *)calloc(maxstreams, sizeof(dagworker_t));
+    if (workers == NULL) {
+        fprintf(stderr, "Failed to alloce memory for dag workers\n");
+        errorstate = 1;
+        goto halteverything;
+    }
+
     sigemptyset(&sig_block_all);
     if (pthread_sigmask(SIG_SETMASK, &sig_block_all, &sig_before) < 0) {
         fprintf(stderr, "Unable to disable signals before starting threads.\n");
@@ -556,11 +1240,30 @@ int run_dag_streams(int dagfd, uint16_t firstport,
         goto halteverything;
     }
 
-    /* Create reading thread for each available stream */
+    /* Set up each available stream */
     /* note that "available" streams is likely more than the number we're
        actually using, so several of these will not be used */
     for (i = 0; i < maxstreams; i++) {
-        dagstreamthread_t *dst = &(dagthreads[i]);
+        /* Start out on the node of the stream's memory, which is where its
+         * worker goes unless it is pinned elsewhere. */
+        int node = capture_memnode(src, i * 2);
+        dagstreamthread_t *dst;
+
+        /* If the stream has no buffer, we can save ourselves a thread
+         * because we're not going to get any packets on it. */
+        if (src->streams[i].buffersize <= 0) {
+            continue;
+        }
+
+        dst = (dagstreamthread_t *)dag_alloc_onnode(
+                sizeof(dagstreamthread_t), node);
+        if (dst == NULL) {
+            fprintf(stderr, "Failed to alloce memory for dag thread\n");
+            errorstate = 1;
+            goto halteverything;
+        }
+        memset(dst, 0, sizeof(dagstreamthread_t));
+        dst->node = node;
         if (initfunc) {
             dst->extra = initfunc(initdata);
         } else {
@@ -572,38 +1275,82 @@ int run_dag_streams(int dagfd, uint16_t firstport,
             (streamsink_t *) malloc(sizeof(streamsink_t) * dst->params.sinkcnt);
         memcpy(dst->params.sinks, sparams->sinks,
                 sizeof(streamsink_t) * dst->params.sinkcnt);
-        for (j = 0; j < DAG_COLOR_SLOTS; ++j) {
-            dst->iovs[j].vec = (struct iovec *) malloc(sizeof(struct iovec) * 2);
-            dst->iovs[j].len = 2;
-        }
         dst->idletime = 0;
         for (j = 0; j < dst->params.sinkcnt; ++j) {
             dst->params.sinks[j].exportport = firstport + (j * filteroffset)
-                + (threadcount * DAG_MULTIPLEX_PORT_INCR);
+                + (streamcount * DAG_MULTIPLEX_PORT_INCR);
             assert(dst->params.sinks[j].exportport <= 65534);
         }
         dst->params.streamnum = i * 2;
+        for (j = 0; j < sparams->streamconfcnt; ++j) {
+            if (sparams->streamconfs[j].streamnum == dst->params.streamnum) {
+                dst->params.poll = sparams->streamconfs[j].poll;
+                if (sparams->streamconfs[j].dedicated >= 0) {
+                    dst->params.dedicated = sparams->streamconfs[j].dedicated;
+                }
+                if (sparams->streamconfs[j].pipeline >= 0) {
+                    dst->params.pipeline = sparams->streamconfs[j].pipeline;
+                }
+                if (sparams->streamconfs[j].cpu >= 0) {
+                    dst->params.cpu = sparams->streamconfs[j].cpu;
+                }
+                if (sparams->streamconfs[j].txcpu >= 0) {
+                    dst->params.txcpu = sparams->streamconfs[j].txcpu;
+                }
+                if (sparams->streamconfs[j].attachwindow >= 0) {
+                    dst->params.attachwindow =
+                        sparams->streamconfs[j].attachwindow;
+                }
+            }
+        }
+        dst->capture.src = src;
+        dst->capture.streamnum = dst->params.streamnum;
+        dst->capture.data = NULL;
         dst->streamstarted = 0;
-        dst->threadstarted = 0;
-        memset(&dst->stats, 0, sizeof(streamstats_t));
         dst->dagmutex = &dagmutex;
+        dst->txcpu = -1;
+
+        dagthreads[streamcount] = dst;
+        streamcount += 1;
+    }
+
+    if (streamcount == 0) {
+        fprintf(stderr, "Failed to create any usable DAG threads. Exiting.\n");
+        errorstate = 1;
+        goto halteverything;
+    }
+
+    workercount = assign_dag_workers(src, dagthreads, streamcount, workers,
+            cpumap);
+    if (workercount < 0) {
+        errorstate = 1;
+        goto halteverything;
+    }
+
+    for (i = 0; i < workercount; i++) {
+        for (j = 0; j < workers[i].streamcnt; j++) {
+            int k;
 
-        ret = start_dag_thread(dst, cpumap, processfunc);
+            for (k = 0; dagthreads[k] != workers[i].streams[j]; k++);
+            ret = place_dag_stream(&dagthreads[k], &workers[i]);
+            workers[i].streams[j] = dagthreads[k];
+            if (ret < 0) {
+                errorstate = 1;
+                goto halteverything;
+            }
+        }
+    }
+    report_placement(workers, workercount, &sparams->housekeepingcpus);
+    gettimeofday(&placed, NULL);
 
+    for (i = 0; i < workercount; i++) {
+        ret = start_dag_worker(&workers[i], processfunc);
         if (ret < 0) {
             fprintf(stderr, "Error creating new thread for DAG processing\n");
             errorstate = 1;
             goto halteverything;
         }
-
-        if (ret == 0) {
-            /* we're not going to use this thread, might as well clean up now */
-            dst_destroy(dst, destroyfunc);
-            continue;
-        }
-
-        dst->threadstarted = 1;
-        threadcount += 1;
+        workers[i].threadstarted = 1;
     }
 
     if (pthread_sigmask(SIG_SETMASK, &sig_before, NULL)) {
@@ -612,28 +1359,29 @@ int run_dag_streams(int dagfd, uint16_t firstport,
         goto halteverything;
     }
 
-    if (threadcount == 0) {
-        fprintf(stderr, "Failed to create any usable DAG threads. Exiting.\n");
-        errorstate = 1;
-        goto halteverything;
+    if (wait_dag_workers(workers, workercount, &slowest, &slowstream) == 0) {
+        gettimeofday(&running, NULL);
+        report_startup(&started, &enumerated, &placed, &running, &slowest,
+                slowstream);
     }
 
     /* Start one thread per filter destination. */
     for (i = 0; i < beaconcnt; ++i) {
         /* Pass non-owning pointer beacon. Will be cleaned up in telescope. */
         beacons[i].params = &bparams[i];
-        beacons[i].params->numstreams = threadcount;
+        beacons[i].params->numstreams = streamcount;
         beacons[i].params->streamports =
-            (uint16_t *)malloc(sizeof(uint16_t) * threadcount);
+            (uint16_t *)malloc(sizeof(uint16_t) * streamcount);
 
         // TODO: This is not right anymore?
-        for (j = 0; j < threadcount; j++) {
+        for (j = 0; j < streamcount; j++) {
             beacons[i].params->streamports[j] =
                 filteroffset * i  + firstport + (DAG_MULTIPLEX_PORT_INCR * j);
         }
 
         /* Create beaconing thread */
-        ret = create_multiplex_beaconer(&beacons[i]);
+        ret = create_multiplex_beaconer(&beacons[i],
+                &sparams->housekeepingcpus);
         if (ret < 0) {
             fprintf(stderr, "Failed to create beaconing thread. Exiting.\n");
             errorstate = 1;
@@ -642,8 +1390,8 @@ int run_dag_streams(int dagfd, uint16_t firstport,
     }
 
     /* Join on all threads */
-    for (i = 0; i < threadcount; i++) {
-        pthread_join(dagthreads[i].tid, NULL);
+    for (i = 0; i < workercount; i++) {
+        pthread_join(workers[i].tid, NULL);
     }
     ndag_interrupt_beacon();
     for (i = 0; i < beaconcnt; ++i) {
@@ -651,26 +1399,33 @@ int run_dag_streams(int dagfd, uint16_t firstport,
     }
 
 halteverything:
-    if (dagthreads) {
+    if (workers) {
         if (errorstate) {
             halt_program();
-            for (i = 0; i < threadcount; i++) {
-                if (dagthreads[i].threadstarted)
-                    pthread_join(dagthreads[i].tid, NULL);
+            for (i = 0; i < workercount; i++) {
+                if (workers[i].threadstarted)
+                    pthread_join(workers[i].tid, NULL);
             }
         }
-        for (i = 0; i < threadcount; i++) {
-            dst_destroy(&(dagthreads[i]), destroyfunc);
+        for (i = 0; i < workercount; i++) {
+            free(workers[i].streams);
         }
-        free(dagthreads);
+        free(workers);
     }
 
-    for (i = 0; i < beaconcnt; ++i) {
-        if (beacons[i].params->streamports) {
-            free(beacons[i].params->streamports);
+    if (dagthreads) {
+        for (i = 0; i < streamcount; i++) {
+            dst_destroy(dagthreads[i], destroyfunc);
         }
+        free(dagthreads);
     }
+
     if (beacons) {
+        for (i = 0; i < beaconcnt; ++i) {
+            if (beacons[i].params && beacons[i].params->streamports) {
+                free(beacons[i].params->streamports);
+            }
+        }
         free(beacons);
     }
     fprintf(stderr, "All DAG streams have been halted.\n");
@@ -682,4 +1437,3 @@ halteverything:
 
 
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
-
@@ -4,6 +4,12 @@
 #define DAG_POLL_MINDATA 8000
 #define DAG_POLL_MAXWAIT 100000
 #define DAG_POLL_FREQ 10000
+#define DAG_POLL_TARGETFILL 50              // percent
+
+#define DAG_ATTACH_WINDOW (8 * 1024 * 1024) // bytes
+#define DAG_IOV_CAPACITY 64                 // iovecs per sink to start with
+#define DAG_WORKER_MEM (2 * 1024 * 1024)    // bytes per stream
+#define DAG_DEDUP_MAX_WINDOW 1000000        // microseconds
 
 #define DAG_MULTIPLEX_PORT_INCR 2
 #define DAG_MULTIPLEX_BEACON_FREQ 1000      // milliseconds
@@ -11,9 +17,16 @@
 #define ENCAP_OVERHEAD (sizeof(ndag_common_t) + sizeof(ndag_encap_t))
 
 #include "ndagmulticaster.h"
+#include "capture.h"
+#include "cpulist.h"
+#include "dedup.h"
+#include "dgramcompress.h"
+#include "pollctl.h"
+#include "txpipeline.h"
+#include "workermem.h"
 
-/* Our color type, currently 8 bit. Used as a bit-field. */
-typedef uint8_t color_t;
+/* Our color type, currently 32 bit. Used as a bit-field. */
+typedef uint32_t color_t;
 
 /* One slot per bit in the color. Note that no bit (color 0) will drop packets
  * and does not require a slot. */
@@ -29,14 +42,49 @@ typedef struct streamsink {
     char *sourceaddr;
     char *name; // non-owning reference, owned by config
     uint16_t mtu;
+    uint16_t copythreshold; // bytes, copy shorter runs of records, 0 never
+    uint16_t snaplen; // bytes of each record to send, 0 for all of them
+    uint8_t headersonly; // bool, cut records after the transport header
+    uint8_t compressflag; // bool, LZ4-compress the records of each datagram
+    uint32_t samplerate; // keep 1 in this many records, 0 or 1 for all
+    uint8_t sampleflows; // bool, sample whole flows rather than packets
 } streamsink_t;
 
+/* Settings for a single stream, overriding the defaults in streamparams_t. */
+typedef struct streamconf {
+    int streamnum;
+    int dedicated; // bool, negative if unset
+    int pipeline; // bool, negative if unset
+    int cpu; // core for the stream's worker, negative if unset
+    int txcpu; // core for the stream's TX thread, negative if unset
+    int64_t attachwindow; // bytes, negative if unset
+    pollctl_params_t poll;
+} streamconf_t;
+
 /* Configuration parameters for the dag stream. */
 typedef struct streamparams {
-    int dagfd;
+    capture_source_t *capture;
     int streamnum;
-    uint8_t compressflag;
-    char *dagdevname;
+    pollctl_params_t poll;
+    int dedicated; // bool, run this stream on a worker of its own
+    int streamspercore; // max number of streams sharing a worker
+    int pipeline; // bool, send from a separate TX thread
+    int pipelinedepth; // number of batches between capture and TX thread
+    int cpu; // core for this stream's worker, negative to pick one
+    int txcpu; // core for this stream's TX thread, negative to pick one
+    uint32_t attachwindow; // bytes the stream may lag behind the capture
+    uint32_t iovcapacity; // iovecs per sink to start with
+    size_t workermem; // bytes of worker memory for the stream
+    uint8_t hugepages; // bool, put worker memory on hugepages
+    uint32_t dedupwindow; // microseconds, 0 to keep duplicate packets
+
+    /* Cores to pick from, non-owning references, owned by config. Empty
+     * lists mean any core on the NUMA node of the stream's memory. */
+    cpulist_t streamcpus;
+    cpulist_t txcpus;
+    cpulist_t housekeepingcpus; // beacons and other threads off the hot path
+    int streamconfcnt;
+    streamconf_t *streamconfs; // non-owning reference, owned by config
     uint64_t globalstart;
     int statinterval;
     char *statdir;
@@ -51,6 +99,11 @@ typedef struct streamsinkstats {
     uint64_t tx_records; // number of ERF records (packets) tx'd
     uint64_t tx_bytes; // number of bytes tx'd
     uint64_t tx_wbytes; // number of "wire" bytes tx'd (excl. ERF headers)
+    uint64_t tx_iovecs; // number of iovecs the datagrams were built from
+    uint64_t tx_copied_bytes; // bytes copied into the staging buffer
+    uint64_t tx_referenced_bytes; // bytes sent from the capture buffer
+    uint64_t tx_saved_bytes; // bytes cut off records by snaplen or headers
+    uint64_t sampled_out_records; // records the sink's sampling skipped
 } streamsinkstats_t;
 
 /* Performance stats. */
@@ -64,12 +117,30 @@ typedef struct streamstats {
     /* Filtered out stats. */
     streamsinkstats_t filtered_out;
 
+    /* Records that matched sinks but were skipped by all of their
+     * sampling, not counted in filtered_out. */
+    streamsinkstats_t sampled_out;
+
     /* nDAG transmit stats. */
     streamsinkstats_t sinks[DAG_COLOR_SLOTS];
 
     /* Error stats. */
     uint64_t dropped_records; // number of records dropped (according to DAG)
     uint64_t truncated_records; // number of records truncated
+    uint64_t suppressed_records; // number of duplicate records dropped
+    uint64_t suppressed_bytes; // number of bytes of duplicates dropped
+
+    /* Polling parameters currently in use. */
+    uint32_t poll_mindata; // bytes
+    uint32_t poll_maxwait; // microseconds
+    uint32_t poll_freq; // microseconds
+    uint64_t poll_rate; // bytes per second seen by the poll controller
+    uint32_t poll_fill; // percent of datagram capacity used
+    uint64_t poll_adjustments; // number of times the parameters were changed
+
+    /* TX pipeline stats. */
+    uint64_t pipeline_batches; // number of batches handed to the TX thread
+    uint64_t pipeline_stalls; // number of times the TX ring was full
 } streamstats_t;
 
 /* Data to manage one iovec. */
@@ -77,28 +148,117 @@ typedef struct iov_data {
     struct iovec *vec;
     uint16_t len;
     uint16_t maxsize;
+    workermem_t *mem; // non-owning reference, the vector grows into this
+
+    /* Runs of records shorter than copythreshold and records cut short are
+     * copied here rather than referenced, so scattered records make a
+     * single iovec. stagingmem holds one segment of stagingsize bytes per
+     * batch that can be in flight, staging points at the segment of the
+     * current walk. NULL if the sink does not copy. */
+    char *stagingmem;
+    char *staging;
+    uint32_t stagingsize;
+    uint32_t stagingused;
+    uint16_t copythreshold;
+    uint16_t snaplen;
+    uint8_t headersonly;
 } iov_data_t;
 
-/* State to configure and run a dagstream thread. */
+/* Records the walker indexes and classifies ahead of building datagrams. */
+#define WALK_INDEX_SIZE 256
+
+/* A record of the capture window, as indexed by the walker. pos is the
+ * record itself, or its slot if the capture source hands out a list of
+ * records. */
+typedef struct walk_entry {
+    char *pos;
+    uint16_t rlen;
+    uint16_t wlen;
+    uint16_t lctr;
+    uint16_t hdrlen; // up to the end of the transport header, if needed
+    color_t color;
+    color_t sampled; // sinks that sampling took the record from
+    uint8_t dup; // bool, dropped as a duplicate
+} walk_entry_t;
+
+/* The records a stream has indexed but not walked yet, entries start to
+ * end. Records left over when a datagram fills stay here for the next walk,
+ * so each record is classified and checked for duplicates once. The first
+ * of them is remembered to tell that the window still starts with it. */
+typedef struct walk_index {
+    walk_entry_t entries[WALK_INDEX_SIZE];
+    int start;
+    int end;
+    char *next; // where indexing goes on in the window
+    char *ahead; // how far the window has been prefetched
+    char *firstrec;
+    uint64_t firstts;
+} walk_index_t;
+
+/* State to configure and run a dagstream. */
 typedef struct dsthread {
     streamparams_t params;
     streamstats_t stats;
-    pthread_t tid;
-    int threadstarted;
+    capture_stream_t capture;
     pthread_mutex_t *dagmutex;
+    int node; // NUMA node this state was allocated on, -1 if any
+    workermem_t *mem; // holds this state and the iovecs once placed
 
     /* One entry for each color. */
     iov_data_t iovs[DAG_COLOR_SLOTS];
+    ndag_encap_params_t state[DAG_COLOR_SLOTS];
+    dgramcompress_t *compress[DAG_COLOR_SLOTS]; // NULL if not compressing
+    dedup_t *dedup; // NULL unless duplicate packets are dropped
+    walk_index_t walkindex;
     /* Number of entries in use. */
     uint16_t inuse;
+    /* Sinks that cut records short, and those that keep only headers. */
+    color_t truncmask;
+    color_t headersmask;
+    /* Sinks that sample, and those of them that sample whole flows. */
+    color_t samplemask;
+    color_t sampleflowmask;
+    uint32_t samplerate[DAG_COLOR_SLOTS];
 
     uint8_t streamstarted;
+    struct timeval attachtime; // time taken to attach and start the stream
     uint32_t idletime;
+    pollctl_t pollctl;
+
+    /* Set if the stream shares its worker with other streams. Its capture
+     * source is then polled without blocking and the worker applies the
+     * mindata and maxwait parameters instead. */
+    uint8_t shared;
+    void *bottom;
+    struct timeval starttime;
+    struct timeval lastpoll;
+    struct timeval lastwalk;
+    uint32_t nextstat;
+
+    /* Set if a TX thread sends on behalf of this stream. Records are then
+     * walked up to walkoff and only released up to bottomoff, both counted
+     * in bytes since the stream started, once the TX thread has sent them. */
+    txpipeline_t *pipeline;
+    txbatch_t *batch;
+    int txcpu;
+    uint64_t bottomoff;
+    uint64_t walkoff;
 
     /* Application specific storage. */
     void *extra;
 } dagstreamthread_t;
 
+/* A thread servicing one or more dagstreams. */
+typedef struct dagworker {
+    pthread_t tid;
+    int threadstarted;
+    int cpu; // -1 if not bound to a core
+    int node; // NUMA node of cpu, -1 if not bound to a core
+    int started; // set once its streams are started, or failed to start
+    int streamcnt;
+    dagstreamthread_t **streams;
+} dagworker_t;
+
 typedef struct beaconthread {
     pthread_t tid;
     ndag_beacon_params_t *params;
@@ -127,19 +287,46 @@ static inline void pause_program(void) {
     }
 }
 
+/* Add a datagram for sink `idx` to the stream's current batch. */
+static inline int dag_stream_push(dagstreamthread_t *dst, int idx,
+        struct iovec *iov, uint16_t num, uint16_t reccount,
+        uint16_t batchidx) {
+    struct iovec compressed;
+
+    if (dst->batch) {
+        return txbatch_push(dst->batch, idx, iov, num, reccount, batchidx);
+    }
+    if (dst->compress[idx]) {
+        if (!dgramcompress_datagram(dst->compress[idx], iov, num,
+                    &compressed)) {
+            return 0;
+        }
+        return ndag_push_encap_iovecs(&dst->state[idx], &compressed, 1,
+                reccount, batchidx);
+    }
+    return ndag_push_encap_iovecs(&dst->state[idx], iov, num, reccount,
+            batchidx);
+}
+
+/* Per-thread memory on a NUMA node (anywhere if node is negative or there is
+ * no NUMA support). Zero-filled, and only to be used with each other. */
+void *dag_alloc_onnode(size_t size, int node);
+void dag_free_onnode(void *ptr, size_t size);
+
 void halt_signal(int signal);
 void toggle_pause_signal(int signal);
 
 int init_dag_stream(dagstreamthread_t *dst);
+void dag_worker_started(dagworker_t *worker);
 int init_dag_sink(ndag_encap_params_t *state, streamsink_t *params,
         int streamnum, uint64_t globalstart);
-void dag_stream_loop(dagstreamthread_t *dst, ndag_encap_params_t *state,
+void dag_worker_loop(dagworker_t *worker,
         void(*walk_records)(char **, char *, dagstreamthread_t *,
-            uint16_t *, uint16_t *, ndag_encap_params_t *));
+            uint16_t *, uint16_t *));
 void halt_dag_stream(dagstreamthread_t *dst);
 void halt_dag_sink(ndag_encap_params_t *state);
-int create_multiplex_beaconer(beaconthread_t *bthread);
-int run_dag_streams(int dagfd, uint16_t firstport,
+int create_multiplex_beaconer(beaconthread_t *bthread, const cpulist_t *cpus);
+int run_dag_streams(capture_source_t *src, uint16_t firstport,
         int beaconcnt, ndag_beacon_params_t *bparams,
         streamparams_t *sparams,
         void *initdata,
@@ -16,41 +16,380 @@
 
 #include <wandio.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DARKFILTER_SIMD 1
+#include <immintrin.h>
+#endif
+
 #include "darkfilter.h"
+#include "erf.h"
+
+/* The vector lookups load 32 bits for each entry, so keep the bytes after
+ * the last entry readable. */
+#define EXCLUDE_PAD (sizeof(uint32_t))
+
+/* IPv6 filters are kept per /48 and prefixes may cover up to a /32 of them,
+ * shorter ones are ignored. */
+#define PFX6_LEN 48
+#define MIN_PFX6_LEN 32
+#define PFX6_MASK (~0ULL << (64 - PFX6_LEN))
+#define SLOT6_MIX 0x9e3779b97f4a7c15ULL
+
+#define CURRENT_EXCLUDE(filter) (&(filter)->exclude[(filter)->current_exclude])
+#define CURRENT_EXCLUDE6(filter) \
+    ((filter)->exclude6[(filter)->current_exclude].slots)
+
+static void select_lookup(void);
+
+/* Merge the color of a filter file into the entry of a /24 or /48, which
+ * starts out as 1 for the default sink. */
+static void add_color(color_t *entry, const darkfilter_file_t *filter_file,
+        int *cnt, int *overlaps) {
+    if (*entry == 0 || filter_file->color == 0) {
+        /* Already marked as dropped or to be marked as dropped. */
+        if (*entry > 1 || filter_file->color != 0) {
+            /* An entry already registered to be dropped is assigned
+             * another color or an already colored entry is assigned
+             * to be dropped. Since the drop filter might change at
+             * any time we prioritize dropping as a tie-breaker. */
+            fprintf(stderr, "[darkfilter] WARN: drop-filter overlapping"
+                    " with other filter, dropping wins.\n");
+            ++*overlaps;
+        } else {
+            ++*cnt;
+        }
+    } else if ((*entry & 1) != 0) {
+        /* Still goes to the default sink. */
+        if (*entry > 1) {
+            /* Other color already added. */
+            ++*overlaps;
+        } else {
+            /* First color to be added. */
+            ++*cnt;
+        }
+        /* Check this color excludes traffic from the default sink. */
+        if (filter_file->exclude && *entry > 1) {
+            /* Another filter was already added, but did not exclude
+             * the default. It is removed. */
+            fprintf(stderr, "[darkfilter] WARN: Overlapping filters "
+                "don't agree if a /24 should be excluded from the "
+                "default sink. Removing colors that mirror part of "
+                "the default sink.\n");
+        }
+    } else {
+        /* Already excluded from default sink. */
+        assert(*entry > 1);
+        ++*overlaps;
+        if (!filter_file->exclude) {
+            /* This color mirrors traffic to the default, it is not added. */
+            fprintf(stderr, "[darkfilter] WARN: Overlapping filters "
+                    "don't agree if a /24 should be excluded from the "
+                    "default sink. Not adding color because it mirrors "
+                    "part of the default sink.\n");
+        }
+    }
+    *entry = color_merge(*entry, filter_file->color, filter_file->exclude);
+}
 
-/* max number of /24s in a /8 darknet */
-#define EXCLUDE_LEN (1<<16)
+/* Palette index of a color, adding it if it is new. Returns -1 if the
+ * palette is full. Consecutive entries mostly end up with the same color,
+ * so the last one is checked first. */
+static int lpm_color_index(darkfilter_lpm_t *lpm, color_t color) {
+    uint32_t i;
 
-/* semi-hax to ignore the darknet network itself in the exclusion list */
-#define MIN_PFX_LEN 15
+    if (lpm->palette[lpm->lastcolor] == color) {
+        return lpm->lastcolor;
+    }
+    for (i = 0; i < lpm->colorcnt; ++i) {
+        if (lpm->palette[i] == color) {
+            lpm->lastcolor = i;
+            return i;
+        }
+    }
+    if (lpm->colorcnt >= DARKFILTER_MAX_COLORS) {
+        fprintf(stderr, "ERROR: Filters combine into more than %d colors\n",
+                DARKFILTER_MAX_COLORS);
+        return -1;
+    }
+    lpm->palette[lpm->colorcnt] = color;
+    lpm->lastcolor = lpm->colorcnt;
+    return lpm->colorcnt++;
+}
 
-#define CURRENT_EXCLUDE(filter) ((filter)->exclude[(filter)->current_exclude])
+/* Merge a filter file's color into an entry, or set it to color if there is
+ * no file, as for darknets. */
+static int lpm_paint_entry(darkfilter_lpm_t *lpm, uint16_t *entry,
+        const darkfilter_file_t *filter_file, color_t color, int *cnt,
+        int *overlaps) {
+    int idx;
 
-static int parse_excl_file(color_t *exclude, const darkfilter_file_t *filter_file) {
-    io_t *file;
-    char buf[1024];
+    if (filter_file != NULL) {
+        color = lpm->palette[*entry];
+        add_color(&color, filter_file, cnt, overlaps);
+    }
+    if ((idx = lpm_color_index(lpm, color)) < 0) {
+        return -1;
+    }
+    *entry = idx;
+    return 0;
+}
+
+/* Paint the addresses from first to last with a filter file's color, or
+ * with color if there is none. Whole /24s are painted in the first level,
+ * others get a second level table. */
+static int lpm_paint(darkfilter_lpm_t *lpm, uint32_t first, uint32_t last,
+        const darkfilter_file_t *filter_file, color_t color, int counts[4]) {
+    uint16_t *entry, *tbl8;
+    uint64_t addr = first;
+    int i;
+
+    while (addr <= last) {
+        entry = &lpm->tbl24[addr >> 8];
+        if ((addr & 0xff) == 0 && addr + 255 <= last &&
+                (*entry & DARKFILTER_TBL8) == 0) {
+            if (lpm_paint_entry(lpm, entry, filter_file, color, &counts[0],
+                        &counts[1]) != 0) {
+                return -1;
+            }
+            addr += 256;
+            continue;
+        }
+
+        if ((*entry & DARKFILTER_TBL8) == 0) {
+            if (lpm->tbl8used >= DARKFILTER_MAX_TBL8) {
+                fprintf(stderr, "ERROR: Prefixes longer than a /24 are in "
+                        "more than %d /24s\n", DARKFILTER_MAX_TBL8);
+                return -1;
+            }
+            tbl8 = &lpm->tbl8[lpm->tbl8used << 8];
+            for (i = 0; i < 256; ++i) {
+                tbl8[i] = *entry;
+            }
+            *entry = DARKFILTER_TBL8 | lpm->tbl8used;
+            ++lpm->tbl8used;
+        }
+        tbl8 = &lpm->tbl8[(*entry & ~DARKFILTER_TBL8) << 8];
+        if (lpm_paint_entry(lpm, &tbl8[addr & 0xff], filter_file, color,
+                    &counts[2], &counts[3]) != 0) {
+            return -1;
+        }
+        ++addr;
+    }
+    return 0;
+}
+
+static inline color_t lpm_lookup(const darkfilter_lpm_t *lpm, uint32_t addr) {
+    uint16_t entry = lpm->tbl24[addr >> 8];
+
+    if (entry & DARKFILTER_TBL8) {
+        entry = lpm->tbl8[((uint32_t)(entry & ~DARKFILTER_TBL8) << 8) |
+                (addr & 0xff)];
+    }
+    return lpm->palette[entry];
+}
+
+/* Parse an IPv4 prefix, e.g. 12.0.0.0/8, into its first and last address.
+ * The string is cut at the slash. */
+static int parse_prefix(char *buf, uint32_t *first, uint32_t *last) {
+    struct in_addr in;
     char *mask_str;
     int mask;
 
-    uint32_t addr;
+    if ((mask_str = strchr(buf, '/')) == NULL) {
+        return -1;
+    }
+    *mask_str = '\0';
+    mask_str++;
+    mask = atoi(mask_str);
+    if (inet_pton(AF_INET, buf, &in) != 1 || mask < 0 || mask > 32) {
+        return -1;
+    }
+    *first = ntohl(in.s_addr) & (mask == 0 ? 0 : ~0U << (32 - mask));
+    *last = *first | (mask == 0 ? ~0U : ~(~0U << (32 - mask)));
+    return 0;
+}
+
+static int parse_excl_file(const darkfilter_filter_t *filter,
+        darkfilter_lpm_t *lpm, const darkfilter_file_t *filter_file) {
+    io_t *file;
+    char buf[1024];
+    char line[1024];
 
     uint32_t first_addr;
     uint32_t last_addr;
+    uint32_t lo, hi;
 
-    uint32_t first_slash24;
-    uint32_t last_slash24;
+    /* /24s and addresses excluded and overlapping. */
+    int counts[4] = {0, 0, 0, 0};
+    int outside = 0;
+    int i;
 
-    uint64_t x;
+    // "default" filter cannot have a filter file
+    assert(filter_file->color != 1);
+
+    if ((file = wandio_create(filter_file->excl_file)) == NULL) {
+        fprintf(stderr, "Failed to open exclusion file %s\n", filter_file->excl_file);
+        return -1;
+    }
+
+    while (wandio_fgets(file, buf, 1024, 1) != 0) {
+        snprintf(line, sizeof(line), "%s", buf);
+        if (parse_prefix(buf, &first_addr, &last_addr) != 0) {
+            fprintf(stderr, "ERROR: Malformed prefix for darkfilter: %s\n",
+                    line);
+            goto err;
+        }
+
+        /* Only the parts of the prefix in a darknet are of interest, which
+         * also keeps a darknet listed in the file from covering the rest. */
+        outside = 1;
+        for (i = 0; i < filter->netcnt; ++i) {
+            lo = first_addr > filter->net[i].first ? first_addr :
+                    filter->net[i].first;
+            hi = last_addr < filter->net[i].last ? last_addr :
+                    filter->net[i].last;
+            if (lo > hi) {
+                continue;
+            }
+            outside = 0;
+            if (lpm_paint(lpm, lo, hi, filter_file, 0, counts) != 0) {
+                goto err;
+            }
+        }
+        if (outside) {
+            fprintf(stderr, "[darkfilter] WARN: Ignoring prefix outside the "
+                    "darknets: %s\n", line);
+        }
+    }
+
+    fprintf(stderr, "[darkfilter] INFO: Filter %s\n", filter_file->excl_file);
+    fprintf(stderr, "[darkfilter] INFO: Excluding %d /24s and %d addresses\n",
+            counts[0], counts[2]);
+    fprintf(stderr, "[darkfilter] INFO: Overlaps %d /24s and %d addresses\n",
+            counts[1], counts[3]);
+
+    wandio_destroy(file);
+
+    return 0;
+
+err:
+    wandio_destroy(file);
+    return -1;
+}
+
+/* Parse a darknet6 prefix, e.g. 2001:db8::/32. Only the upper 64 bits of
+ * addresses are looked at, so the prefix can be a /64 at most. */
+static int parse_net6(const char *str, darkfilter_net6_t *net) {
+    char buf[INET6_ADDRSTRLEN + 8];
+    struct in6_addr in6;
+    char *mask_str;
+    int mask, i;
+
+    snprintf(buf, sizeof(buf), "%s", str);
+    if ((mask_str = strchr(buf, '/')) == NULL) {
+        goto err;
+    }
+    *mask_str = '\0';
+    mask_str++;
+    mask = atoi(mask_str);
+    if (inet_pton(AF_INET6, buf, &in6) != 1 || mask < 1 || mask > 64) {
+        goto err;
+    }
+
+    net->prefix = 0;
+    for (i = 0; i < 8; ++i) {
+        net->prefix = (net->prefix << 8) | in6.s6_addr[i];
+    }
+    net->mask = ~0ULL << (64 - mask);
+    net->prefix &= net->mask;
+    return 0;
+
+err:
+    fprintf(stderr, "ERROR: Invalid IPv6 darknet prefix: %s\n", str);
+    return -1;
+}
+
+static inline int in_darknet6(const darkfilter_filter_t *filter,
+        uint64_t addr) {
+    int i;
+
+    for (i = 0; i < filter->net6cnt; ++i) {
+        if ((addr & filter->net6[i].mask) == filter->net6[i].prefix) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static inline uint32_t slot6_index(uint64_t key) {
+    return (uint32_t)((key * SLOT6_MIX) >> (64 - DARKFILTER_SLOT6_BITS));
+}
+
+/* Find the entry of the /48 that addr is in, adding one for the default
+ * sink if there is none. Returns NULL if the table is full. */
+static color_t *add_slot6(darkfilter_table6_t *table, uint64_t addr) {
+    uint64_t key = (addr & PFX6_MASK) | 1;
+    uint32_t i = slot6_index(key);
+
+    while (table->slots[i].key != 0) {
+        if (table->slots[i].key == key) {
+            return &table->slots[i].color;
+        }
+        i = (i + 1) & (DARKFILTER_SLOTS6 - 1);
+    }
+    if (table->used >= DARKFILTER_MAX_PFX6) {
+        return NULL;
+    }
+    ++table->used;
+    table->slots[i].key = key;
+    table->slots[i].color = 1;
+    return &table->slots[i].color;
+}
+
+/* Color of an IPv6 destination given by its upper 64 bits: 0 outside the
+ * darknets, otherwise the color of its /48, which is the default sink
+ * unless a filter file names it. The table is at most half full, so the
+ * probe always ends at an empty slot. */
+static inline color_t lookup_color6(const darkfilter_filter_t *filter,
+        const darkfilter_slot6_t *slots, uint64_t addr) {
+    uint64_t key = (addr & PFX6_MASK) | 1;
+    uint32_t i;
+
+    if (!in_darknet6(filter, addr)) {
+        return 0;
+    }
+    for (i = slot6_index(key); slots[i].key != 0;
+            i = (i + 1) & (DARKFILTER_SLOTS6 - 1)) {
+        if (slots[i].key == key) {
+            return slots[i].color;
+        }
+    }
+    return 1;
+}
+
+static int parse_excl_file6(const darkfilter_filter_t *filter,
+        darkfilter_table6_t *table, const darkfilter_file_t *filter_file) {
+    io_t *file;
+    char buf[1024];
+    char *mask_str;
+    struct in6_addr in6;
+    int mask, i;
+
+    uint64_t addr;
+    uint64_t first_slash48;
+    uint64_t x, span;
+    color_t *entry;
 
     int cnt = 0;
     int overlaps = 0;
-    int idx;
+    int outside = 0;
 
     // "default" filter cannot have a filter file
     assert(filter_file->color != 1);
 
-    if ((file = wandio_create(filter_file->excl_file)) == NULL) {
-        fprintf(stderr, "Failed to open exclusion file %s\n", filter_file->excl_file);
+    if ((file = wandio_create(filter_file->excl_file6)) == NULL) {
+        fprintf(stderr, "Failed to open exclusion file %s\n",
+                filter_file->excl_file6);
         return -1;
     }
 
@@ -64,92 +403,51 @@ static int parse_excl_file(color_t *exclude, const darkfilter_file_t *filter_fil
         *mask_str = '\0';
         mask_str++;
 
-        /* Convert the ip and mask to a number. */
-        addr = inet_addr(buf);
-        addr = ntohl(addr);
         mask = atoi(mask_str);
-        if (mask < 0 || mask > 32) {
+        if (inet_pton(AF_INET6, buf, &in6) != 1 || mask < 0 || mask > 128) {
             fprintf(stderr, "ERROR: Malformed prefix for darkfilter: %s/%s\n",
                     buf, mask_str);
             goto err;
         }
-        if (mask < MIN_PFX_LEN) {
+        if (mask < MIN_PFX6_LEN) {
           fprintf(stderr, "[darkfilter] WARN: Ignoring short prefix: %s/%s\n",
                   buf, mask_str);
           continue;
         }
+        /* Longer prefixes take their whole /48, as with /24s for IPv4. */
+        if (mask > PFX6_LEN) {
+            mask = PFX6_LEN;
+        }
 
-        /* Compute the /24s that this prefix covers.
-         * Perhaps not the most efficient way to do this, but i've borrowed it
-         * from other code that I'm sure actually works, and this only happens
-         * once at startup, so whatevs. ;) */
-        first_addr = addr & (~0 << (32-mask));
-        last_addr = first_addr + (1 << (32-mask)) - 1;
-
-        first_slash24 = (first_addr/256)*256;
-        last_slash24 = (last_addr/256)*256;
-
-        for(x = first_slash24; x <= last_slash24; x += 256) {
-            idx = (x & 0x00FFFF00) >> 8;
-            if (exclude[idx] == 0 || filter_file->color == 0) {
-                /* /24 already marked as dropped or to be marked as dropped. */
-                if (exclude[idx] > 1 || filter_file->color != 0) {
-                    /* An entry already registered to be dropped is assigned
-                     * another color or an already colored entry is assigned
-                     * to be dropped. Since the drop filter might change at
-                     * any time we prioritize dropping as a tie-breaker. */
-                    fprintf(stderr, "[darkfilter] WARN: drop-filter overlapping"
-                            " with other filter, dropping wins.\n");
-                    ++overlaps;
-                } else {
-                    ++cnt;
-                }
-                exclude[idx] = 0;
-            } else if ((exclude[idx] & 1) != 0) {
-                /* /24 still goes to the default sink. */
-                if (exclude[idx] > 1) {
-                    /* Other color already added. */
-                    ++overlaps;
-                } else {
-                    /* First color to be added. */
-                    ++cnt;
-                }
-                /* Check this color excludes traffic from the default sink. */
-                if (filter_file->exclude) {
-                    if (exclude[idx] > 1) {
-                        /* Another filter was already added, but did not exclude
-                         * the default. Remove it. */
-                        fprintf(stderr, "[darkfilter] WARN: Overlapping filters "
-                            "don't agree if a /24 should be excluded from the "
-                            "default sink. Removing colors that mirror part of "
-                            "the default sink.\n");
-                    }
-                    exclude[idx] = 0;
-                }
-                /* Add this color. */
-                exclude[idx] |= filter_file->color;
-            } else {
-                /* /24 already excluded from default sink. */
-                assert(exclude[idx] > 1);
-                ++overlaps;
-                if (filter_file->exclude) {
-                    /* This color excludes traffic as well, add it. */
-                    exclude[idx] |= filter_file->color;
-                } else {
-                    /* This color mirrors traffic to the default, don't add it. */
-                    fprintf(stderr, "[darkfilter] WARN: Overlapping filters "
-                            "don't agree if a /24 should be excluded from the "
-                            "default sink. Not adding color because it mirrors "
-                            "part of the default sink.\n");
-                }
-                
+        addr = 0;
+        for (i = 0; i < 8; ++i) {
+            addr = (addr << 8) | in6.s6_addr[i];
+        }
+        first_slash48 = addr & (~0ULL << (64 - mask));
+        span = 1ULL << (PFX6_LEN - mask);
+
+        for (x = 0; x < span; ++x) {
+            addr = first_slash48 + (x << (64 - PFX6_LEN));
+            if (!in_darknet6(filter, addr)) {
+                ++outside;
+                continue;
             }
+            if ((entry = add_slot6(table, addr)) == NULL) {
+                fprintf(stderr, "ERROR: IPv6 filters cover more than %d "
+                        "/48s\n", DARKFILTER_MAX_PFX6);
+                goto err;
+            }
+            add_color(entry, filter_file, &cnt, &overlaps);
         }
     }
 
-    fprintf(stderr, "[darkfilter] INFO: Filter %s\n", filter_file->excl_file);
-    fprintf(stderr, "[darkfilter] INFO: Excluding %d /24s\n", cnt);
-    fprintf(stderr, "[darkfilter] INFO: Overlaps %d /24s\n", overlaps);
+    fprintf(stderr, "[darkfilter] INFO: Filter %s\n", filter_file->excl_file6);
+    fprintf(stderr, "[darkfilter] INFO: Excluding %d /48s\n", cnt);
+    fprintf(stderr, "[darkfilter] INFO: Overlaps %d /48s\n", overlaps);
+    if (outside > 0) {
+        fprintf(stderr, "[darkfilter] WARN: Ignoring %d /48s outside the "
+                "IPv6 darknets\n", outside);
+    }
 
     wandio_destroy(file);
 
@@ -160,44 +458,182 @@ err:
     return -1;
 }
 
-darkfilter_filter_t *create_darkfilter_filter(int first_octet, int cnt,
-                                              darkfilter_file_t* files) {
+/* Fill in one of the two sets of exclusion tables from the filter files. */
+static int parse_excl_files(darkfilter_filter_t *filter, int which) {
+    darkfilter_lpm_t *lpm = &filter->exclude[which];
+    darkfilter_table6_t *table = &filter->exclude6[which];
+    int counts[4];
+    int i;
+
+    /* Palette entry 0 drops everything outside the darknets, 1 signifies
+     * forwarding to the default route. */
+    memset(lpm->tbl24, 0, DARKFILTER_TBL24 * sizeof(uint16_t));
+    lpm->tbl8used = 0;
+    lpm->palette[0] = 0;
+    lpm->colorcnt = 1;
+    lpm->lastcolor = 0;
+    for (i = 0; i < filter->netcnt; ++i) {
+        if (lpm_paint(lpm, filter->net[i].first, filter->net[i].last, NULL,
+                    1, counts) != 0) {
+            return -1;
+        }
+    }
+    if (table->slots) {
+        memset(table->slots, 0, DARKFILTER_SLOTS6 * sizeof(darkfilter_slot6_t));
+        table->used = 0;
+    }
+    if (filter->rules[which].rules) {
+        rules_reset(&filter->rules[which]);
+    }
+    if (filter->blocklist[which].slots) {
+        blocklist_reset(&filter->blocklist[which]);
+    }
+
+    for (i = 0; i < filter->filecnt; ++i) {
+        if (filter->files[i].excl_file && parse_excl_file(filter, lpm,
+                    &filter->files[i]) != 0) {
+            return -1;
+        }
+        if (filter->files[i].excl_file6 && parse_excl_file6(filter, table,
+                    &filter->files[i]) != 0) {
+            return -1;
+        }
+        if (filter->files[i].rule_file && rules_parse_file(
+                    &filter->rules[which], filter->files[i].rule_file,
+                    filter->files[i].color, filter->files[i].exclude) != 0) {
+            return -1;
+        }
+        if (filter->files[i].block_file && blocklist_parse_file(
+                    &filter->blocklist[which], filter->files[i].block_file,
+                    filter->files[i].color) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Add an IPv4 darknet, which must not overlap the others. */
+static int add_net(darkfilter_filter_t *filter, char *str) {
+    darkfilter_net_t *net;
+    char buf[64];
+    int i;
+
+    if (filter->netcnt >= DARKFILTER_MAX_NET) {
+        fprintf(stderr, "ERROR: Cannot handle more than %d IPv4 darknets\n",
+                DARKFILTER_MAX_NET);
+        return -1;
+    }
+    net = &filter->net[filter->netcnt];
+    snprintf(buf, sizeof(buf), "%s", str);
+    if (parse_prefix(buf, &net->first, &net->last) != 0) {
+        fprintf(stderr, "ERROR: Invalid darknet prefix: %s\n", str);
+        return -1;
+    }
+    for (i = 0; i < filter->netcnt; ++i) {
+        if (net->first <= filter->net[i].last &&
+                filter->net[i].first <= net->last) {
+            fprintf(stderr, "ERROR: Darknet %s overlaps another darknet\n",
+                    str);
+            return -1;
+        }
+    }
+    ++filter->netcnt;
+    return 0;
+}
+
+darkfilter_filter_t *create_darkfilter_filter(int first_octet,
+        char **darknets, int netcnt, char **darknet6, int net6cnt, int cnt,
+        darkfilter_file_t* files, uint32_t blocklistsize) {
     darkfilter_filter_t *filter;
-    int i, j;
+    darkfilter_lpm_t *lpm;
+    char octetnet[32];
+    int i, rulefiles = 0, blockfiles = 0;
 
-    filter = malloc(sizeof(darkfilter_filter_t));
+    filter = calloc(1, sizeof(darkfilter_filter_t));
     if (!filter) {
         goto err;
     }
+    select_lookup();
 
-    if (first_octet < 0 || first_octet > 255) {
+    if (first_octet < -1 || first_octet > 255) {
         fprintf(stderr, "ERROR: Invalid first octet for darkfilter: %d\n",
                 first_octet);
         fprintf(stderr,
                 "Check that you have set the darknet octet option correctly\n");
         goto err;
     }
+    if (first_octet == -1 && netcnt == 0 && net6cnt == 0) {
+        fprintf(stderr, "ERROR: No darknet for darkfilter\n");
+        fprintf(stderr, "Set at least one of the darknetoctet, darknets or "
+                "darknet6 options\n");
+        goto err;
+    }
+    if (net6cnt > DARKFILTER_MAX_NET6) {
+        fprintf(stderr, "ERROR: Cannot handle more than %d IPv6 darknets\n",
+                DARKFILTER_MAX_NET6);
+        goto err;
+    }
 
     filter->filecnt = cnt;
     filter->files = files;
-    filter->darknet = first_octet << 24;
+    if (first_octet >= 0) {
+        snprintf(octetnet, sizeof(octetnet), "%d.0.0.0/8", first_octet);
+        if (add_net(filter, octetnet) != 0) {
+            goto err;
+        }
+    }
+    for (i = 0; i < netcnt; ++i) {
+        if (add_net(filter, darknets[i]) != 0) {
+            goto err;
+        }
+    }
+    filter->net6cnt = net6cnt;
+    for (i = 0; i < net6cnt; ++i) {
+        if (parse_net6(darknet6[i], &filter->net6[i]) != 0) {
+            goto err;
+        }
+    }
+    for (i = 0; i < cnt; ++i) {
+        if (files[i].excl_file6 && net6cnt == 0) {
+            fprintf(stderr, "ERROR: IPv6 filter %s needs at least one IPv6 "
+                    "darknet\n", files[i].excl_file6);
+            goto err;
+        }
+        if (files[i].rule_file) {
+            ++rulefiles;
+        }
+        if (files[i].block_file) {
+            ++blockfiles;
+        }
+    }
 
     for (i = 0; i < 2; ++i) {
-        if ((filter->exclude[i] =
-             calloc(EXCLUDE_LEN, sizeof(color_t))) == NULL) {
+        lpm = &filter->exclude[i];
+        lpm->tbl24 = calloc(DARKFILTER_TBL24 * sizeof(uint16_t) + EXCLUDE_PAD,
+                1);
+        lpm->tbl8 = calloc(DARKFILTER_MAX_TBL8 * 256 * sizeof(uint16_t) +
+                EXCLUDE_PAD, 1);
+        lpm->palette = calloc(DARKFILTER_MAX_COLORS * sizeof(color_t) +
+                EXCLUDE_PAD, 1);
+        if (lpm->tbl24 == NULL || lpm->tbl8 == NULL || lpm->palette == NULL) {
+            goto err;
+        }
+        if (net6cnt > 0 && (filter->exclude6[i].slots =
+                calloc(DARKFILTER_SLOTS6, sizeof(darkfilter_slot6_t))) == NULL) {
+            goto err;
+        }
+        if (rulefiles > 0 && rules_init(&filter->rules[i]) != 0) {
             goto err;
         }
-        /* Initialize to default route 1.  */
-        for (j = 0; j < EXCLUDE_LEN; ++j) {
-            filter->exclude[i][j] = 1;
+        if (blockfiles > 0 && blocklist_init(&filter->blocklist[i],
+                    blocklistsize) != 0) {
+            goto err;
         }
     }
     filter->current_exclude = 0;
 
-    for (i = 0; i < cnt; ++i) {
-        if (parse_excl_file(CURRENT_EXCLUDE(filter), &filter->files[i]) != 0) {
-          goto err;
-        }
+    if (parse_excl_files(filter, filter->current_exclude) != 0) {
+        goto err;
     }
 
     return filter;
@@ -214,30 +650,37 @@ void destroy_darkfilter_filter(darkfilter_filter_t *filter) {
         return;
     }
     for (i=0; i<2; i++) {
-        free(filter->exclude[i]);
+        free(filter->exclude[i].tbl24);
+        free(filter->exclude[i].tbl8);
+        free(filter->exclude[i].palette);
+        free(filter->exclude6[i].slots);
+        rules_free(&filter->rules[i]);
+        blocklist_free(&filter->blocklist[i]);
     }
     free(filter);
 }
 
 int update_darkfilter_exclusions(darkfilter_filter_t *filter) {
-    int i;
-    color_t *excl = filter->exclude[!filter->current_exclude];
-    /* 1 signifies forwarding to the default route.  */
-    for (i = 0; i < EXCLUDE_LEN; ++i) {
-        excl[i] = 1;
-    }
-    for (i = 0; i < filter->filecnt; ++i) {
-        if (parse_excl_file(excl, &filter->files[i]) != 0) {
-            return -1;
-        }
+    if (parse_excl_files(filter, !filter->current_exclude) != 0) {
+        return -1;
     }
     filter->current_exclude = !filter->current_exclude;
     return 0;
 }
 
-int apply_darkfilter(darkfilter_t *state, char *pktbuf) {
+/* Find the addresses of a record, in host byte order: the IPv4 source and
+ * destination, or the upper 64 bits of the IPv6 destination. Returns the IP
+ * version, 0 if the record is not IP and -1 on error. Common record types
+ * are decoded directly, libtrace only sees unusual ones. */
+static int get_addrs(darkfilter_t *state, char *pktbuf, uint32_t *src,
+        uint32_t *addr, uint64_t *addr6) {
     libtrace_ip_t  *ip_hdr  = NULL;
-    uint32_t ip_addr;
+    libtrace_ip6_t *ip6_hdr = NULL;
+    int ret, i;
+
+    if ((ret = erf_ip_addrs((const uint8_t *)pktbuf, src, addr, addr6)) >= 0) {
+        return ret;
+    }
 
     /* Prepare a libtrace packet. */
     if (trace_prepare_packet(state->dummytrace, state->packet, pktbuf,
@@ -248,24 +691,187 @@ int apply_darkfilter(darkfilter_t *state, char *pktbuf) {
         return -1;
     }
 
-    /* Check for IPv4. */
-    if((ip_hdr = trace_get_ip(state->packet)) == NULL) {
-        goto skip;
+    /* Check for IPv4, then IPv6. */
+    if((ip_hdr = trace_get_ip(state->packet)) != NULL) {
+        /* Extract the addresses. */
+        *src = ntohl(ip_hdr->ip_src.s_addr);
+        *addr = ntohl(ip_hdr->ip_dst.s_addr);
+        return 4;
     }
+    if((ip6_hdr = trace_get_ip6(state->packet)) != NULL) {
+        *addr6 = 0;
+        for (i = 0; i < 8; ++i) {
+            *addr6 = (*addr6 << 8) | ip6_hdr->ip_dst.s6_addr[i];
+        }
+        return 6;
+    }
+    return 0;
+}
 
-    /* Extract destination address. */
-    ip_addr = htonl(ip_hdr->ip_dst.s_addr);
+int apply_darkfilter(darkfilter_t *state, char *pktbuf, color_t *color) {
+    darkfilter_filter_t *filter = state->filter;
+    const rules_t *rules = &filter->rules[filter->current_exclude];
+    const blocklist_t *bl = &filter->blocklist[filter->current_exclude];
+    uint32_t ip_src, ip_addr;
+    uint64_t ip6_addr;
+    int ret;
 
-    /* Check if prefix matches the darknet. */
-    if((ip_addr & 0xFF000000) != state->filter->darknet) {
-        goto skip;
+    /* Color 0 will drop the packet, see telescope.h. */
+    *color = 0;
+    if ((ret = get_addrs(state, pktbuf, &ip_src, &ip_addr, &ip6_addr)) < 0) {
+        return -1;
     }
 
-    /* Return matching color(s). */
-    return (int) CURRENT_EXCLUDE(state->filter)[(ip_addr & 0x00FFFF00) >> 8];
+    if (ret == 4) {
+        *color = lpm_lookup(CURRENT_EXCLUDE(filter), ip_addr);
+    } else if (ret == 6 && CURRENT_EXCLUDE6(filter) != NULL) {
+        *color = lookup_color6(filter, CURRENT_EXCLUDE6(filter), ip6_addr);
+    }
 
-skip:
-    /* Color 0 will drop the packet, see telescope.h. */
+    /* Rules and blocklists as in apply_darkfilter_batch(). */
+    if (rules->rules) {
+        rules_classify_batch(rules, &pktbuf, color, 1);
+    }
+    if (ret == 4 && *color != 0 && bl->slots) {
+        *color &= ~blocklist_lookup(bl, ip_src);
+    }
+    return 0;
+}
+
+/* Colors for a run of destination addresses from the exclusion table. */
+static void lookup_colors_scalar(const darkfilter_lpm_t *lpm,
+        const uint32_t *addrs, color_t *colors, int cnt) {
+    int i;
+
+    for (i = 0; i < cnt; ++i) {
+        colors[i] = lpm_lookup(lpm, addrs[i]);
+    }
+}
+
+#ifdef DARKFILTER_SIMD
+__attribute__((target("avx2")))
+static void lookup_colors_avx2(const darkfilter_lpm_t *lpm,
+        const uint32_t *addrs, color_t *colors, int cnt) {
+    const __m256i entrymask = _mm256_set1_epi32(0xFFFF);
+    const __m256i tbl8flag = _mm256_set1_epi32(DARKFILTER_TBL8);
+    const __m256i tbl8mask = _mm256_set1_epi32(DARKFILTER_TBL8 - 1);
+    const __m256i hostmask = _mm256_set1_epi32(0xFF);
+    const __m256i colormask = _mm256_set1_epi32(sizeof(color_t) < 4 ?
+            (1U << (8 * sizeof(color_t))) - 1 : 0xFFFFFFFF);
+    uint32_t gathered[8];
+    __m256i addr, entry, second, idx, found;
+    int i, j;
+
+    for (i = 0; i + 8 <= cnt; i += 8) {
+        addr = _mm256_loadu_si256((const __m256i *)&addrs[i]);
+        entry = _mm256_i32gather_epi32((const int *)lpm->tbl24,
+                _mm256_srli_epi32(addr, 8), sizeof(uint16_t));
+        entry = _mm256_and_si256(entry, entrymask);
+
+        /* Entries of /24s with a second level are looked up again there. */
+        second = _mm256_cmpeq_epi32(_mm256_and_si256(entry, tbl8flag),
+                tbl8flag);
+        if (!_mm256_testz_si256(second, second)) {
+            idx = _mm256_or_si256(_mm256_slli_epi32(
+                    _mm256_and_si256(entry, tbl8mask), 8),
+                    _mm256_and_si256(addr, hostmask));
+            entry = _mm256_mask_i32gather_epi32(entry,
+                    (const int *)lpm->tbl8, idx, second, sizeof(uint16_t));
+            entry = _mm256_and_si256(entry, entrymask);
+        }
+
+        found = _mm256_i32gather_epi32((const int *)lpm->palette, entry,
+                sizeof(color_t));
+        found = _mm256_and_si256(found, colormask);
+        _mm256_storeu_si256((__m256i *)gathered, found);
+        for (j = 0; j < 8; ++j) {
+            colors[i + j] = (color_t)gathered[j];
+        }
+    }
+    lookup_colors_scalar(lpm, addrs + i, colors + i, cnt - i);
+}
+#endif
+
+static void (*lookup_colors)(const darkfilter_lpm_t *, const uint32_t *,
+        color_t *, int) = lookup_colors_scalar;
+
+/* Pick the widest address lookup the CPU supports. Before AVX2 there is no
+ * gather, so the table loads take one instruction per address whatever the
+ * width and older CPUs use the scalar lookup. */
+static void select_lookup(void) {
+    const char *name = "scalar";
+
+#ifdef DARKFILTER_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        lookup_colors = lookup_colors_avx2;
+        name = "AVX2";
+    }
+#endif
+    fprintf(stderr, "[darkfilter] INFO: Using %s address lookup\n", name);
+}
+
+int apply_darkfilter_batch(darkfilter_t *state, char **pktbufs,
+        color_t *colors, int cnt) {
+    darkfilter_filter_t *filter = state->filter;
+    uint32_t srcs[DARKFILTER_BATCH];
+    uint32_t addrs[DARKFILTER_BATCH];
+    uint64_t addrs6[DARKFILTER_BATCH];
+    uint8_t other[DARKFILTER_BATCH];
+    uint8_t version[DARKFILTER_BATCH];
+    color_t clear[DARKFILTER_BATCH];
+    int current = filter->current_exclude;
+    const darkfilter_lpm_t *excl = &filter->exclude[current];
+    const darkfilter_slot6_t *excl6 = filter->exclude6[current].slots;
+    const rules_t *rules = &filter->rules[current];
+    const blocklist_t *bl = &filter->blocklist[current];
+    int i, done, n, nother, nblock, ret;
+
+    for (done = 0; done < cnt; done += n) {
+        n = cnt - done < DARKFILTER_BATCH ? cnt - done : DARKFILTER_BATCH;
+        nother = 0;
+
+        /* Gather the destinations. Records that are not IPv4 are looked up
+         * as any address and get their color on their own afterwards: 0 to
+         * drop them, unless they are IPv6 and there are IPv6 darknets. */
+        for (i = 0; i < n; ++i) {
+            ret = get_addrs(state, pktbufs[done + i], &srcs[i], &addrs[i],
+                    &addrs6[nother]);
+            if (ret < 0) {
+                return -1;
+            }
+            version[i] = ret;
+            if (ret != 4) {
+                addrs[i] = 0;
+                other[nother++] = i;
+            }
+        }
+        lookup_colors(excl, addrs, colors + done, n);
+        for (i = 0; i < nother; ++i) {
+            colors[done + other[i]] = version[other[i]] == 6 &&
+                    excl6 != NULL ? lookup_color6(filter, excl6, addrs6[i]) : 0;
+        }
+
+        /* Rules only add to what the destination filters decided. */
+        if (rules->rules) {
+            rules_classify_batch(rules, pktbufs + done, colors + done, n);
+        }
+
+        /* Blocked sources are taken from their sinks last, whatever
+         * matched. Only IPv4 packets that go somewhere are looked up. */
+        if (bl->slots) {
+            for (i = 0, nblock = 0; i < n; ++i) {
+                if (version[i] == 4 && colors[done + i] != 0) {
+                    srcs[nblock] = srcs[i];
+                    other[nblock++] = i;
+                }
+            }
+            blocklist_lookup_batch(bl, srcs, clear, nblock);
+            for (i = 0; i < nblock; ++i) {
+                colors[done + other[i]] &= ~clear[i];
+            }
+        }
+    }
     return 0;
 }
 
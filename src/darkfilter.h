@@ -5,21 +5,89 @@
 #include <libtrace.h>
 #include <wandio.h>
 
+#include "blocklist.h"
 #include "dagmultiplexer.h"
+#include "rules.h"
+
+/* Records whose addresses are looked up together. */
+#define DARKFILTER_BATCH 64
+
+/* IPv4 darknets are looked up in a DIR-24-8 table: the first level has an
+ * entry per /24, which either refers to a color directly or, with
+ * DARKFILTER_TBL8 set, to a second level table with an entry per address
+ * in that /24. Entries hold an index into a palette of the colors in use,
+ * so a /24 lookup needs a single access outside the cache. Addresses that
+ * are not in a darknet have palette entry 0, i.e. they are dropped. */
+#define DARKFILTER_MAX_NET 64
+#define DARKFILTER_TBL24 (1 << 24)
+#define DARKFILTER_TBL8 0x8000
+#define DARKFILTER_MAX_TBL8 8192 // /24s that have longer prefixes in them
+#define DARKFILTER_MAX_COLORS DARKFILTER_TBL8
+
+/* IPv6 darknets are looked up by /48 in a hash table, the same way the IPv4
+ * darknets are looked up by /24. The table is sized for a fully populated /32
+ * with room to spare, so lookups rarely probe more than one slot. */
+#define DARKFILTER_MAX_NET6 16
+#define DARKFILTER_SLOT6_BITS 18
+#define DARKFILTER_SLOTS6 (1 << DARKFILTER_SLOT6_BITS)
+#define DARKFILTER_MAX_PFX6 (DARKFILTER_SLOTS6 / 2) // /48s in the table
 
 typedef struct darkfilter_file {
   color_t color;
-  char *excl_file;
+  char *excl_file; // NULL if the sink has IPv6 prefixes only
+  char *excl_file6; // NULL if the sink has IPv4 prefixes only
+  char *rule_file; // NULL if the sink has no rules
+  char *block_file; // NULL if the sink takes packets from any source
   uint8_t exclude; // bool
 } darkfilter_file_t;
 
+/* An IPv4 darknet, as its first and last address. */
+typedef struct darkfilter_net {
+    uint32_t first;
+    uint32_t last;
+} darkfilter_net_t;
+
+typedef struct darkfilter_lpm {
+    uint16_t *tbl24;
+    uint16_t *tbl8; // DARKFILTER_MAX_TBL8 tables of 256 entries
+    uint32_t tbl8used;
+    color_t *palette;
+    uint32_t colorcnt;
+    uint16_t lastcolor; // palette index that was looked up last
+} darkfilter_lpm_t;
+
+/* An IPv6 darknet, as the upper 64 bits of its prefix and netmask. */
+typedef struct darkfilter_net6 {
+    uint64_t prefix;
+    uint64_t mask;
+} darkfilter_net6_t;
+
+/* The color of a /48 of an IPv6 darknet. The key holds the /48 in its upper
+ * bits and is never 0, which marks an empty slot. */
+typedef struct darkfilter_slot6 {
+    uint64_t key;
+    color_t color;
+} darkfilter_slot6_t;
+
+typedef struct darkfilter_table6 {
+    darkfilter_slot6_t *slots;
+    uint32_t used;
+} darkfilter_table6_t;
+
 typedef struct filter {
     int filecnt;
     darkfilter_file_t *files;
 
-    uint32_t darknet;
+    int netcnt;
+    darkfilter_net_t net[DARKFILTER_MAX_NET];
+    int net6cnt;
+    darkfilter_net6_t net6[DARKFILTER_MAX_NET6];
 
-    color_t *exclude[2];
+    /* Both swap together on reload. */
+    darkfilter_lpm_t exclude[2];
+    darkfilter_table6_t exclude6[2]; // slots are NULL without IPv6 darknets
+    rules_t rules[2]; // NULL rules without rule files
+    blocklist_t blocklist[2]; // NULL slots without blocklist files
     volatile sig_atomic_t current_exclude;
 
 } darkfilter_filter_t;
@@ -30,8 +98,12 @@ typedef struct darkfilter {
     libtrace_packet_t *packet;
 } darkfilter_t;
 
-darkfilter_filter_t *create_darkfilter_filter(int first_octet, int cnt,
-        darkfilter_file_t* files);
+/* The darknets are the /8 of first_octet, unless it is -1, and the IPv4
+ * and IPv6 prefixes given as strings. Blocklists can hold blocklistsize
+ * entries together. */
+darkfilter_filter_t *create_darkfilter_filter(int first_octet,
+        char **darknets, int netcnt, char **darknet6, int net6cnt, int cnt,
+        darkfilter_file_t* files, uint32_t blocklistsize);
 void destroy_darkfilter_filter(darkfilter_filter_t *filter);
 int update_darkfilter_exclusions(darkfilter_filter_t *filter);
 
@@ -40,7 +112,14 @@ int update_darkfilter_exclusions(darkfilter_filter_t *filter);
  * run_dag_streams().
  */
 void *create_darkfilter(void *filter);
-int apply_darkfilter(darkfilter_t *df, char *pktbuf);
+
+/* Classify a record, filling in its color. Returns 0, or -1 if the record
+ * could not be decoded. */
+int apply_darkfilter(darkfilter_t *df, char *pktbuf, color_t *color);
+
+/* The same for cnt records at once, filling in a color for each. */
+int apply_darkfilter_batch(darkfilter_t *df, char **pktbufs, color_t *colors,
+        int cnt);
 void destroy_darkfilter(void *df);
 
 #endif
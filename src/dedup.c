@@ -0,0 +1,127 @@
+/* Duplicate suppression for streams that see the same packets on more than
+ * one link. Each packet is reduced to a hash of the parts that stay the
+ * same on every link: the IP header without the TTL (or hop limit) and the
+ * checksum, and the first bytes after it. The hash picks a bucket of the
+ * window and is remembered there with the packet's ERF timestamp. A packet
+ * whose hash is found within the window is a duplicate.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+
+#include "dedup.h"
+#include "erf.h"
+
+#define DEDUP_HASH_WORDS ((60 + DEDUP_PAYLOAD + 7) / 8)
+#define DEDUP_MIX 0x9e3779b97f4a7c15ULL
+
+size_t dedup_memsize(void) {
+    return sizeof(dedup_t) + sizeof(dedup_bucket_t) * DEDUP_BUCKETS +
+        2 * WORKERMEM_ALIGN;
+}
+
+dedup_t *dedup_create(workermem_t *mem, uint32_t windowusec) {
+    dedup_t *dedup;
+
+    dedup = (dedup_t *)workermem_alloc(mem, sizeof(dedup_t));
+    if (dedup == NULL) {
+        goto createfail;
+    }
+    dedup->buckets = (dedup_bucket_t *)workermem_alloc(mem,
+            sizeof(dedup_bucket_t) * DEDUP_BUCKETS);
+    if (dedup->buckets == NULL) {
+        goto createfail;
+    }
+    dedup->window = ((uint64_t)windowusec << (32 - DEDUP_TS_SHIFT)) /
+        1000000;
+    return dedup;
+
+createfail:
+    fprintf(stderr, "Failed to allocate memory for duplicate suppression\n");
+    return NULL;
+}
+
+/* Hash the invariant bytes of the packet. Returns 0 if it is not IP. */
+static inline uint64_t dedup_hash(const uint8_t *rec) {
+    uint64_t words[DEDUP_HASH_WORDS];
+    uint8_t *bytes = (uint8_t *)words;
+    const uint8_t *l3;
+    uint16_t ethertype;
+    uint32_t remaining, len, hlen;
+    uint64_t hash = 0;
+    int i;
+
+    if ((l3 = erf_network_header(rec, &ethertype, &remaining)) == NULL) {
+        return 0;
+    }
+    if (ethertype == ETHERTYPE_IPV4 && remaining >= IPV4_HEADER_LEN) {
+        hlen = (l3[0] & 0x0f) * 4;
+    } else if (ethertype == ETHERTYPE_IPV6 && remaining >= IPV6_HEADER_LEN) {
+        hlen = IPV6_HEADER_LEN;
+    } else {
+        return 0;
+    }
+    len = hlen + DEDUP_PAYLOAD;
+    if (len > remaining) {
+        len = remaining;
+    }
+    if (len > sizeof(words)) {
+        len = sizeof(words);
+    }
+
+    memset(words, 0, sizeof(words));
+    memcpy(bytes, l3, len);
+    if (ethertype == ETHERTYPE_IPV4) {
+        bytes[8] = 0; // TTL
+        bytes[10] = 0; // checksum
+        bytes[11] = 0;
+    } else {
+        bytes[7] = 0; // hop limit
+    }
+
+    for (i = 0; i < (int)((len + 7) / 8); ++i) {
+        hash = (hash ^ words[i]) * DEDUP_MIX;
+        hash ^= hash >> 29;
+    }
+    return hash ^ len;
+}
+
+int dedup_check(dedup_t *dedup, const uint8_t *rec) {
+    dedup_bucket_t *bucket;
+    uint64_t hash = dedup_hash(rec);
+    uint32_t tag, ts, age, oldest = 0;
+    int32_t diff;
+    int i, victim = 0;
+
+    if (hash == 0) {
+        return 0;
+    }
+    bucket = &dedup->buckets[hash & (DEDUP_BUCKETS - 1)];
+    tag = (uint32_t)(hash >> 32) | 1;
+    ts = (uint32_t)(le64toh(*(const uint64_t *)rec) >> DEDUP_TS_SHIFT);
+
+    /* Replace the same packet seen long ago, or else the oldest entry. */
+    for (i = 0; i < DEDUP_WAYS; ++i) {
+        diff = (int32_t)(ts - bucket->ts[i]);
+        if (bucket->tag[i] == tag) {
+            /* The copies may reach the stream out of order. */
+            if ((uint32_t)(diff < 0 ? -diff : diff) <= dedup->window) {
+                return 1;
+            }
+            victim = i;
+            break;
+        }
+        age = bucket->tag[i] == 0 ? UINT32_MAX : diff < 0 ? 0 : (uint32_t)diff;
+        if (age >= oldest) {
+            oldest = age;
+            victim = i;
+        }
+    }
+
+    bucket->tag[victim] = tag;
+    bucket->ts[victim] = ts;
+    return 0;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,41 @@
+#ifndef DEDUP_H_
+#define DEDUP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "workermem.h"
+
+/* Packets seen within the window are remembered in buckets of one cache
+ * line each. Timestamps are kept in units of 2^-20 seconds, which wraps
+ * after a bit more than an hour and is close enough to microseconds. */
+#define DEDUP_BUCKETS 16384
+#define DEDUP_WAYS 8
+#define DEDUP_TS_SHIFT 12 // ERF timestamps are in units of 2^-32 seconds
+#define DEDUP_PAYLOAD 32 // bytes after the network header that are hashed
+
+typedef struct dedup_bucket {
+    uint32_t tag[DEDUP_WAYS]; // upper half of the hash, 0 if empty
+    uint32_t ts[DEDUP_WAYS];
+} dedup_bucket_t;
+
+/* A window of recently seen packets for one stream, to drop the second copy
+ * of packets that a tap delivers on two links. */
+typedef struct dedup {
+    dedup_bucket_t *buckets;
+    uint32_t window; // in timestamp units
+} dedup_t;
+
+/* Carved from the stream's worker memory. dedup_memsize() tells how much of
+ * it this takes at most. */
+dedup_t *dedup_create(workermem_t *mem, uint32_t windowusec);
+size_t dedup_memsize(void);
+
+/* Check an ERF record against the window and remember it. Returns 1 if the
+ * same packet was seen less than the window apart, 0 otherwise and for
+ * records that are not IP. */
+int dedup_check(dedup_t *dedup, const uint8_t *rec);
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
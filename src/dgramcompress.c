@@ -0,0 +1,141 @@
+/* LZ4 compression of the datagrams of a sink. The records of a datagram are
+ * compressed as one LZ4 block behind a small header, so each datagram can
+ * be decompressed on its own and lost datagrams don't affect the others.
+ * Everything is allocated up front from the stream's worker memory and the
+ * LZ4 state is kept, so compressing does not allocate.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <lz4.h>
+
+#include "dgramcompress.h"
+#include "erf.h"
+#include "ndagmulticaster.h"
+
+size_t dgramcompress_memsize(uint16_t maxsize) {
+    return sizeof(dgramcompress_t) + LZ4_sizeofState() + (size_t)maxsize +
+        NDAG_BATCH_SIZE * (sizeof(dgramcompress_hdr_t) + (size_t)maxsize) +
+        4 * WORKERMEM_ALIGN;
+}
+
+dgramcompress_t *dgramcompress_create(workermem_t *mem, uint16_t maxsize) {
+    dgramcompress_t *comp;
+
+    comp = (dgramcompress_t *)workermem_alloc(mem, sizeof(dgramcompress_t));
+    if (comp == NULL) {
+        goto createfail;
+    }
+    comp->maxsize = maxsize;
+    comp->outsize = NDAG_BATCH_SIZE *
+        (sizeof(dgramcompress_hdr_t) + (uint32_t)maxsize);
+    comp->scratch = (char *)workermem_alloc(mem, maxsize);
+    comp->out = (char *)workermem_alloc(mem, comp->outsize);
+    comp->lz4state = workermem_alloc(mem, LZ4_sizeofState());
+    if (comp->scratch == NULL || comp->out == NULL ||
+            comp->lz4state == NULL) {
+        goto createfail;
+    }
+    return comp;
+
+createfail:
+    fprintf(stderr, "Failed to allocate memory for datagram compression\n");
+    return NULL;
+}
+
+static inline uint64_t now_nsecs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Cut the record that crosses maxsize in the copy of a datagram's records
+ * at scratch, so the datagram ends on a record boundary. The walker only
+ * lets a datagram grow past maxsize when its first record is larger than
+ * that on its own, and counts it in truncated_records. The record keeps
+ * its wlen, as with snaplen. Returns the bytes of records left. */
+static uint32_t cut_oversized(char *scratch, uint16_t maxsize) {
+    uint8_t *rec;
+    uint32_t off = 0, rlen;
+
+    /* A record whose header does not fit is left out. */
+    while (off + ERF_HEADER_LEN <= maxsize) {
+        rec = (uint8_t *)scratch + off;
+        rlen = (rec[10] << 8) | rec[11];
+        if (rlen < ERF_HEADER_LEN || off + rlen > maxsize) {
+            rec[10] = (maxsize - off) >> 8;
+            rec[11] = (maxsize - off) & 0xff;
+            return maxsize;
+        }
+        off += rlen;
+    }
+    return off;
+}
+
+int dgramcompress_datagram(dgramcompress_t *comp, struct iovec *iov,
+        uint16_t num, struct iovec *out) {
+    dgramcompress_hdr_t *hdr;
+    uint16_t flags = 0;
+    uint32_t rawlen = 0, off = 0, len;
+    uint64_t start = now_nsecs();
+    char *src;
+    int i, clen, oversized;
+
+    for (i = 0; i < num; ++i) {
+        rawlen += iov[i].iov_len;
+    }
+    /* Without compression the multicaster would cut a datagram that holds
+     * more than maxsize bytes down to size. The records are copied to be
+     * cut, as the capture buffer is shared with the other sinks. */
+    oversized = rawlen > comp->maxsize;
+    if (oversized) {
+        rawlen = comp->maxsize;
+    }
+    if (comp->outused + sizeof(dgramcompress_hdr_t) + rawlen >
+            comp->outsize) {
+        return 0;
+    }
+
+    if (num == 1 && !oversized) {
+        src = (char *)iov[0].iov_base;
+    } else {
+        for (i = 0; i < num && off < rawlen; ++i) {
+            len = iov[i].iov_len < rawlen - off ? iov[i].iov_len :
+                rawlen - off;
+            memcpy(comp->scratch + off, iov[i].iov_base, len);
+            off += len;
+        }
+        src = comp->scratch;
+        if (oversized) {
+            rawlen = cut_oversized(comp->scratch, comp->maxsize);
+        }
+    }
+
+    /* Only worth it if the block comes out smaller. */
+    hdr = (dgramcompress_hdr_t *)(comp->out + comp->outused);
+    clen = LZ4_compress_fast_extState(comp->lz4state, src, (char *)(hdr + 1),
+            rawlen, rawlen - 1, DGRAM_COMPRESS_ACCELERATION);
+    if (clen > 0) {
+        len = clen;
+    } else {
+        memcpy(hdr + 1, src, rawlen);
+        len = rawlen;
+        flags = DGRAM_COMPRESS_STORED;
+    }
+    hdr->rawlen = htons(rawlen);
+    hdr->flags = htons(flags);
+
+    out->iov_base = hdr;
+    out->iov_len = sizeof(dgramcompress_hdr_t) + len;
+    comp->outused += out->iov_len;
+
+    comp->rawbytes += rawlen;
+    comp->compressedbytes += out->iov_len;
+    comp->nsecs += now_nsecs() - start;
+    return 1;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,92 @@
+#ifndef DGRAMCOMPRESS_H_
+#define DGRAMCOMPRESS_H_
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "workermem.h"
+
+/* nDAG packet type of datagrams whose records are LZ4-compressed, so that
+ * receivers can tell them apart from NDAG_PKT_ENCAPERF. libndagserver does
+ * not define it and stock receivers do not read it, hence the global
+ * experimentalcompress option that sinks need to compress. */
+#ifndef NDAG_PKT_ENCAPERF_LZ4
+#define NDAG_PKT_ENCAPERF_LZ4 0x07
+#endif
+
+#define DGRAM_COMPRESS_ACCELERATION 1 // LZ4 default
+
+/* Set if the records follow uncompressed, as they would not shrink. */
+#define DGRAM_COMPRESS_STORED 0x0001
+
+/* Precedes the records of a compressed datagram, after the nDAG encap
+ * header. Both fields are in network byte order. */
+typedef struct __attribute__((packed)) dgramcompress_hdr {
+    uint16_t rawlen; // bytes of ERF records once decompressed
+    uint16_t flags;
+} dgramcompress_hdr_t;
+
+/* Compression state of one sink of a stream. Datagrams are compressed into
+ * a buffer that holds a batch of them, as they are only sent at the end of
+ * the batch. Only the thread that sends the sink's datagrams uses it. */
+typedef struct dgramcompress {
+    char *scratch; // records of a datagram that is spread over iovecs
+    char *out;
+    uint32_t outsize;
+    uint32_t outused;
+    uint16_t maxsize; // bytes of records in a datagram
+    void *lz4state;
+
+    /* Stats. */
+    uint64_t rawbytes; // bytes of records handed in
+    uint64_t compressedbytes; // bytes sent, including the headers above
+    uint64_t nsecs; // time spent compressing
+} dgramcompress_t;
+
+/* Start a new batch of datagrams. */
+static inline void dgramcompress_reset(dgramcompress_t *comp) {
+    comp->outused = 0;
+}
+
+#ifdef HAVE_LZ4
+/* Carved from the stream's worker memory, for datagrams with up to maxsize
+ * bytes of records. dgramcompress_memsize() tells how much of it this
+ * takes at most. */
+dgramcompress_t *dgramcompress_create(workermem_t *mem, uint16_t maxsize);
+size_t dgramcompress_memsize(uint16_t maxsize);
+
+/* Compress the records of a datagram into a single iovec in out, header
+ * included. Returns 0 if the batch is full. */
+int dgramcompress_datagram(dgramcompress_t *comp, struct iovec *iov,
+        uint16_t num, struct iovec *out);
+#else
+/* Built without liblz4. The configuration refuses sinks that compress, so
+ * no stream ever has a compression state. */
+static inline dgramcompress_t *dgramcompress_create(workermem_t *mem,
+        uint16_t maxsize) {
+    (void)mem;
+    (void)maxsize;
+    return NULL;
+}
+
+static inline size_t dgramcompress_memsize(uint16_t maxsize) {
+    (void)maxsize;
+    return 0;
+}
+
+static inline int dgramcompress_datagram(dgramcompress_t *comp,
+        struct iovec *iov, uint16_t num, struct iovec *out) {
+    (void)comp;
+    (void)iov;
+    (void)num;
+    (void)out;
+    return 0;
+}
+#endif
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,417 @@
+#ifndef ERF_H_
+#define ERF_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+/* Definitions for ERF records that we build or decode ourselves rather
+ * than through libtrace or the DAG API. */
+
+#define ERF_HEADER_LEN 16
+#define ERF_ETH_PAD 2
+
+#define ERF_TYPE_MASK 0x7f
+#define ERF_TYPE_EXT 0x80 // extension headers follow the ERF header
+#define ERF_EXT_LEN 8
+
+#ifndef ERF_TYPE_ETH
+#define ERF_TYPE_ETH 2
+#endif
+#ifndef ERF_TYPE_COLOR_ETH
+#define ERF_TYPE_COLOR_ETH 10
+#endif
+#ifndef ERF_TYPE_DSM_COLOR_ETH
+#define ERF_TYPE_DSM_COLOR_ETH 16
+#endif
+#ifndef ERF_TYPE_COLOR_HASH_ETH
+#define ERF_TYPE_COLOR_HASH_ETH 18
+#endif
+#ifndef ERF_TYPE_IPV4
+#define ERF_TYPE_IPV4 22
+#endif
+#ifndef ERF_TYPE_IPV6
+#define ERF_TYPE_IPV6 23
+#endif
+
+/* Guarded, <net/ethernet.h> defines some of these too. */
+#ifndef ETHERTYPE_IPV4
+#define ETHERTYPE_IPV4 0x0800
+#endif
+#ifndef ETHERTYPE_IPV6
+#define ETHERTYPE_IPV6 0x86dd
+#endif
+#ifndef ETHERTYPE_VLAN
+#define ETHERTYPE_VLAN 0x8100
+#endif
+#ifndef ETHERTYPE_QINQ
+#define ETHERTYPE_QINQ 0x88a8
+#endif
+#ifndef ETHERTYPE_MPLS
+#define ETHERTYPE_MPLS 0x8847
+#endif
+#ifndef ETHERTYPE_MPLS_MCAST
+#define ETHERTYPE_MPLS_MCAST 0x8848
+#endif
+
+#define MPLS_LABEL_LEN 4
+#define IPV4_HEADER_LEN 20
+#define IPV4_SRC_OFFSET 12
+#define IPV4_DST_OFFSET 16
+#define IPV6_HEADER_LEN 40
+#define IPV6_DST_OFFSET 24
+
+#define TCP_HEADER_LEN 20
+#define UDP_HEADER_LEN 8
+#define ICMP_HEADER_LEN 8
+
+/* Records are padded to a multiple of eight bytes, as the DAG does. */
+#define ERF_ALIGN(len) (((len) + 7) & ~7)
+
+/* Find the network layer header of an ERF record, skipping extension
+ * headers, the Ethernet pad, any VLAN tags and an MPLS label stack. The
+ * payload of an MPLS stack is told apart by its IP version. Returns NULL if
+ * the record type or MPLS payload is not one we decode or the record is
+ * truncated, otherwise sets ethertype and the number of captured bytes from
+ * the returned header. */
+static inline const uint8_t *erf_network_header(const uint8_t *rec,
+        uint16_t *ethertype, uint32_t *remaining) {
+    const uint8_t *ptr = rec + ERF_HEADER_LEN;
+    const uint8_t *end = rec + ((rec[10] << 8) | rec[11]);
+    uint8_t type = rec[8];
+    uint16_t etype;
+
+    if (type & ERF_TYPE_EXT) {
+        do {
+            if (ptr + ERF_EXT_LEN > end) {
+                return NULL;
+            }
+            ptr += ERF_EXT_LEN;
+        } while (ptr[-ERF_EXT_LEN] & 0x80);
+    }
+
+    switch (type & ERF_TYPE_MASK) {
+        case ERF_TYPE_ETH:
+        case ERF_TYPE_COLOR_ETH:
+        case ERF_TYPE_DSM_COLOR_ETH:
+        case ERF_TYPE_COLOR_HASH_ETH:
+            ptr += ERF_ETH_PAD;
+            if (ptr + 14 > end) {
+                return NULL;
+            }
+            etype = (ptr[12] << 8) | ptr[13];
+            ptr += 14;
+            while ((etype == ETHERTYPE_VLAN || etype == ETHERTYPE_QINQ) &&
+                    ptr + 4 <= end) {
+                etype = (ptr[2] << 8) | ptr[3];
+                ptr += 4;
+            }
+            if (etype == ETHERTYPE_MPLS || etype == ETHERTYPE_MPLS_MCAST) {
+                /* Labels up to and including the bottom of the stack. */
+                do {
+                    if (ptr + MPLS_LABEL_LEN >= end) {
+                        return NULL;
+                    }
+                    ptr += MPLS_LABEL_LEN;
+                } while ((ptr[-2] & 0x01) == 0);
+
+                switch (ptr[0] >> 4) {
+                    case 4:
+                        etype = ETHERTYPE_IPV4;
+                        break;
+                    case 6:
+                        etype = ETHERTYPE_IPV6;
+                        break;
+                    default:
+                        return NULL;
+                }
+            }
+            break;
+        case ERF_TYPE_IPV4:
+            etype = ETHERTYPE_IPV4;
+            break;
+        case ERF_TYPE_IPV6:
+            etype = ETHERTYPE_IPV6;
+            break;
+        default:
+            return NULL;
+    }
+
+    if (ptr >= end) {
+        return NULL;
+    }
+    *ethertype = etype;
+    *remaining = end - ptr;
+    return ptr;
+}
+
+/* Read the addresses of an ERF record in host byte order: the IPv4 source
+ * and destination, or the upper 64 bits of the IPv6 destination, which is
+ * all that prefix lookups need. Returns the IP version, 0 if the record
+ * carries something else and -1 if it could not be decoded here. */
+static inline int erf_ip_addrs(const uint8_t *rec, uint32_t *src4,
+        uint32_t *addr4, uint64_t *addr6) {
+    const uint8_t *l3;
+    uint16_t ethertype;
+    uint32_t remaining;
+    int i;
+
+    if ((l3 = erf_network_header(rec, &ethertype, &remaining)) == NULL) {
+        return -1;
+    }
+    if (ethertype == ETHERTYPE_IPV4 && remaining >= IPV4_HEADER_LEN) {
+        *src4 = ((uint32_t)l3[IPV4_SRC_OFFSET] << 24) |
+                ((uint32_t)l3[IPV4_SRC_OFFSET + 1] << 16) |
+                ((uint32_t)l3[IPV4_SRC_OFFSET + 2] << 8) |
+                l3[IPV4_SRC_OFFSET + 3];
+        *addr4 = ((uint32_t)l3[IPV4_DST_OFFSET] << 24) |
+                ((uint32_t)l3[IPV4_DST_OFFSET + 1] << 16) |
+                ((uint32_t)l3[IPV4_DST_OFFSET + 2] << 8) |
+                l3[IPV4_DST_OFFSET + 3];
+        return 4;
+    }
+    if (ethertype == ETHERTYPE_IPV6 && remaining >= IPV6_HEADER_LEN) {
+        *addr6 = 0;
+        for (i = 0; i < 8; ++i) {
+            *addr6 = (*addr6 << 8) | l3[IPV6_DST_OFFSET + i];
+        }
+        return 6;
+    }
+    return 0;
+}
+
+/* Length of the transport header at l4 with the given protocol, or 0 if
+ * only the network header is kept. */
+static inline uint32_t erf_transport_header_len(const uint8_t *l4,
+        uint8_t proto, uint32_t remaining) {
+    switch (proto) {
+        case IPPROTO_TCP:
+            if (remaining < TCP_HEADER_LEN) {
+                return remaining;
+            }
+            return (l4[12] >> 4) * 4;
+        case IPPROTO_UDP:
+            return UDP_HEADER_LEN;
+        case IPPROTO_ICMP:
+        case IPPROTO_ICMPV6:
+            return ICMP_HEADER_LEN;
+        default:
+            return 0;
+    }
+}
+
+/* Length of the network header at l3, including any IPv6 extension
+ * headers, and the protocol that follows it, which is IPPROTO_NONE for
+ * fragments other than the first. Returns 0 if it is not IP or truncated. */
+static inline uint32_t erf_network_header_len(const uint8_t *l3,
+        uint16_t ethertype, uint32_t remaining, uint8_t *proto) {
+    uint32_t hlen;
+
+    if (ethertype == ETHERTYPE_IPV4) {
+        if (remaining < IPV4_HEADER_LEN) {
+            return 0;
+        }
+        hlen = (l3[0] & 0x0f) * 4;
+        *proto = l3[9];
+        if (((l3[6] & 0x1f) | l3[7]) != 0) {
+            *proto = IPPROTO_NONE; // not the first fragment
+        }
+    } else if (ethertype == ETHERTYPE_IPV6) {
+        if (remaining < IPV6_HEADER_LEN) {
+            return 0;
+        }
+        hlen = IPV6_HEADER_LEN;
+        *proto = l3[6];
+        while (hlen + 8 <= remaining) {
+            if (*proto == IPPROTO_HOPOPTS || *proto == IPPROTO_ROUTING ||
+                    *proto == IPPROTO_DSTOPTS) {
+                *proto = l3[hlen];
+                hlen += (l3[hlen + 1] + 1) * 8;
+            } else if (*proto == IPPROTO_FRAGMENT) {
+                if (((l3[hlen + 2] << 8 | l3[hlen + 3]) & 0xfff8) != 0) {
+                    *proto = IPPROTO_NONE;
+                } else {
+                    *proto = l3[hlen];
+                }
+                hlen += 8;
+            } else {
+                break;
+            }
+        }
+    } else {
+        return 0;
+    }
+    return hlen;
+}
+
+/* Number of bytes of an ERF record up to the end of its transport header,
+ * i.e. what is left once the payload is cut off. IPv6 extension headers are
+ * skipped and fragments other than the first keep only the network header.
+ * Records that are not decoded here are kept whole, so the result is never
+ * more than rlen. */
+static inline uint16_t erf_headers_len(const uint8_t *rec) {
+    uint16_t rlen = (rec[10] << 8) | rec[11];
+    const uint8_t *l3;
+    uint16_t ethertype;
+    uint32_t remaining, len, hlen;
+    uint8_t proto;
+
+    if ((l3 = erf_network_header(rec, &ethertype, &remaining)) == NULL) {
+        return rlen;
+    }
+    if ((hlen = erf_network_header_len(l3, ethertype, remaining,
+                    &proto)) == 0) {
+        return rlen;
+    }
+
+    if (hlen < remaining) {
+        hlen += erf_transport_header_len(l3 + hlen, proto, remaining - hlen);
+    }
+    len = (l3 - rec) + hlen;
+    return len < rlen ? len : rlen;
+}
+
+/* The fields of a packet that rules and flow hashes look at. Addresses are
+ * only filled in for IPv4, in host byte order. ICMP packets have their type
+ * and code in sport and dport. Ports and flags that are not in the record
+ * are 0. */
+typedef struct erf_flow {
+    uint32_t src;
+    uint32_t dst;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t version;
+    uint8_t proto;
+    uint8_t tcpflags;
+} erf_flow_t;
+
+/* Decode the flow fields of an ERF record. Returns 1 if it is IP, 0 if it
+ * is not or could not be decoded here. */
+static inline int erf_flow(const uint8_t *rec, erf_flow_t *flow) {
+    const uint8_t *l3, *l4;
+    uint16_t ethertype;
+    uint32_t remaining, hlen;
+
+    if ((l3 = erf_network_header(rec, &ethertype, &remaining)) == NULL) {
+        return 0;
+    }
+    if ((hlen = erf_network_header_len(l3, ethertype, remaining,
+                    &flow->proto)) == 0) {
+        return 0;
+    }
+    if (ethertype == ETHERTYPE_IPV4) {
+        flow->version = 4;
+        flow->src = ((uint32_t)l3[IPV4_SRC_OFFSET] << 24) |
+                ((uint32_t)l3[IPV4_SRC_OFFSET + 1] << 16) |
+                ((uint32_t)l3[IPV4_SRC_OFFSET + 2] << 8) |
+                l3[IPV4_SRC_OFFSET + 3];
+        flow->dst = ((uint32_t)l3[IPV4_DST_OFFSET] << 24) |
+                ((uint32_t)l3[IPV4_DST_OFFSET + 1] << 16) |
+                ((uint32_t)l3[IPV4_DST_OFFSET + 2] << 8) |
+                l3[IPV4_DST_OFFSET + 3];
+    } else {
+        flow->version = 6;
+        flow->src = 0;
+        flow->dst = 0;
+    }
+
+    flow->sport = 0;
+    flow->dport = 0;
+    flow->tcpflags = 0;
+    l4 = l3 + hlen;
+    remaining = hlen < remaining ? remaining - hlen : 0;
+    switch (flow->proto) {
+        case IPPROTO_TCP:
+            if (remaining >= 14) {
+                flow->tcpflags = l4[13];
+            }
+            /* Fall through. */
+        case IPPROTO_UDP:
+        case IPPROTO_SCTP:
+            if (remaining >= 4) {
+                flow->sport = (l4[0] << 8) | l4[1];
+                flow->dport = (l4[2] << 8) | l4[3];
+            }
+            break;
+        case IPPROTO_ICMP:
+        case IPPROTO_ICMPV6:
+            if (remaining >= 2) {
+                flow->sport = l4[0];
+                flow->dport = l4[1];
+            }
+            break;
+    }
+    return 1;
+}
+
+/* Unaligned loads, left in network byte order. */
+static inline uint32_t erf_load32(const uint8_t *ptr) {
+    uint32_t val;
+
+    memcpy(&val, ptr, sizeof(val));
+    return val;
+}
+
+static inline uint32_t erf_load16(const uint8_t *ptr) {
+    uint16_t val;
+
+    memcpy(&val, ptr, sizeof(val));
+    return val;
+}
+
+/* Hash the addresses, protocol and ports of a record. Both directions of a
+ * flow hash the same, so software fan-out and sampling keep flows
+ * together. Records that are not IP hash to zero. */
+static inline uint32_t erf_flow_hash(const uint8_t *rec) {
+    const uint8_t *l3, *l4 = NULL;
+    uint32_t remaining, addrs = 0, ports = 0, hash;
+    uint16_t ethertype;
+    uint8_t proto = 0;
+    int i;
+
+    l3 = erf_network_header(rec, &ethertype, &remaining);
+    if (l3 == NULL) {
+        return 0;
+    }
+
+    if (ethertype == ETHERTYPE_IPV4 && remaining >= 20) {
+        uint32_t ihl = (l3[0] & 0x0f) * 4;
+
+        addrs = erf_load32(l3 + 12) ^ erf_load32(l3 + 16);
+        proto = l3[9];
+        /* Only unfragmented packets are hashed with ports. The first
+         * fragment is not, so all fragments of a datagram hash the same. */
+        if ((erf_load16(l3 + 6) & htons(0x3fff)) == 0 &&
+                remaining >= ihl + 4) {
+            l4 = l3 + ihl;
+        }
+    } else if (ethertype == ETHERTYPE_IPV6 && remaining >= 40) {
+        for (i = 8; i < 40; i += 4) {
+            addrs ^= erf_load32(l3 + i);
+        }
+        proto = l3[6];
+        if (remaining >= 44) {
+            l4 = l3 + 40;
+        }
+    } else {
+        return 0;
+    }
+
+    if (l4 && (proto == IPPROTO_TCP || proto == IPPROTO_UDP ||
+                proto == IPPROTO_SCTP)) {
+        ports = erf_load16(l4) ^ erf_load16(l4 + 2);
+    }
+
+    hash = addrs ^ (ports * 0x9e3779b1) ^ proto;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
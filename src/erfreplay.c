@@ -0,0 +1,394 @@
+/* Capture backend that replays ERF files from memory.
+ *
+ * Each file is mapped into memory and acts as the buffer of one stream, so
+ * the stream loop sees the same [bottom, top) windows it would get from
+ * dag_advance_stream(). Records are released according to their ERF
+ * timestamps scaled by the replay speed, or as fast as the consumer can
+ * walk them if the speed is zero.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <dagapi.h>
+
+#include "byteswap.h"
+#include "capture.h"
+#include "dagmultiplexer.h"
+
+typedef struct erf_replay_file {
+    char *path; // non-owning reference, owned by config
+    uint8_t *base;
+    uint8_t *end; // end of the last complete record
+    size_t maplen;
+    uint64_t firstts; // nanoseconds
+    uint64_t duration; // nanoseconds between first and last record
+} erf_replay_file_t;
+
+typedef struct erf_replay {
+    erf_replay_file_t *files;
+    int filecnt;
+    int active; // number of streams that have not finished replaying
+} erf_replay_t;
+
+typedef struct erf_replay_stream {
+    erf_replay_file_t *file;
+    uint8_t *top;
+    uint32_t window;
+    uint32_t mindata;
+    struct timeval maxwait;
+    struct timeval poll;
+    int loopsleft;
+    uint64_t loopoffset; // nanoseconds added to timestamps of later loops
+    struct timespec started;
+    uint8_t finished;
+} erf_replay_stream_t;
+
+/* Convert an ERF timestamp (32.32 fixed point) to nanoseconds. */
+static inline uint64_t erf_ts_to_ns(const dag_record_t *erfhdr) {
+    uint64_t ts = bswap_le_to_host64(erfhdr->ts);
+
+    return (ts >> 32) * 1000000000ULL +
+            (((ts & 0xFFFFFFFFULL) * 1000000000ULL) >> 32);
+}
+
+static inline uint64_t ns_since(struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000ULL +
+            now.tv_nsec - start->tv_nsec;
+}
+
+static int map_erf_file(erf_replay_file_t *file) {
+    struct stat st;
+    uint8_t *rec;
+    uint16_t rlen;
+    int fd;
+
+    fd = open(file->path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open ERF file %s: %s\n", file->path,
+                strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to stat ERF file %s: %s\n", file->path,
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    file->maplen = st.st_size;
+    if (file->maplen == 0) {
+        /* Empty file, the stream will simply not be used. */
+        close(fd);
+        return 0;
+    }
+
+    file->base = mmap(NULL, file->maplen, PROT_READ,
+            MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (file->base == MAP_FAILED) {
+        fprintf(stderr, "Failed to map ERF file %s: %s\n", file->path,
+                strerror(errno));
+        file->base = NULL;
+        return -1;
+    }
+    madvise(file->base, file->maplen, MADV_SEQUENTIAL);
+
+    /* Find the end of the last complete record so that the stream loop
+     * never sees a partial or corrupt record at the end of the file. */
+    rec = file->base;
+    while (rec + dag_record_size <= file->base + file->maplen) {
+        rlen = ntohs(((dag_record_t *)rec)->rlen);
+        if (rlen < dag_record_size ||
+                rec + rlen > file->base + file->maplen) {
+            fprintf(stderr, "Ignoring trailing data in ERF file %s at "
+                    "offset %zu\n", file->path, (size_t)(rec - file->base));
+            break;
+        }
+        file->duration = erf_ts_to_ns((dag_record_t *)rec);
+        rec += rlen;
+    }
+    file->end = rec;
+
+    if (file->end > file->base) {
+        file->firstts = erf_ts_to_ns((dag_record_t *)file->base);
+        file->duration -= file->firstts;
+    }
+
+    fprintf(stderr, "Mapped ERF file %s (%zu bytes)\n", file->path,
+            (size_t)(file->end - file->base));
+    return 0;
+}
+
+static void erf_replay_close(capture_source_t *src) {
+    erf_replay_t *replay = (erf_replay_t *)src->data;
+    int i;
+
+    if (replay == NULL) {
+        return;
+    }
+
+    for (i = 0; i < replay->filecnt; ++i) {
+        if (replay->files[i].base) {
+            munmap(replay->files[i].base, replay->files[i].maplen);
+        }
+    }
+    free(replay->files);
+    free(replay);
+    src->data = NULL;
+}
+
+static int erf_replay_open(capture_source_t *src) {
+    capture_options_t *opts = src->opts;
+    erf_replay_t *replay;
+    int i;
+
+    if (opts->filecnt == 0) {
+        fprintf(stderr, "ERF replay requires at least one file to replay.\n");
+        return -1;
+    }
+
+    replay = (erf_replay_t *)calloc(1, sizeof(erf_replay_t));
+    if (replay == NULL) {
+        fprintf(stderr, "Failed to allocate memory for ERF replay\n");
+        return -1;
+    }
+    src->data = replay;
+
+    replay->files = (erf_replay_file_t *)calloc(opts->filecnt,
+            sizeof(erf_replay_file_t));
+    if (replay->files == NULL) {
+        fprintf(stderr, "Failed to allocate memory for ERF replay files\n");
+        goto replayopenfail;
+    }
+    replay->filecnt = opts->filecnt;
+
+    for (i = 0; i < replay->filecnt; ++i) {
+        replay->files[i].path = opts->files[i];
+        if (map_erf_file(&replay->files[i]) != 0) {
+            goto replayopenfail;
+        }
+        if (replay->files[i].end > replay->files[i].base) {
+            replay->active++;
+        }
+    }
+
+    if (opts->speed > 0) {
+        fprintf(stderr, "Replaying %d ERF file(s) at %.2fx speed\n",
+                replay->filecnt, opts->speed);
+    } else {
+        fprintf(stderr, "Replaying %d ERF file(s) as fast as possible\n",
+                replay->filecnt);
+    }
+    return 0;
+
+replayopenfail:
+    erf_replay_close(src);
+    return -1;
+}
+
+static int erf_replay_stream_count(capture_source_t *src) {
+    return ((erf_replay_t *)src->data)->filecnt;
+}
+
+static int64_t erf_replay_stream_size(capture_source_t *src, int streamnum) {
+    erf_replay_t *replay = (erf_replay_t *)src->data;
+
+    if (streamnum / 2 >= replay->filecnt) {
+        return -1;
+    }
+    return replay->files[streamnum / 2].end -
+            replay->files[streamnum / 2].base;
+}
+
+static int erf_replay_memnode(capture_source_t *src, int streamnum) {
+    (void) src;
+    (void) streamnum;
+
+    /* Any node will do. */
+    return -1;
+}
+
+static int erf_replay_attach(capture_stream_t *cs, uint32_t window) {
+    erf_replay_t *replay = (erf_replay_t *)cs->src->data;
+    erf_replay_stream_t *rs;
+    int fileidx = cs->streamnum / 2;
+
+    if (fileidx >= replay->filecnt) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    rs = (erf_replay_stream_t *)calloc(1, sizeof(erf_replay_stream_t));
+    if (rs == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    rs->file = &replay->files[fileidx];
+    rs->window = window;
+    rs->loopsleft = cs->src->opts->loops;
+    cs->data = rs;
+    return 0;
+}
+
+static int64_t erf_replay_buffer_size(capture_stream_t *cs) {
+    erf_replay_stream_t *rs = (erf_replay_stream_t *)cs->data;
+
+    return rs->file->end - rs->file->base;
+}
+
+static int erf_replay_set_poll(capture_stream_t *cs, uint32_t mindata,
+        struct timeval *maxwait, struct timeval *poll) {
+    erf_replay_stream_t *rs = (erf_replay_stream_t *)cs->data;
+
+    rs->mindata = mindata;
+    rs->maxwait = *maxwait;
+    rs->poll = *poll;
+    return 0;
+}
+
+static int erf_replay_start(capture_stream_t *cs) {
+    erf_replay_stream_t *rs = (erf_replay_stream_t *)cs->data;
+
+    rs->top = rs->file->base;
+    clock_gettime(CLOCK_MONOTONIC, &rs->started);
+    return 0;
+}
+
+/* Called once the last loop over the file has been consumed. The last
+ * stream to finish halts the program, everything else just idles. */
+static void erf_replay_finish(capture_stream_t *cs) {
+    erf_replay_t *replay = (erf_replay_t *)cs->src->data;
+    erf_replay_stream_t *rs = (erf_replay_stream_t *)cs->data;
+
+    if (rs->finished) {
+        return;
+    }
+    rs->finished = 1;
+    fprintf(stderr, "Finished replaying %s on stream %d\n", rs->file->path,
+            cs->streamnum);
+    if (__sync_sub_and_fetch(&replay->active, 1) == 0) {
+        fprintf(stderr, "ERF replay complete.\n");
+        halt_program();
+    }
+}
+
+static uint8_t *erf_replay_advance(capture_stream_t *cs, uint8_t **bottom) {
+    erf_replay_stream_t *rs = (erf_replay_stream_t *)cs->data;
+    erf_replay_file_t *file = rs->file;
+    double speed = cs->src->opts->speed;
+    uint64_t maxwait, waited = 0, pollns;
+    uint8_t *limit;
+    uint16_t rlen;
+
+    if (*bottom == NULL) {
+        *bottom = file->base;
+    }
+
+    maxwait = rs->maxwait.tv_sec * 1000000000ULL + rs->maxwait.tv_usec * 1000;
+    pollns = rs->poll.tv_sec * 1000000000ULL + rs->poll.tv_usec * 1000;
+    if (pollns == 0) {
+        pollns = 1000;
+    }
+
+    if (*bottom >= file->end) {
+        if (rs->loopsleft == 1 || rs->finished) {
+            erf_replay_finish(cs);
+            usleep(maxwait / 1000);
+            return *bottom;
+        }
+        /* Start the next loop. Zero loops means replaying forever. */
+        if (rs->loopsleft > 1) {
+            rs->loopsleft--;
+        }
+        rs->loopoffset += file->duration;
+        *bottom = file->base;
+        rs->top = file->base;
+    }
+
+    if (rs->top < *bottom) {
+        rs->top = *bottom;
+    }
+
+    limit = file->end;
+    if (rs->window > 0 && (uint64_t)(limit - *bottom) > rs->window) {
+        limit = *bottom + rs->window;
+    }
+
+    if (speed <= 0) {
+        rs->top = limit;
+        return rs->top;
+    }
+
+    while (1) {
+        uint64_t elapsed = ns_since(&rs->started) * speed;
+
+        /* Release every record that is due by now. */
+        while (rs->top < limit) {
+            dag_record_t *erfhdr = (dag_record_t *)rs->top;
+
+            if (erf_ts_to_ns(erfhdr) - file->firstts + rs->loopoffset >
+                    elapsed) {
+                break;
+            }
+            rlen = ntohs(erfhdr->rlen);
+            if (rs->top + rlen > limit) {
+                break;
+            }
+            rs->top += rlen;
+        }
+
+        if ((uint64_t)(rs->top - *bottom) >= rs->mindata ||
+                rs->top == limit || waited >= maxwait || is_halted()) {
+            break;
+        }
+
+        usleep(pollns / 1000);
+        waited += pollns;
+    }
+
+    return rs->top;
+}
+
+static int erf_replay_stop(capture_stream_t *cs) {
+    (void) cs;
+    return 0;
+}
+
+static int erf_replay_detach(capture_stream_t *cs) {
+    free(cs->data);
+    cs->data = NULL;
+    return 0;
+}
+
+const capture_ops_t erf_replay_ops = {
+    .name = "erf",
+    .concurrent = 1,
+    .open = erf_replay_open,
+    .close = erf_replay_close,
+    .stream_count = erf_replay_stream_count,
+    .memnode = erf_replay_memnode,
+    .stream_size = erf_replay_stream_size,
+    .attach = erf_replay_attach,
+    .buffer_size = erf_replay_buffer_size,
+    .set_poll = erf_replay_set_poll,
+    .start = erf_replay_start,
+    .advance = erf_replay_advance,
+    .stop = erf_replay_stop,
+    .detach = erf_replay_detach,
+};
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
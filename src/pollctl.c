@@ -0,0 +1,138 @@
+/* Adaptive tuning of the stream polling parameters.
+ *
+ * The DAG returns from dag_advance_stream() once mindata bytes are
+ * available or maxwait has passed, checking every poll interval. Fixed
+ * values either add up to maxwait of latency at low rates, or wake us up
+ * long before a full batch of datagrams is available at high rates.
+ *
+ * Every POLLCTL_INTERVAL the controller looks at the byte rate, how full
+ * the datagrams were and whether the card dropped records, and picks:
+ *
+ *  - maxwait: the latency target, which bounds how long a record can wait.
+ *  - mindata: half of what arrives in maxwait, capped at one full batch of
+ *    datagrams. If datagrams are emptier than the fill target, mindata is
+ *    doubled instead (up to the same cap) to coalesce more per wakeup.
+ *    Drops reset it to the minimum so the buffer is drained early.
+ *  - poll: a quarter of the time it takes to accumulate mindata.
+ *
+ * Changes of mindata smaller than 1/POLLCTL_HYSTERESIS are ignored, and
+ * poll is only recalculated when mindata or maxwait change.
+ */
+
+#include <string.h>
+
+#include "pollctl.h"
+
+static inline uint32_t clamp(uint64_t val, uint32_t lo, uint32_t hi) {
+    if (val < lo) {
+        return lo;
+    }
+    if (val > hi) {
+        return hi;
+    }
+    return val;
+}
+
+void pollctl_merge_params(pollctl_params_t *params,
+        const pollctl_params_t *defaults) {
+    if (params->adaptive < 0) {
+        params->adaptive = defaults->adaptive;
+    }
+    if (params->mindata < 0) {
+        params->mindata = defaults->mindata;
+    }
+    if (params->maxwait < 0) {
+        params->maxwait = defaults->maxwait;
+    }
+    if (params->pollfreq < 0) {
+        params->pollfreq = defaults->pollfreq;
+    }
+    if (params->maxlatency < 0) {
+        params->maxlatency = defaults->maxlatency;
+    }
+    if (params->targetfill < 0) {
+        params->targetfill = defaults->targetfill;
+    }
+}
+
+void pollctl_init(pollctl_t *pc, const pollctl_params_t *params,
+        struct timeval *now) {
+    memset(pc, 0, sizeof(pollctl_t));
+    pc->params = *params;
+    pc->mindata = params->mindata;
+    pc->maxwait = params->maxwait;
+    pc->pollfreq = params->pollfreq;
+    if (params->adaptive && pc->maxwait > (uint32_t)params->maxlatency) {
+        pc->maxwait = params->maxlatency;
+    }
+    pc->last = *now;
+}
+
+int pollctl_update(pollctl_t *pc, struct timeval *now, uint64_t bytes,
+        uint64_t dgrambytes, uint64_t dgramcap, uint64_t drops,
+        uint32_t batchbytes) {
+    uint64_t elapsed, expected;
+    uint32_t mindata, maxwait, pollfreq;
+
+    elapsed = (now->tv_sec - pc->last.tv_sec) * 1000000 +
+            (now->tv_usec - pc->last.tv_usec);
+    if (elapsed == 0) {
+        return 0;
+    }
+
+    pc->rate = (bytes - pc->bytes) * 1000000 / elapsed;
+    pc->fill = dgramcap > pc->dgramcap ?
+            (dgrambytes - pc->dgrambytes) * 100 / (dgramcap - pc->dgramcap) :
+            0;
+
+    if (batchbytes < POLLCTL_MIN_MINDATA) {
+        batchbytes = POLLCTL_MIN_MINDATA;
+    }
+
+    maxwait = pc->params.maxlatency;
+    expected = pc->rate * maxwait / 1000000;
+
+    if (drops != pc->drops) {
+        mindata = POLLCTL_MIN_MINDATA;
+    } else {
+        mindata = clamp(expected / 2, POLLCTL_MIN_MINDATA, batchbytes);
+        if (dgramcap > pc->dgramcap &&
+                pc->fill < (uint32_t)pc->params.targetfill &&
+                pc->mindata * 2 > mindata) {
+            mindata = clamp((uint64_t)pc->mindata * 2, POLLCTL_MIN_MINDATA,
+                    batchbytes);
+        }
+
+        /* Ignore small changes in rate rather than re-tuning every time. */
+        if (mindata < pc->mindata + pc->mindata / POLLCTL_HYSTERESIS &&
+                mindata > pc->mindata - pc->mindata / POLLCTL_HYSTERESIS) {
+            mindata = pc->mindata;
+        }
+    }
+
+    if (mindata == pc->mindata && maxwait == pc->maxwait) {
+        pollfreq = pc->pollfreq;
+    } else if (pc->rate > 0) {
+        pollfreq = clamp((uint64_t)mindata * 1000000 / pc->rate / 4,
+                POLLCTL_MIN_POLL, maxwait / 2);
+    } else {
+        pollfreq = clamp(pc->params.pollfreq, POLLCTL_MIN_POLL, maxwait / 2);
+    }
+
+    pc->last = *now;
+    pc->bytes = bytes;
+    pc->dgrambytes = dgrambytes;
+    pc->dgramcap = dgramcap;
+    pc->drops = drops;
+
+    if (mindata == pc->mindata && maxwait == pc->maxwait &&
+            pollfreq == pc->pollfreq) {
+        return 0;
+    }
+    pc->mindata = mindata;
+    pc->maxwait = maxwait;
+    pc->pollfreq = pollfreq;
+    return 1;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,66 @@
+#ifndef POLLCTL_H_
+#define POLLCTL_H_
+
+#include <stdint.h>
+#include <sys/time.h>
+
+/* How often the adaptive controller re-evaluates the polling parameters. */
+#define POLLCTL_INTERVAL 100000 // microseconds
+
+/* Bounds for the adaptive controller. */
+#define POLLCTL_MIN_MINDATA 64
+#define POLLCTL_MIN_POLL 100 // microseconds
+#define POLLCTL_HYSTERESIS 8
+
+/* Polling parameters for a stream. Negative values are unset while parsing
+ * the config and inherit the global defaults. */
+typedef struct pollctl_params {
+    int adaptive;   // bool
+    int mindata;    // bytes, initial value if adaptive
+    int maxwait;    // microseconds, initial value if adaptive
+    int pollfreq;   // microseconds, initial value if adaptive
+    int maxlatency; // microseconds, upper bound for maxwait if adaptive
+    int targetfill; // percent of datagram capacity to aim for if adaptive
+} pollctl_params_t;
+
+/* Controller state for one stream. */
+typedef struct pollctl {
+    pollctl_params_t params;
+
+    /* Current settings. */
+    uint32_t mindata;
+    uint32_t maxwait;
+    uint32_t pollfreq;
+
+    /* Counter values at the last update. */
+    struct timeval last;
+    uint64_t bytes;
+    uint64_t dgrambytes;
+    uint64_t dgramcap;
+    uint64_t drops;
+
+    /* Observations from the last interval. */
+    uint64_t rate; // bytes per second
+    uint32_t fill; // percent of datagram capacity used
+} pollctl_t;
+
+void pollctl_merge_params(pollctl_params_t *params,
+        const pollctl_params_t *defaults);
+void pollctl_init(pollctl_t *pc, const pollctl_params_t *params,
+        struct timeval *now);
+
+static inline int pollctl_due(pollctl_t *pc, struct timeval *now) {
+    return pc->params.adaptive &&
+            (now->tv_sec - pc->last.tv_sec) * 1000000 +
+            (now->tv_usec - pc->last.tv_usec) >= POLLCTL_INTERVAL;
+}
+
+/* Feed the controller the stream's cumulative counters. Returns 1 if the
+ * polling parameters changed and need to be applied to the stream. */
+int pollctl_update(pollctl_t *pc, struct timeval *now, uint64_t bytes,
+        uint64_t dgrambytes, uint64_t dgramcap, uint64_t drops,
+        uint32_t batchbytes);
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
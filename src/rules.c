@@ -0,0 +1,365 @@
+/* Multi-field rules for sinks. A rule file has one rule per line, made of
+ * fields that all have to match, e.g.
+ *
+ *   proto tcp flags S/SA dport 22-23
+ *   src 192.0.2.0/24 proto udp
+ *
+ * Rules are compiled into a tuple space: a hash table per pair of source
+ * and destination prefix lengths, all kept in one table. A packet is looked
+ * up once for each pair that is in use and the rules found are checked for
+ * protocol, ports and TCP flags.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <wandio.h>
+
+#include "rules.h"
+
+#define RULES_BATCH 64
+#define RULES_MIX 0x9e3779b97f4a7c15ULL
+
+int rules_init(rules_t *rules) {
+    rules->rules = calloc(RULES_MAX, sizeof(rule_t));
+    rules->slots = calloc(RULES_SLOTS, sizeof(rules_slot_t));
+    if (rules->rules == NULL || rules->slots == NULL) {
+        fprintf(stderr, "Failed to allocate memory for rules\n");
+        rules_free(rules);
+        return -1;
+    }
+    rules_reset(rules);
+    return 0;
+}
+
+void rules_free(rules_t *rules) {
+    free(rules->rules);
+    free(rules->slots);
+    rules->rules = NULL;
+    rules->slots = NULL;
+}
+
+void rules_reset(rules_t *rules) {
+    memset(rules->slots, 0, RULES_SLOTS * sizeof(rules_slot_t));
+    rules->rulecnt = 0;
+    rules->tuplecnt = 0;
+    rules->anytuple = -1;
+}
+
+static inline uint32_t rules_hash(uint32_t tuple, uint32_t src, uint32_t dst) {
+    uint64_t hash = ((((uint64_t)src << 32) | dst) + tuple) * RULES_MIX;
+
+    hash ^= hash >> 29;
+    return (uint32_t)((hash * RULES_MIX) >> (64 - RULES_SLOT_BITS));
+}
+
+static int parse_addr(char *str, uint32_t *addr, uint32_t *mask) {
+    struct in_addr in;
+    char *mask_str;
+    int len = 32;
+
+    if ((mask_str = strchr(str, '/')) != NULL) {
+        *mask_str = '\0';
+        len = atoi(mask_str + 1);
+    }
+    if (inet_pton(AF_INET, str, &in) != 1 || len < 0 || len > 32) {
+        return -1;
+    }
+    *mask = len == 0 ? 0 : ~0U << (32 - len);
+    *addr = ntohl(in.s_addr) & *mask;
+    return 0;
+}
+
+static int parse_range(const char *str, uint16_t *lo, uint16_t *hi) {
+    char *end;
+    unsigned long first, last;
+
+    first = strtoul(str, &end, 10);
+    last = first;
+    if (*end == '-') {
+        last = strtoul(end + 1, &end, 10);
+    }
+    if (end == str || *end != '\0' || first > last || last > 65535) {
+        return -1;
+    }
+    *lo = first;
+    *hi = last;
+    return 0;
+}
+
+static int parse_proto(const char *str, uint8_t *proto) {
+    char *end;
+    unsigned long num;
+
+    if (!strcmp(str, "tcp")) {
+        *proto = IPPROTO_TCP;
+    } else if (!strcmp(str, "udp")) {
+        *proto = IPPROTO_UDP;
+    } else if (!strcmp(str, "icmp")) {
+        *proto = IPPROTO_ICMP;
+    } else if (!strcmp(str, "icmp6")) {
+        *proto = IPPROTO_ICMPV6;
+    } else if (!strcmp(str, "sctp")) {
+        *proto = IPPROTO_SCTP;
+    } else {
+        num = strtoul(str, &end, 10);
+        if (end == str || *end != '\0' || num < 1 || num > 255) {
+            return -1;
+        }
+        *proto = num;
+    }
+    return 0;
+}
+
+/* TCP flags as letters, e.g. SA, in the order of their bits. */
+static int parse_flagset(const char *str, const char *end, uint8_t *flags) {
+    static const char letters[] = "FSRPAUEC";
+    const char *pos;
+
+    *flags = 0;
+    for (; str < end; ++str) {
+        if ((pos = strchr(letters, *str)) == NULL) {
+            return -1;
+        }
+        *flags |= 1 << (pos - letters);
+    }
+    return 0;
+}
+
+/* Flags that must be set, optionally followed by the flags that are looked
+ * at, e.g. S/SA for a SYN without ACK. */
+static int parse_flags(const char *str, uint8_t *flags, uint8_t *mask) {
+    const char *slash = strchr(str, '/');
+
+    if (slash == NULL) {
+        if (parse_flagset(str, str + strlen(str), flags) != 0) {
+            return -1;
+        }
+        *mask = *flags;
+        return 0;
+    }
+    if (parse_flagset(str, slash, flags) != 0 ||
+            parse_flagset(slash + 1, slash + strlen(slash), mask) != 0 ||
+            (*flags & ~*mask) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_rule(char *line, rule_t *rule, rules_tuple_t *tuple) {
+    char *save = NULL, *key, *value;
+
+    memset(rule, 0, sizeof(rule_t));
+    rule->sporthi = 65535;
+    rule->dporthi = 65535;
+    tuple->srcmask = 0;
+    tuple->dstmask = 0;
+
+    for (key = strtok_r(line, " \t", &save); key != NULL;
+            key = strtok_r(NULL, " \t", &save)) {
+        if ((value = strtok_r(NULL, " \t", &save)) == NULL) {
+            return -1;
+        }
+        if (!strcmp(key, "src")) {
+            if (parse_addr(value, &rule->src, &tuple->srcmask) != 0) {
+                return -1;
+            }
+        } else if (!strcmp(key, "dst")) {
+            if (parse_addr(value, &rule->dst, &tuple->dstmask) != 0) {
+                return -1;
+            }
+        } else if (!strcmp(key, "proto")) {
+            if (parse_proto(value, &rule->proto) != 0) {
+                return -1;
+            }
+        } else if (!strcmp(key, "sport") || !strcmp(key, "type")) {
+            if (parse_range(value, &rule->sportlo, &rule->sporthi) != 0) {
+                return -1;
+            }
+        } else if (!strcmp(key, "dport") || !strcmp(key, "code")) {
+            if (parse_range(value, &rule->dportlo, &rule->dporthi) != 0) {
+                return -1;
+            }
+        } else if (!strcmp(key, "flags")) {
+            if (parse_flags(value, &rule->flags, &rule->flagmask) != 0) {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+    }
+
+    /* Only TCP has flags. */
+    if (rule->flagmask != 0) {
+        if (rule->proto != 0 && rule->proto != IPPROTO_TCP) {
+            return -1;
+        }
+        rule->proto = IPPROTO_TCP;
+    }
+    return 0;
+}
+
+static int add_rule(rules_t *rules, const rule_t *rule,
+        const rules_tuple_t *tuple) {
+    rules_slot_t *slot;
+    uint32_t i, t;
+
+    if (rules->rulecnt >= RULES_MAX) {
+        fprintf(stderr, "ERROR: More than %d rules\n", RULES_MAX);
+        return -1;
+    }
+
+    for (t = 0; t < (uint32_t)rules->tuplecnt; ++t) {
+        if (rules->tuples[t].srcmask == tuple->srcmask &&
+                rules->tuples[t].dstmask == tuple->dstmask) {
+            break;
+        }
+    }
+    if (t == (uint32_t)rules->tuplecnt) {
+        if (rules->tuplecnt >= RULES_MAX_TUPLES) {
+            fprintf(stderr, "ERROR: Rules use more than %d combinations of "
+                    "prefix lengths\n", RULES_MAX_TUPLES);
+            return -1;
+        }
+        rules->tuples[t] = *tuple;
+        if (tuple->srcmask == 0 && tuple->dstmask == 0) {
+            rules->anytuple = t;
+        }
+        ++rules->tuplecnt;
+    }
+
+    for (i = rules_hash(t, rule->src, rule->dst); rules->slots[i].first != 0;
+            i = (i + 1) & (RULES_SLOTS - 1)) {
+        slot = &rules->slots[i];
+        if (slot->tuple == t && slot->src == rule->src &&
+                slot->dst == rule->dst) {
+            break;
+        }
+    }
+    slot = &rules->slots[i];
+    slot->tuple = t;
+    slot->src = rule->src;
+    slot->dst = rule->dst;
+
+    rules->rules[rules->rulecnt] = *rule;
+    rules->rules[rules->rulecnt].next = slot->first;
+    slot->first = ++rules->rulecnt;
+    return 0;
+}
+
+int rules_parse_file(rules_t *rules, const char *path, color_t color,
+        uint8_t exclude) {
+    io_t *file;
+    char buf[1024];
+    char line[1024];
+    char *start;
+    rule_t rule;
+    rules_tuple_t tuple;
+    int lineno = 0, cnt = 0;
+
+    if ((file = wandio_create(path)) == NULL) {
+        fprintf(stderr, "Failed to open rule file %s\n", path);
+        return -1;
+    }
+
+    while (wandio_fgets(file, buf, sizeof(buf), 1) != 0) {
+        ++lineno;
+        if ((start = strchr(buf, '#')) != NULL) {
+            *start = '\0';
+        }
+        start = buf + strspn(buf, " \t");
+        if (*start == '\0') {
+            continue;
+        }
+
+        snprintf(line, sizeof(line), "%s", start);
+        if (parse_rule(start, &rule, &tuple) != 0) {
+            fprintf(stderr, "ERROR: Malformed rule in %s line %d: %s\n",
+                    path, lineno, line);
+            goto err;
+        }
+        rule.color = color;
+        rule.exclude = exclude;
+        if (add_rule(rules, &rule, &tuple) != 0) {
+            goto err;
+        }
+        ++cnt;
+    }
+
+    fprintf(stderr, "[darkfilter] INFO: Rules %s\n", path);
+    fprintf(stderr, "[darkfilter] INFO: Added %d rules, %d combinations of "
+            "prefix lengths in use\n", cnt, rules->tuplecnt);
+    wandio_destroy(file);
+    return 0;
+
+err:
+    wandio_destroy(file);
+    return -1;
+}
+
+static inline int rule_matches(const rule_t *rule, const erf_flow_t *flow) {
+    return (rule->proto == 0 || rule->proto == flow->proto) &&
+        flow->sport >= rule->sportlo && flow->sport <= rule->sporthi &&
+        flow->dport >= rule->dportlo && flow->dport <= rule->dporthi &&
+        (flow->tcpflags & rule->flagmask) == rule->flags;
+}
+
+void rules_classify_batch(const rules_t *rules, char **recs, color_t *colors,
+        int cnt) {
+    erf_flow_t flows[RULES_BATCH];
+    int idx[RULES_BATCH];
+    const rules_tuple_t *tuple;
+    const rules_slot_t *slot;
+    const rule_t *rule;
+    uint32_t src, dst, r;
+    int done, n, t, i, j, m;
+
+    if (rules->rulecnt == 0) {
+        return;
+    }
+
+    for (done = 0; done < cnt; done += n) {
+        n = cnt - done < RULES_BATCH ? cnt - done : RULES_BATCH;
+
+        /* Only records that are not dropped yet need to be looked at. */
+        for (i = 0, m = 0; i < n; ++i) {
+            if (colors[done + i] != 0 &&
+                    erf_flow((const uint8_t *)recs[done + i], &flows[m])) {
+                idx[m++] = done + i;
+            }
+        }
+
+        /* Look up all records in one tuple at a time. IPv6 records only
+         * match rules without addresses. */
+        for (t = 0; t < rules->tuplecnt; ++t) {
+            tuple = &rules->tuples[t];
+            for (j = 0; j < m; ++j) {
+                if (flows[j].version != 4 && t != rules->anytuple) {
+                    continue;
+                }
+                src = flows[j].src & tuple->srcmask;
+                dst = flows[j].dst & tuple->dstmask;
+                for (i = rules_hash(t, src, dst); rules->slots[i].first != 0;
+                        i = (i + 1) & (RULES_SLOTS - 1)) {
+                    slot = &rules->slots[i];
+                    if (slot->tuple == (uint32_t)t && slot->src == src &&
+                            slot->dst == dst) {
+                        break;
+                    }
+                }
+                for (r = rules->slots[i].first; r != 0; r = rule->next) {
+                    rule = &rules->rules[r - 1];
+                    if (rule_matches(rule, &flows[j])) {
+                        colors[idx[j]] = color_merge(colors[idx[j]],
+                                rule->color, rule->exclude);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,84 @@
+#ifndef RULES_H_
+#define RULES_H_
+
+#include <stdint.h>
+
+#include "dagmultiplexer.h"
+#include "erf.h"
+
+/* Rules are grouped by the prefix lengths of their source and destination,
+ * and found by hashing the masked addresses for each group that is in use
+ * (tuple space search). Rules with the same group and addresses are chained
+ * and checked one by one for the remaining fields. */
+#define RULES_MAX 65536
+#define RULES_SLOT_BITS 17 // keeps the hash table at most half full
+#define RULES_SLOTS (1 << RULES_SLOT_BITS)
+#define RULES_MAX_TUPLES 64 // distinct pairs of prefix lengths
+
+typedef struct rule {
+    uint32_t src; // masked, in host byte order
+    uint32_t dst;
+    uint16_t sportlo; // ICMP type for ICMP
+    uint16_t sporthi;
+    uint16_t dportlo; // ICMP code for ICMP
+    uint16_t dporthi;
+    uint8_t proto; // 0 for any
+    uint8_t flags; // TCP flags that must be set among flagmask
+    uint8_t flagmask;
+    uint8_t exclude; // bool, of the sink that the rule belongs to
+    color_t color;
+    uint32_t next; // index + 1 of the next rule in the chain, 0 at the end
+} rule_t;
+
+typedef struct rules_tuple {
+    uint32_t srcmask;
+    uint32_t dstmask;
+} rules_tuple_t;
+
+typedef struct rules_slot {
+    uint32_t src;
+    uint32_t dst;
+    uint32_t tuple;
+    uint32_t first; // index + 1 of the first rule, 0 if the slot is empty
+} rules_slot_t;
+
+typedef struct rules {
+    rule_t *rules;
+    uint32_t rulecnt;
+    rules_slot_t *slots;
+    rules_tuple_t tuples[RULES_MAX_TUPLES];
+    int tuplecnt;
+    int anytuple; // the tuple without addresses, which IPv6 packets use
+} rules_t;
+
+/* Merge the color of a sink whose filter matched into the color of a
+ * packet, see telescope.h for the rules. Dropping wins, sinks that exclude
+ * traffic take it from the default sink and from sinks that mirror it. */
+static inline color_t color_merge(color_t entry, color_t color,
+        uint8_t exclude) {
+    if (entry == 0 || color == 0) {
+        return 0;
+    }
+    if (entry & 1) {
+        return exclude ? color : entry | color;
+    }
+    return exclude ? entry | color : entry;
+}
+
+int rules_init(rules_t *rules);
+void rules_free(rules_t *rules);
+void rules_reset(rules_t *rules);
+
+/* Add the rules of a rule file for a sink. Returns 0, or -1 if the file
+ * could not be read or does not parse. */
+int rules_parse_file(rules_t *rules, const char *path, color_t color,
+        uint8_t exclude);
+
+/* Merge the colors of the sinks whose rules match each record into colors.
+ * Records with color 0 are left alone. */
+void rules_classify_batch(const rules_t *rules, char **recs, color_t *colors,
+        int cnt);
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
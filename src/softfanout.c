@@ -0,0 +1,587 @@
+/* Software fan-out of a capture source into several streams.
+ *
+ * Some sources deliver everything on a single hot stream, e.g. a DAG
+ * without hardware load balancing. Walking that stream on one core limits
+ * the whole telescope to what that core can filter and send.
+ *
+ * This backend wraps another source. For every stream of the inner
+ * source, a capture thread walks the records, hashes their 5-tuple and
+ * hands a descriptor (a pointer into the inner buffer, not a copy) to one
+ * of N workers over a single-producer/single-consumer ring. Each worker is
+ * exposed as an ordinary stream with a window over an array of record
+ * pointers, so it gets its own encapsulation state, multicast port and
+ * beacon entry. All records of a flow go to the same worker, in order.
+ *
+ * The inner buffer is released up to the oldest record that a worker has
+ * not finished with yet. Workers acknowledge records a window at a time,
+ * when they ask for the next window after sending the previous one.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <numa.h>
+#include <netinet/in.h>
+
+#include <dagapi.h>
+
+#include "capture.h"
+#include "dagmultiplexer.h"
+#include "erf.h"
+
+#define SOFTFANOUT_RING_SIZE 65536 // descriptors per worker, power of two
+#define SOFTFANOUT_WINDOW 4096 // records handed to a worker per advance
+#define SOFTFANOUT_WAIT 20 // microseconds
+#define SOFTFANOUT_MIN_POLL 10 // microseconds
+
+typedef struct fanout_desc {
+    char *rec;
+    uint64_t end; // inner stream offset just past the record
+} fanout_desc_t;
+
+typedef struct fanout_ring {
+    fanout_desc_t *descs;
+    uint32_t head; // written by the capture thread
+    uint32_t tail; // written by the worker
+    uint64_t acked; // end of the last record the worker is done with
+
+    /* Only used by the capture thread. */
+    uint64_t assigned; // end of the last record pushed
+    uint64_t floor; // start of the first record pushed since it was idle
+    uint64_t records;
+
+    int closed; // the worker has stopped, skip its records
+} fanout_ring_t;
+
+struct softfanout;
+
+/* One stream of the inner source and the capture thread walking it. */
+typedef struct fanout_input {
+    struct softfanout *fo;
+    capture_stream_t cs;
+    int attached; // number of attached workers
+    int started; // number of started workers
+
+    uint32_t mindata;
+    struct timeval maxwait;
+    struct timeval poll;
+    uint8_t pollset;
+
+    pthread_t tid;
+    int stop;
+
+    fanout_ring_t *rings;
+    uint64_t stalls;
+    uint64_t dropped;
+} fanout_input_t;
+
+typedef struct softfanout {
+    capture_source_t *inner;
+    int workers;
+    int inputcnt;
+    fanout_input_t *inputs;
+    pthread_mutex_t mutex;
+} softfanout_t;
+
+/* One worker, i.e. one stream as seen by the multiplexer. */
+typedef struct fanout_stream {
+    fanout_input_t *input;
+    fanout_ring_t *ring;
+    char **recs;
+    uint32_t reccnt;
+    uint64_t windowend;
+    uint32_t maxwait; // microseconds
+    uint32_t poll; // microseconds
+} fanout_stream_t;
+
+/* Offset of the inner stream up to which no worker needs the records. */
+static uint64_t fanout_released(fanout_input_t *input, uint64_t walkoff) {
+    softfanout_t *fo = input->fo;
+    fanout_ring_t *ring;
+    uint64_t released = walkoff, acked;
+    int i;
+
+    for (i = 0; i < fo->workers; ++i) {
+        ring = &input->rings[i];
+        acked = __atomic_load_n(&ring->acked, __ATOMIC_ACQUIRE);
+        if (acked == ring->assigned ||
+                __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        /* Both are at or before the first record still in use. */
+        if (ring->floor > acked) {
+            acked = ring->floor;
+        }
+        if (acked < released) {
+            released = acked;
+        }
+    }
+    return released;
+}
+
+static int fanout_push(fanout_ring_t *ring, char *rec, uint64_t start,
+        uint64_t end) {
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    fanout_desc_t *desc;
+
+    if (ring->head - tail == SOFTFANOUT_RING_SIZE) {
+        return 0;
+    }
+    if (__atomic_load_n(&ring->acked, __ATOMIC_ACQUIRE) == ring->assigned) {
+        ring->floor = start;
+    }
+
+    desc = &ring->descs[ring->head & (SOFTFANOUT_RING_SIZE - 1)];
+    desc->rec = rec;
+    desc->end = end;
+    ring->assigned = end;
+    ring->records++;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void *fanout_capture(void *data) {
+    fanout_input_t *input = (fanout_input_t *)data;
+    softfanout_t *fo = input->fo;
+    capture_source_t *inner = fo->inner;
+    int reclist = inner->ops->reclist;
+    uint8_t *bottom = NULL, *top, *walk;
+    uint64_t bottomoff = 0, walkoff = 0, released;
+    fanout_ring_t *ring;
+    char *rec;
+    uint32_t step;
+    int node, progress;
+
+    node = capture_memnode(inner, input->cs.streamnum);
+    if (node >= 0) {
+        numa_run_on_node(node);
+    }
+
+    while (!__atomic_load_n(&input->stop, __ATOMIC_ACQUIRE) && !is_halted()) {
+        released = fanout_released(input, walkoff);
+        if (bottom) {
+            bottom += released - bottomoff;
+        }
+        bottomoff = released;
+
+        top = inner->ops->advance(&input->cs, &bottom);
+        if (top == NULL) {
+            fprintf(stderr, "Error while advancing stream %d for fan-out: "
+                    "%s\n", input->cs.streamnum, strerror(errno));
+            halt_program();
+            break;
+        }
+
+        walk = bottom + (walkoff - bottomoff);
+        progress = 0;
+        while (walk < top) {
+            if (reclist) {
+                rec = *(char **)walk;
+                step = sizeof(char *);
+            } else {
+                if (top - walk < dag_record_size) {
+                    break;
+                }
+                rec = (char *)walk;
+                step = ntohs(((dag_record_t *)rec)->rlen);
+                if (step < dag_record_size) {
+                    fprintf(stderr, "Corrupt record on stream %d, stopping "
+                            "fan-out.\n", input->cs.streamnum);
+                    halt_program();
+                    goto capturedone;
+                }
+                if ((uint32_t)(top - walk) < step) {
+                    break;
+                }
+            }
+
+            ring = &input->rings[((uint64_t)erf_flow_hash((uint8_t *)rec) *
+                    fo->workers) >> 32];
+            if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+                input->dropped++;
+            } else if (!fanout_push(ring, rec, walkoff, walkoff + step)) {
+                /* Wait for the worker rather than reorder its flows. */
+                input->stalls++;
+                break;
+            }
+            walk += step;
+            walkoff += step;
+            progress = 1;
+        }
+
+        if (!progress && walkoff != bottomoff) {
+            usleep(SOFTFANOUT_WAIT);
+        }
+    }
+
+capturedone:
+    pthread_exit(NULL);
+}
+
+static void softfanout_close(capture_source_t *src) {
+    softfanout_t *fo = (softfanout_t *)src->data;
+    int i, j;
+
+    if (fo == NULL) {
+        return;
+    }
+
+    if (fo->inputs) {
+        for (i = 0; i < fo->inputcnt; ++i) {
+            if (fo->inputs[i].rings == NULL) {
+                continue;
+            }
+            for (j = 0; j < fo->workers; ++j) {
+                free(fo->inputs[i].rings[j].descs);
+            }
+            free(fo->inputs[i].rings);
+        }
+        free(fo->inputs);
+    }
+    pthread_mutex_destroy(&fo->mutex);
+    capture_close(fo->inner);
+    free(fo);
+    src->data = NULL;
+}
+
+static int softfanout_open(capture_source_t *src) {
+    softfanout_t *fo = (softfanout_t *)src->data;
+    fanout_input_t *input;
+    int i, j;
+
+    fo->workers = src->opts->softfanout;
+    fo->inputcnt = capture_enumerate(fo->inner);
+    if (fo->inputcnt < 0) {
+        return -1;
+    }
+
+    fo->inputs = (fanout_input_t *)calloc(fo->inputcnt,
+            sizeof(fanout_input_t));
+    if (fo->inputs == NULL) {
+        fprintf(stderr, "Failed to allocate memory for software fan-out\n");
+        return -1;
+    }
+
+    for (i = 0; i < fo->inputcnt; ++i) {
+        input = &fo->inputs[i];
+        input->fo = fo;
+        input->cs.src = fo->inner;
+        input->cs.streamnum = i * 2;
+        input->rings = (fanout_ring_t *)calloc(fo->workers,
+                sizeof(fanout_ring_t));
+        if (input->rings == NULL) {
+            goto fanoutopenfail;
+        }
+        for (j = 0; j < fo->workers; ++j) {
+            input->rings[j].descs = (fanout_desc_t *)malloc(
+                    sizeof(fanout_desc_t) * SOFTFANOUT_RING_SIZE);
+            if (input->rings[j].descs == NULL) {
+                goto fanoutopenfail;
+            }
+        }
+    }
+
+    fprintf(stderr, "Fanning out each %s stream to %d streams in software\n",
+            fo->inner->ops->name, fo->workers);
+    return 0;
+
+fanoutopenfail:
+    fprintf(stderr, "Failed to allocate memory for software fan-out rings\n");
+    return -1;
+}
+
+static int softfanout_stream_count(capture_source_t *src) {
+    softfanout_t *fo = (softfanout_t *)src->data;
+
+    return fo->inputcnt * fo->workers;
+}
+
+static int softfanout_memnode(capture_source_t *src, int streamnum) {
+    softfanout_t *fo = (softfanout_t *)src->data;
+
+    return capture_memnode(fo->inner, (streamnum / 2 / fo->workers) * 2);
+}
+
+/* Every worker of an inner stream shares its buffer. */
+static int64_t softfanout_stream_size(capture_source_t *src, int streamnum) {
+    softfanout_t *fo = (softfanout_t *)src->data;
+    int idx = streamnum / 2 / fo->workers;
+
+    if (idx >= fo->inner->streamcnt) {
+        return -1;
+    }
+    return fo->inner->streams[idx].buffersize;
+}
+
+static int softfanout_attach(capture_stream_t *cs, uint32_t window) {
+    softfanout_t *fo = (softfanout_t *)cs->src->data;
+    fanout_input_t *input;
+    fanout_stream_t *fs;
+    int idx = cs->streamnum / 2;
+    int err;
+
+    if (idx >= fo->inputcnt * fo->workers) {
+        errno = EINVAL;
+        return -1;
+    }
+    input = &fo->inputs[idx / fo->workers];
+
+    fs = (fanout_stream_t *)calloc(1, sizeof(fanout_stream_t));
+    if (fs == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    fs->recs = (char **)malloc(sizeof(char *) * SOFTFANOUT_WINDOW);
+    if (fs->recs == NULL) {
+        free(fs);
+        errno = ENOMEM;
+        return -1;
+    }
+    fs->input = input;
+    fs->ring = &input->rings[idx % fo->workers];
+
+    pthread_mutex_lock(&fo->mutex);
+    if (input->attached == 0 &&
+            fo->inner->ops->attach(&input->cs, window) != 0) {
+        err = errno;
+        pthread_mutex_unlock(&fo->mutex);
+        free(fs->recs);
+        free(fs);
+        errno = err;
+        return -1;
+    }
+    input->attached++;
+    pthread_mutex_unlock(&fo->mutex);
+
+    cs->data = fs;
+    return 0;
+}
+
+static int64_t softfanout_buffer_size(capture_stream_t *cs) {
+    fanout_stream_t *fs = (fanout_stream_t *)cs->data;
+    capture_source_t *inner = fs->input->fo->inner;
+
+    return inner->ops->buffer_size(&fs->input->cs);
+}
+
+static int softfanout_set_poll(capture_stream_t *cs, uint32_t mindata,
+        struct timeval *maxwait, struct timeval *poll) {
+    fanout_stream_t *fs = (fanout_stream_t *)cs->data;
+    fanout_input_t *input = fs->input;
+
+    fs->maxwait = maxwait->tv_sec * 1000000 + maxwait->tv_usec;
+    fs->poll = poll->tv_sec * 1000000 + poll->tv_usec;
+    if (fs->poll < SOFTFANOUT_MIN_POLL) {
+        fs->poll = SOFTFANOUT_MIN_POLL;
+    }
+
+    /* The capture thread has a core to itself, so the inner stream keeps
+     * the first settings that block, whatever its workers change to. */
+    pthread_mutex_lock(&input->fo->mutex);
+    if (!input->pollset && (maxwait->tv_sec > 0 || maxwait->tv_usec > 0)) {
+        input->mindata = mindata;
+        input->maxwait = *maxwait;
+        input->poll = *poll;
+        input->pollset = 1;
+    }
+    pthread_mutex_unlock(&input->fo->mutex);
+    return 0;
+}
+
+static int softfanout_start(capture_stream_t *cs) {
+    fanout_stream_t *fs = (fanout_stream_t *)cs->data;
+    fanout_input_t *input = fs->input;
+    softfanout_t *fo = input->fo;
+    capture_source_t *inner = fo->inner;
+    struct timeval maxwait, poll;
+
+    pthread_mutex_lock(&fo->mutex);
+    __atomic_store_n(&fs->ring->closed, 0, __ATOMIC_RELEASE);
+    if (input->started > 0) {
+        input->started++;
+        pthread_mutex_unlock(&fo->mutex);
+        return 0;
+    }
+
+    if (!input->pollset) {
+        maxwait.tv_sec = 0;
+        maxwait.tv_usec = DAG_POLL_MAXWAIT;
+        poll.tv_sec = 0;
+        poll.tv_usec = DAG_POLL_FREQ;
+        input->mindata = DAG_POLL_MINDATA;
+        input->maxwait = maxwait;
+        input->poll = poll;
+    }
+    if (inner->ops->set_poll(&input->cs, input->mindata, &input->maxwait,
+                &input->poll) != 0 || inner->ops->start(&input->cs) != 0) {
+        pthread_mutex_unlock(&fo->mutex);
+        return -1;
+    }
+
+    input->stop = 0;
+    if (pthread_create(&input->tid, NULL, fanout_capture, input) != 0) {
+        fprintf(stderr, "Failed to create fan-out thread for stream %d\n",
+                input->cs.streamnum);
+        inner->ops->stop(&input->cs);
+        pthread_mutex_unlock(&fo->mutex);
+        return -1;
+    }
+    input->started = 1;
+    pthread_mutex_unlock(&fo->mutex);
+    return 0;
+}
+
+static uint8_t *softfanout_advance(capture_stream_t *cs, uint8_t **bottom) {
+    fanout_stream_t *fs = (fanout_stream_t *)cs->data;
+    fanout_ring_t *ring = fs->ring;
+    uint8_t *start = (uint8_t *)fs->recs;
+    uint8_t *end = (uint8_t *)(fs->recs + fs->reccnt);
+    uint32_t head, tail, cnt, i, waited = 0;
+
+    /* Still walking the current window. */
+    if (*bottom >= start && *bottom < end) {
+        return end;
+    }
+
+    /* The previous window has been sent, the capture thread can have it. */
+    if (fs->reccnt > 0) {
+        __atomic_store_n(&ring->acked, fs->windowend, __ATOMIC_RELEASE);
+        fs->reccnt = 0;
+    }
+    *bottom = start;
+
+    tail = ring->tail;
+    while ((head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) == tail) {
+        if (waited >= fs->maxwait || is_halted()) {
+            return start;
+        }
+        usleep(fs->poll);
+        waited += fs->poll;
+    }
+
+    cnt = head - tail;
+    if (cnt > SOFTFANOUT_WINDOW) {
+        cnt = SOFTFANOUT_WINDOW;
+    }
+    for (i = 0; i < cnt; ++i) {
+        fs->recs[i] = ring->descs[(tail + i) & (SOFTFANOUT_RING_SIZE - 1)].rec;
+    }
+    fs->windowend = ring->descs[(tail + cnt - 1) &
+            (SOFTFANOUT_RING_SIZE - 1)].end;
+    fs->reccnt = cnt;
+    __atomic_store_n(&ring->tail, tail + cnt, __ATOMIC_RELEASE);
+
+    return (uint8_t *)(fs->recs + cnt);
+}
+
+static int softfanout_stop(capture_stream_t *cs) {
+    fanout_stream_t *fs = (fanout_stream_t *)cs->data;
+    fanout_input_t *input = fs->input;
+    softfanout_t *fo = input->fo;
+    int ret = 0, i;
+
+    pthread_mutex_lock(&fo->mutex);
+    __atomic_store_n(&fs->ring->closed, 1, __ATOMIC_RELEASE);
+    if (input->started == 0 || --input->started > 0) {
+        pthread_mutex_unlock(&fo->mutex);
+        return 0;
+    }
+
+    __atomic_store_n(&input->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(input->tid, NULL);
+    ret = fo->inner->ops->stop(&input->cs);
+
+    fprintf(stderr, "Fan-out of stream %d: %"PRIu64" ring stalls, "
+            "%"PRIu64" records dropped for stopped workers\n", input->cs.streamnum,
+            input->stalls, input->dropped);
+    for (i = 0; i < fo->workers; ++i) {
+        fanout_ring_t *ring = &input->rings[i];
+
+        fprintf(stderr, "    worker %d (stream %d): %"PRIu64" records\n", i,
+                ((input->cs.streamnum / 2) * fo->workers + i) * 2,
+                ring->records);
+
+        /* Start from scratch if the stream is started again. */
+        ring->head = ring->tail = 0;
+        ring->acked = ring->assigned = ring->floor = 0;
+        ring->records = 0;
+    }
+    input->stalls = input->dropped = 0;
+    pthread_mutex_unlock(&fo->mutex);
+    return ret;
+}
+
+static int softfanout_detach(capture_stream_t *cs) {
+    fanout_stream_t *fs = (fanout_stream_t *)cs->data;
+    fanout_input_t *input = fs->input;
+    softfanout_t *fo = input->fo;
+    int ret = 0;
+
+    pthread_mutex_lock(&fo->mutex);
+    if (--input->attached == 0) {
+        ret = fo->inner->ops->detach(&input->cs);
+        input->pollset = 0;
+    }
+    pthread_mutex_unlock(&fo->mutex);
+
+    free(fs->recs);
+    free(fs);
+    cs->data = NULL;
+    return ret;
+}
+
+const capture_ops_t softfanout_ops = {
+    .name = "softfanout",
+    .reclist = 1,
+    .concurrent = 1,
+    .open = softfanout_open,
+    .close = softfanout_close,
+    .stream_count = softfanout_stream_count,
+    .memnode = softfanout_memnode,
+    .stream_size = softfanout_stream_size,
+    .attach = softfanout_attach,
+    .buffer_size = softfanout_buffer_size,
+    .set_poll = softfanout_set_poll,
+    .start = softfanout_start,
+    .advance = softfanout_advance,
+    .stop = softfanout_stop,
+    .detach = softfanout_detach,
+};
+
+capture_source_t *softfanout_wrap(capture_source_t *inner) {
+    capture_source_t *src;
+    softfanout_t *fo;
+
+    src = (capture_source_t *)malloc(sizeof(capture_source_t));
+    fo = (softfanout_t *)calloc(1, sizeof(softfanout_t));
+    if (src == NULL || fo == NULL) {
+        fprintf(stderr, "Failed to allocate memory for software fan-out\n");
+        free(src);
+        free(fo);
+        capture_close(inner);
+        return NULL;
+    }
+
+    fo->inner = inner;
+    pthread_mutex_init(&fo->mutex, NULL);
+    src->ops = &softfanout_ops;
+    src->opts = inner->opts;
+    src->fd = -1;
+    src->data = fo;
+    src->streams = NULL;
+    src->streamcnt = 0;
+
+    if (src->ops->open(src) != 0) {
+        capture_close(src);
+        return NULL;
+    }
+    return src;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
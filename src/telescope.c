@@ -22,25 +22,26 @@
 #include "ndagmulticaster.h"
 #include "byteswap.h"
 #include "darkfilter.h"
+#include "erf.h"
 
 /* Check if bit at position `needle` is set in `haystack`. */
 #define IS_SET(haystack, needle) (((haystack >> needle) & 0x1) != 0)
 
 /* Hide the needle at bit `pos` in `haystack`. */
-#define SET_IT(haystack, position) (haystack |= (0x1 << position))
+#define SET_IT(haystack, position) (haystack |= ((color_t)0x1 << position))
+
+/* Records classified at once, and how far ahead their headers are fetched. */
+#define WALK_CLASSIFY_BATCH 128
+#define WALK_PREFETCH_RECORDS 8
+#define WALK_PREFETCH_BYTES 4096
 
 static volatile sig_atomic_t reload = 0;
 static pthread_t darkfilter_tid;
 
-static int leading_zeros(uint8_t color) {
+static int leading_zeros(color_t color) {
   assert(color > 0);
-  int cnt = 0;
-  /* Count by hand. There may be compiler intrinsics for this, but I'm not
-   * sure how they compare speed-wise and at what point they pay off. */
-  while (((color >> cnt) & 1) == 0) {
-    ++cnt;
-  }
-  return cnt;
+  /* Despite the name, this is the index of the lowest bit set. */
+  return __builtin_ctz(color);
 }
 
 static void reload_signal(int signal) {
@@ -48,43 +49,337 @@ static void reload_signal(int signal) {
     reload = 1;
 }
 
-/* Add the packet to the state with color. Note down collected bytes. */
-static void append(iov_data_t *iov, uint16_t curiov, int color,
-        char *bottom, uint16_t len, uint32_t *collected) {
-    if (iov->vec[curiov].iov_base == NULL) {
-        iov->vec[curiov].iov_base = bottom;
+/* Double the iovecs of a sink. They come from the worker memory, so the old
+ * vector is only given back when the stream goes away. */
+static int grow(iov_data_t *iov) {
+    struct iovec *vec = (struct iovec *) workermem_alloc(iov->mem,
+            sizeof(struct iovec) * iov->len * 2);
+
+    /* The worker memory is sized so that this does not happen. */
+    if (vec == NULL) {
+        fprintf(stderr, "Out of worker memory for iovecs.\n");
+        halt_program();
+        return -1;
     }
-    iov->vec[curiov].iov_len += len;
-    *collected += len;
+    memcpy(vec, iov->vec, sizeof(struct iovec) * iov->len);
+    iov->vec = vec;
+    iov->len *= 2;
+    return 0;
 }
 
 /* End an iov and allocate a new one if necessary. */
 static void end(iov_data_t *iov, uint16_t *curiov) {
     if (iov->vec[*curiov].iov_len != 0) {
-        *curiov = *curiov + 1;
         /* Allocate more iovs if we don't have enough. */
-        if (*curiov == iov->len) {
-            iov->vec = (struct iovec *) realloc(iov->vec,
-                    sizeof(struct iovec) * (iov->len + 10));
-            iov->len += 10;
+        if (*curiov + 1 == iov->len && grow(iov) != 0) {
+            return;
         }
+        *curiov = *curiov + 1;
         iov->vec[*curiov].iov_base = NULL;
         iov->vec[*curiov].iov_len = 0;
     }
 }
 
-static char * walk_stream_buffer(char *bottom, char *top,
+/* Add a run of records to an iovec of a sink. Note down collected bytes.
+ * A run that does not directly follow the current iov starts a new one. */
+static void append(iov_data_t *iov, uint16_t *curiov, char *rec, uint32_t len,
+        uint32_t *collected) {
+    if (iov->vec[*curiov].iov_base != NULL &&
+            (char *)iov->vec[*curiov].iov_base + iov->vec[*curiov].iov_len
+                != rec) {
+        end(iov, curiov);
+    }
+    if (iov->vec[*curiov].iov_base == NULL) {
+        iov->vec[*curiov].iov_base = rec;
+    }
+    iov->vec[*curiov].iov_len += len;
+    *collected += len;
+}
+
+/* Sinks among sinks whose sampling skips a record. Flows are sampled by
+ * their hash, so a sink gets all packets of a flow or none, and packets by
+ * a hash of their flow and timestamp. Either only depends on the record. */
+static inline color_t sample_record(const dagstreamthread_t *dst,
+        const uint8_t *rec, color_t sinks) {
+    uint32_t flowhash = erf_flow_hash(rec), pkthash, hash;
+    uint64_t ts = ((const dag_record_t *)rec)->ts;
+    color_t skipped = 0;
+    unsigned int i;
+
+    pkthash = (flowhash ^ (uint32_t)ts ^ (uint32_t)(ts >> 32)) * 0x9e3779b1;
+    pkthash ^= pkthash >> 16;
+    pkthash *= 0x85ebca6b;
+    pkthash ^= pkthash >> 13;
+    for (; sinks != 0; sinks &= sinks - 1) {
+        i = __builtin_ctz(sinks);
+        hash = IS_SET(dst->sampleflowmask, i) ? flowhash : pkthash;
+        if (hash % dst->samplerate[i] != 0) {
+            skipped |= (color_t)1 << i;
+        }
+    }
+    return skipped;
+}
+
+/* The record an entry of the index stands for. */
+static inline char *entry_rec(const walk_entry_t *entry, int reclist) {
+    return reclist ? *(char **)entry->pos : entry->pos;
+}
+
+/* Where the window goes on after an entry. */
+static inline char *entry_end(const walk_entry_t *entry, int reclist) {
+    return entry->pos + (reclist ? sizeof(char *) : entry->rlen);
+}
+
+/* Check that the window still starts with the records the index kept from
+ * the last walk. The capture source may have moved on to another buffer,
+ * or refilled the same one, since. */
+static inline int index_carries(const walk_index_t *ix, char *bottom,
+        char *top, int reclist) {
+    const walk_entry_t *first = &ix->entries[ix->start];
+
+    return ix->start < ix->end && first->pos == bottom && ix->next <= top &&
+        entry_rec(first, reclist) == ix->firstrec &&
+        ((dag_record_t *)ix->firstrec)->ts == ix->firstts;
+}
+
+/* Move the entries from start on to the front of the index, to make room
+ * for more. */
+static inline void index_compact(walk_index_t *ix, int start) {
+    memmove(ix->entries, ix->entries + start,
+            sizeof(walk_entry_t) * (ix->end - start));
+    ix->end -= start;
+    ix->start = 0;
+}
+
+/* Index up to WALK_CLASSIFY_BATCH more records of the window and classify
+ * them at once, so the datagrams can be built without chasing rlen through
+ * the buffer. Each header sits somewhere in the lines ahead of the last
+ * one, so every line is prefetched up to a fixed distance ahead, far enough
+ * to keep the memory busy while a batch is classified and walked. With a
+ * list of records the pointers tell exactly where the next ones are.
+ * Indexing stops at a partial record or once the index is full. Returns
+ * the number of records added, or -1 if the filter failed. */
+static int index_records(walk_index_t *ix, char *top, dagstreamthread_t *dst,
+        darkfilter_t *filter, int reclist) {
+    char *recs[WALK_CLASSIFY_BATCH];
+    color_t colors[WALK_CLASSIFY_BATCH];
+    dedup_t *dedup = dst->dedup;
+    walk_entry_t *entry = &ix->entries[ix->end];
+    dag_record_t *erfhdr;
+    char *next = ix->next, *ahead = ix->ahead, *rec;
+    int n, i;
+
+    /* Indexing follows rlen from record to record, so where it is stays in
+     * locals rather than going through the index. */
+    for (n = 0; n < WALK_CLASSIFY_BATCH && ix->end + n < WALK_INDEX_SIZE &&
+            next < top; ++n, ++entry) {
+        if (reclist) {
+            rec = *(char **)next;
+            if (next + WALK_PREFETCH_RECORDS * sizeof(char *) < top) {
+                __builtin_prefetch(*(char **)(next +
+                            WALK_PREFETCH_RECORDS * sizeof(char *)));
+            }
+        } else {
+            rec = next;
+            if (ahead < rec) {
+                ahead = rec;
+            }
+            for (; ahead < rec + WALK_PREFETCH_BYTES && ahead < top;
+                    ahead += 64) {
+                __builtin_prefetch(ahead);
+            }
+        }
+
+        erfhdr = (dag_record_t *)rec;
+        entry->rlen = ntohs(erfhdr->rlen);
+        if (!reclist && top - rec < entry->rlen) {
+            /* Partial record in the buffer, nothing more to index. */
+            break;
+        }
+        entry->pos = next;
+        entry->wlen = ntohs(erfhdr->wlen);
+        entry->lctr = ntohs(erfhdr->lctr);
+        entry->hdrlen = dst->headersmask ?
+            erf_headers_len((uint8_t *)rec) : entry->rlen;
+        recs[n] = rec;
+        next = entry_end(entry, reclist);
+    }
+    ix->ahead = ahead;
+
+    if (filter && n > 0 && apply_darkfilter_batch(filter, recs, colors,
+                n) != 0) {
+        fprintf(stderr, "Error applying darknet filter to received "
+                "traffic.\n");
+        halt_program();
+        return -1;
+    }
+
+    entry = &ix->entries[ix->end];
+    for (i = 0; i < n; ++i, ++entry) {
+        entry->color = filter ? colors[i] : 1;
+        entry->sampled = 0;
+        entry->dup = 0;
+        /* Only packets that would be sent need to be looked for. */
+        if (dedup && entry->color != 0 &&
+                dedup_check(dedup, (uint8_t *)recs[i])) {
+            entry->dup = 1;
+            entry->color = 0;
+        }
+        if (entry->color & dst->samplemask) {
+            entry->sampled = sample_record(dst, (uint8_t *)recs[i],
+                    entry->color & dst->samplemask);
+            entry->color &= ~entry->sampled;
+        }
+    }
+    ix->next = next;
+    ix->end += n;
+    return n;
+}
+
+/* Copy a run of records into the staging buffer of a sink and add them to
+ * its iovecs from there, where they join up with other copied runs.
+ * Returns 0 if the staging buffer has no room left. */
+static inline int stage(iov_data_t *iov, uint16_t *curiov,
+        walk_entry_t *entries, int run, int reclist, uint32_t runlen,
+        uint32_t *collected) {
+    char *dest = iov->staging + iov->stagingused;
+    uint32_t off = 0;
+    int r;
+
+    if (iov->stagingused + runlen > iov->stagingsize) {
+        return 0;
+    }
+    if (!reclist) {
+        memcpy(dest, entries[0].pos, runlen);
+    } else {
+        for (r = 0; r < run; ++r) {
+            memcpy(dest + off, entry_rec(&entries[r], reclist),
+                    entries[r].rlen);
+            off += entries[r].rlen;
+        }
+    }
+    iov->stagingused += runlen;
+    append(iov, curiov, dest, runlen, collected);
+    return 1;
+}
+
+/* Number of bytes of a record a sink sends, once it is cut short. */
+static inline uint16_t cut_len(const iov_data_t *iov,
+        const walk_entry_t *entry) {
+    uint16_t len = iov->headersonly ? entry->hdrlen : entry->rlen;
+
+    if (iov->snaplen > 0 && iov->snaplen < len) {
+        len = iov->snaplen;
+    }
+    return len;
+}
+
+/* Number of bytes a sink that cuts records short adds for a record, when
+ * the records before it will take staged more bytes of the staging buffer.
+ * A record is only cut if its copy fits the staging buffer, otherwise it is
+ * sent whole. */
+static inline uint16_t cut_send_len(const iov_data_t *iov,
+        const walk_entry_t *entry, uint32_t staged) {
+    uint16_t len = cut_len(iov, entry);
+
+    if (len < entry->rlen &&
+            iov->stagingused + staged + len <= iov->stagingsize) {
+        return len;
+    }
+    return entry->rlen;
+}
+
+/* Add a run of records to a sink that cuts them short. Records that are cut
+ * are copied into the staging buffer with their rlen adjusted, while wlen
+ * keeps the length on the wire. Records that are short enough already, or
+ * no longer fit the staging buffer, are sent whole. Returns the number of
+ * bytes added. */
+static inline uint32_t cut_run(iov_data_t *iov, uint16_t *curiov,
+        walk_entry_t *entries, int run, int reclist,
+        uint32_t *collected, uint32_t *copied, uint32_t *saved) {
+    uint32_t added = 0;
+    uint16_t len;
+    char *rec, *dest;
+    int r;
+
+    for (r = 0; r < run; ++r) {
+        rec = entry_rec(&entries[r], reclist);
+        len = cut_send_len(iov, &entries[r], 0);
+        if (len < entries[r].rlen) {
+            dest = iov->staging + iov->stagingused;
+            memcpy(dest, rec, len);
+            ((dag_record_t *)dest)->rlen = htons(len);
+            iov->stagingused += len;
+            append(iov, curiov, dest, len, collected);
+            *copied += len;
+            *saved += entries[r].rlen - len;
+        } else {
+            len = entries[r].rlen;
+            append(iov, curiov, rec, len, collected);
+        }
+        added += len;
+    }
+    return added;
+}
+
+/* Check whether a record still fits the datagrams of all sinks in color,
+ * after the run of runlen bytes that is about to be added to them. A record
+ * always fits an empty datagram, see the note on truncation below. */
+static inline int run_fits(dagstreamthread_t *dst, uint32_t *collected,
+        color_t sinks, uint32_t runlen, uint16_t len) {
+    unsigned int i;
+
+    for (; sinks != 0; sinks &= sinks - 1) {
+        i = __builtin_ctz(sinks);
+        if (collected[i] + runlen > 0 &&
+                collected[i] + runlen + len > dst->iovs[i].maxsize) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* The same for sinks that cut records short, with the lengths of the run
+ * as sent by each of them in cutrun and the staging it takes in cutstaged.
+ * The record is checked at the length cut_run() will add, whole once the
+ * staging buffer is full. */
+static inline int cut_fits(dagstreamthread_t *dst, uint32_t *collected,
+        color_t sinks, uint32_t *cutrun, uint32_t *cutstaged,
+        const walk_entry_t *entry) {
+    unsigned int i;
+
+    for (; sinks != 0; sinks &= sinks - 1) {
+        i = __builtin_ctz(sinks);
+        if (collected[i] + cutrun[i] > 0 && collected[i] + cutrun[i] +
+                cut_send_len(&dst->iovs[i], entry, cutstaged[i]) >
+                dst->iovs[i].maxsize) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static char *walk_stream_buffer(char *bottom, char *top,
         uint16_t *total_reccount, uint16_t *curiov,
         dagstreamthread_t *dst, darkfilter_t *filter,
         uint16_t* reccounts) {
+    walk_index_t *ix = &dst->walkindex;
+    walk_entry_t *index = ix->entries;
     uint32_t collected[DAG_COLOR_SLOTS];
     uint32_t tx[DAG_COLOR_SLOTS];
     uint32_t txw[DAG_COLOR_SLOTS];
+    uint32_t copied[DAG_COLOR_SLOTS];
+    uint32_t saved[DAG_COLOR_SLOTS];
+    uint32_t cutrun[DAG_COLOR_SLOTS];
+    uint32_t cutstaged[DAG_COLOR_SLOTS];
     uint32_t walked = 0;
     uint32_t wwalked = 0;
-    int i;
-    int color = 1;
-    int non_default_open = 0; // Track if previous packet had a non-default sink.
+    uint32_t runlen, wrunlen, lctrs;
+    uint16_t len;
+    color_t inusemask, sinks, cut, bits;
+    int i, e, r, run, added, full = 0, failed = 0;
+    int reclist = dst->capture.src->ops->reclist;
+    char *walk = bottom;
 
     /* Sanity check. */
     if (dst->params.sinkcnt == 0) {
@@ -92,130 +387,186 @@ static char * walk_stream_buffer(char *bottom, char *top,
     }
 
     /* Nothing collected atm. */
-    memset(collected, 0, sizeof(collected));
-    memset(tx, 0, sizeof(tx));
-    memset(txw, 0, sizeof(txw));
+    memset(collected, 0, sizeof(uint32_t) * dst->inuse);
+    memset(tx, 0, sizeof(uint32_t) * dst->inuse);
+    memset(txw, 0, sizeof(uint32_t) * dst->inuse);
+    memset(copied, 0, sizeof(uint32_t) * dst->inuse);
+    memset(saved, 0, sizeof(uint32_t) * dst->inuse);
 
     for (i = 0; i < dst->inuse; ++i) {
         dst->iovs[i].vec[curiov[i]].iov_base = NULL;
         dst->iovs[i].vec[curiov[i]].iov_len = 0;
     }
+    inusemask = dst->inuse >= (int)DAG_COLOR_SLOTS ? (color_t)~0 :
+            ((color_t)1 << dst->inuse) - 1;
+
+    /* Records indexed by the last walk but left over once its datagrams
+     * were full are kept, unless the window has changed since. */
+    if (!index_carries(ix, bottom, top, reclist)) {
+        ix->start = ix->end = 0;
+        ix->next = bottom;
+        ix->ahead = bottom;
+    }
 
-    /* Remove this check from the loop: `&& walked < maxsize`. I think that is
-     * checked before appending data to an iovec. */
-    while (bottom < top) {
-        dag_record_t *erfhdr = (dag_record_t *)bottom;
-        uint16_t len = ntohs(erfhdr->rlen);
-        uint16_t wlen = ntohs(erfhdr->wlen);
-        uint16_t lctr = ntohs(erfhdr->lctr);
-
-        if (lctr != 0) {
-            dst->stats.dropped_records += lctr;
+    /* Build the iovecs of all sinks from the index, one run of records with
+     * the same color at a time, indexing more records as the walk reaches
+     * the end of it. A run of contiguous records becomes a single iovec for
+     * each sink in its color. Sinks outside the color need no attention,
+     * append() starts a new iovec whenever a record does not follow on from
+     * the previous one. */
+    for (e = ix->start; !full && !failed; e += run) {
+        if (e == ix->end) {
+            ix->start = ix->end = 0;
+            e = 0;
+            if ((added = index_records(ix, top, dst, filter, reclist)) <= 0) {
+                failed = added < 0;
+                break;
+            }
         }
 
-        if (top - bottom < len) {
-            /* Partial record in the buffer */
-            break;
+        color_t color = index[e].color;
+        color_t sampled = index[e].sampled;
+        uint8_t dup = index[e].dup;
+
+        /* No color (i.e. 0) drops packets, see telescope.h */
+        sinks = color & inusemask;
+        cut = sinks & dst->truncmask;
+        runlen = 0;
+        wrunlen = 0;
+        lctrs = 0;
+        for (bits = cut; bits != 0; bits &= bits - 1) {
+            cutrun[__builtin_ctz(bits)] = 0;
+            cutstaged[__builtin_ctz(bits)] = 0;
         }
+        for (run = 0; ; ++run) {
+            walk_entry_t *entry;
 
-        if (filter) {
-            color = apply_darkfilter(filter, bottom);
-            if (color < 0) {
-                fprintf(stderr, "Error applying darknet filter to received "
-                        "traffic.\n");
-                halt_program();
-                return bottom;
-            }
-
-            /* No color (i.e. 0) drops packets, see telescope.h */
-            if (color == 0) {
-                /* Skip this packet. */
-                bottom += len;
-
-                /* Update stats. */
-                dst->stats.walked_records++;
-                dst->stats.walked_bytes += len;
-                dst->stats.walked_wbytes += wlen;
-                dst->stats.filtered_out.tx_records++;
-                dst->stats.filtered_out.tx_bytes += len;
-                dst->stats.filtered_out.tx_wbytes += wlen;
-
-                /* Close running iovecs. */
-                for (i = 0; i < dst->inuse; ++i) {
-                    end(&dst->iovs[i], &curiov[i]);
+            if (e + run == ix->end) {
+                if (ix->end == WALK_INDEX_SIZE) {
+                    if (e == 0) {
+                        /* The run fills the index, end it here. */
+                        break;
+                    }
+                    index_compact(ix, e);
+                    e = 0;
+                }
+                if ((added = index_records(ix, top, dst, filter,
+                                reclist)) <= 0) {
+                    failed = added < 0;
+                    break;
                 }
-
-                /* Next packet. */
-                continue;
             }
-        }
+            entry = &index[e + run];
+            if (entry->color != color || entry->sampled != sampled ||
+                    entry->dup != dup) {
+                break;
+            }
 
-        /* The default case should be fast. Lot's of loops otherwise. */
-        if (color == 1) {
-            i = leading_zeros(color); // Should be 0.
-            if (collected[i] > 0 && collected[i] + len > dst->iovs[i].maxsize) {
-                /* Current record would push us over the end of our datagram */
+            if (!run_fits(dst, collected, sinks & ~cut, runlen, entry->rlen)
+                    || (cut != 0 && !cut_fits(dst, collected, cut, cutrun,
+                            cutstaged, entry))) {
+                /* Current record would push us over the end of a
+                 * datagram */
+                full = 1;
                 break;
             }
-            tx[i] += len;
-            txw[i] += wlen;
-            reccounts[i] += 1;
-            append(&dst->iovs[i], curiov[i], i, bottom, len, &collected[i]);
-
-            /* Close all running non-default iovecs. Technically,
-             * this means skipping the first entry. */
-            if (non_default_open) {
-                for (i = 1; i < dst->inuse; ++i) {
-                    end(&dst->iovs[i], &curiov[i]);
+            runlen += entry->rlen;
+            wrunlen += entry->wlen;
+            lctrs += entry->lctr;
+            for (bits = cut; bits != 0; bits &= bits - 1) {
+                i = __builtin_ctz(bits);
+                len = cut_send_len(&dst->iovs[i], entry, cutstaged[i]);
+                if (len < entry->rlen) {
+                    cutstaged[i] += len;
                 }
+                cutrun[i] += len;
             }
-            non_default_open = 0;
-        } else {
-            /* We have to check the default here as well since it might overlap
-             * with other colors.*/
+        }
+        if (run == 0) {
+            break;
+        }
 
-            /* Sadly we have to check the size before we do anything else.
-             * Otherwise we risk appending a packet to the same sink twice.*/
-            for (i = 0; i < dst->inuse; ++i) {
-                if (IS_SET(color, i) && collected[i] > 0
-                        && collected[i] + len > dst->iovs[i].maxsize) {
-                    goto stopwalking;
-                }
+        if (sinks == 0) {
+            /* Skip these packets, but update stats. */
+            dst->stats.walked_bytes += runlen;
+            dst->stats.walked_wbytes += wrunlen;
+            if (dup) {
+                dst->stats.suppressed_records += run;
+                dst->stats.suppressed_bytes += runlen;
+            } else if (sampled) {
+                dst->stats.sampled_out.tx_records += run;
+                dst->stats.sampled_out.tx_bytes += runlen;
+                dst->stats.sampled_out.tx_wbytes += wrunlen;
+            } else {
+                dst->stats.filtered_out.tx_records += run;
+                dst->stats.filtered_out.tx_bytes += runlen;
+                dst->stats.filtered_out.tx_wbytes += wrunlen;
             }
-
-            /* Append to matching colors, end open iovs. */
-            for (i = 0; i < dst->inuse; ++i) {
-                if (IS_SET(color, i)) {
-                    tx[i] += len;
-                    txw[i] += wlen;
-                    reccounts[i] += 1;
-                    append(&dst->iovs[i], curiov[i], i, bottom, len, &collected[i]);
-                } else {
-                    end(&dst->iovs[i], &curiov[i]);
+        } else {
+            for (bits = sinks; bits != 0; bits &= bits - 1) {
+                i = __builtin_ctz(bits);
+                txw[i] += wrunlen;
+                reccounts[i] += run;
+
+                if (IS_SET(cut, i)) {
+                    tx[i] += cut_run(&dst->iovs[i], &curiov[i],
+                            &index[e], run, reclist, &collected[i],
+                            &copied[i], &saved[i]);
+                    continue;
+                }
+                tx[i] += runlen;
+
+                /* Short runs would make short iovecs, copy them instead. */
+                if (runlen < dst->iovs[i].copythreshold &&
+                        stage(&dst->iovs[i], &curiov[i], &index[e], run,
+                            reclist, runlen, &collected[i])) {
+                    copied[i] += runlen;
+                    continue;
+                }
+                if (!reclist) {
+                    append(&dst->iovs[i], &curiov[i], index[e].pos, runlen, &collected[i]);
+                    continue;
+                }
+                for (r = 0; r < run; ++r) {
+                    append(&dst->iovs[i], &curiov[i],
+                            entry_rec(&index[e + r], reclist),
+                            index[e + r].rlen, &collected[i]);
                 }
             }
 
-            /* Need to close these if next packet is default only. */
-            non_default_open = 1;
+            /* Record local stats. */
+            walked += runlen;
+            wwalked += wrunlen;
+            *total_reccount += run;
         }
 
-        /* Record local stats. */
-        walked += len;
-        wwalked += wlen;
+        for (bits = sampled & inusemask; bits != 0; bits &= bits - 1) {
+            dst->stats.sinks[__builtin_ctz(bits)].sampled_out_records += run;
+        }
 
         /* Global stats and progress. */
-        bottom += len;
-        ++(*total_reccount);
-        dst->stats.walked_records++;
+        dst->stats.dropped_records += lctrs;
+        dst->stats.walked_records += run;
+        walk = entry_end(&index[e + run - 1], reclist);
+    }
+
+    /* Keep the records left over for the next walk, so they are classified
+     * and checked for duplicates only once. */
+    ix->start = e;
+    if (ix->start < ix->end) {
+        ix->firstrec = entry_rec(&index[e], reclist);
+        ix->firstts = ((dag_record_t *)ix->firstrec)->ts;
     }
 
-stopwalking:
     /* Write local stats to global info. */
     dst->stats.walked_bytes += walked;
     dst->stats.walked_wbytes += wwalked;
     for (i = 0; i < dst->inuse; ++i) {
         dst->stats.sinks[i].tx_bytes += tx[i];
         dst->stats.sinks[i].tx_wbytes += txw[i];
+        dst->stats.sinks[i].tx_copied_bytes += copied[i];
+        dst->stats.sinks[i].tx_referenced_bytes += tx[i] - copied[i];
+        dst->stats.sinks[i].tx_saved_bytes += saved[i];
     }
 
     /* Walked can be larger than maxsize if the first record is
@@ -228,16 +579,17 @@ stopwalking:
             break;
         }
     }
-    return bottom;
+    return walk;
 }
 
 void telescope_walk_records(char **bottom, char *top,
         dagstreamthread_t *dst, uint16_t *savedtosend,
-        uint16_t *records_walked_total, ndag_encap_params_t *state) {
+        uint16_t *records_walked_total) {
 
     uint16_t available[DAG_COLOR_SLOTS];
     uint16_t records_walked[DAG_COLOR_SLOTS];
     uint16_t records_walked_loop;
+    char *before;
     int i, max;
 
     /* Get our application-specific state. */
@@ -252,10 +604,11 @@ void telescope_walk_records(char **bottom, char *top,
 
     do {
         records_walked_loop = 0;
+        before = *bottom;
 
         /* Iteration data. */
-        memset(available, 0, sizeof(available));
-        memset(records_walked, 0, sizeof(records_walked));
+        memset(available, 0, sizeof(uint16_t) * dst->inuse);
+        memset(records_walked, 0, sizeof(uint16_t) * dst->inuse);
 
         (*bottom) = walk_stream_buffer((*bottom), top,
                 &records_walked_loop, available, dst, filter, records_walked);
@@ -266,13 +619,14 @@ void telescope_walk_records(char **bottom, char *top,
             /* Append all new iovecs to ndag stream. */
             for (i = 0; i < dst->inuse; ++i) {
                 if (records_walked[i] > 0) {
-                    if (ndag_push_encap_iovecs(&state[i], dst->iovs[i].vec,
+                    if (dag_stream_push(dst, i, dst->iovs[i].vec,
                                 available[i] + 1, records_walked[i],
                                     savedtosend[i]) == 0) {
                         halt_program();
                         break;
                     }
                     savedtosend[i] += 1;
+                    dst->stats.sinks[i].tx_iovecs += available[i] + 1;
 
                     /* Collect overall processed records. */
                     records_walked_total[i] += records_walked[i];
@@ -287,71 +641,95 @@ void telescope_walk_records(char **bottom, char *top,
                 max = savedtosend[i];
             }
         }
-    } while (!is_halted() && records_walked_loop > 0 && max < NDAG_BATCH_SIZE);
+
+        /* Keep going while the walk gets anywhere, even if every record
+         * it indexed was dropped, so dropped traffic never waits for the
+         * next advance. */
+    } while (!is_halted() && *bottom != before && max < NDAG_BATCH_SIZE);
 }
 
-static void *per_dagstream(void *threaddata) {
-    dagstreamthread_t *dst = (dagstreamthread_t *)threaddata;
-    ndag_encap_params_t state[DAG_COLOR_SLOTS];
-    int initialized = 0;
-    int i, res, idx;
+static int init_telescope_stream(dagstreamthread_t *dst) {
+    int res, idx;
 
     /* Sanity check. */
     if (dst->params.sinkcnt == 0 || dst->params.sinks == NULL) {
         fprintf(stderr, "At least on sink is required to start a dag stream.\n");
-        goto perdagstreamexit;
+        return -1;
     }
 
-    /* Initialize dagstream thread.*/
+    /* Initialize dagstream.*/
     if (init_dag_stream(dst) == -1) {
-        goto perdagstreamexit;
+        return -1;
     }
 
     /* Color bit indices should match the iovec position to make lookup easy. */
-    for (initialized = 0; initialized < dst->params.sinkcnt; ++initialized) {
+    for (dst->inuse = 0; dst->inuse < dst->params.sinkcnt; ++dst->inuse) {
         /* The colors are assigned in incrementing order, which should ensure
          * that leading_zeros(color) returns their own index. The expection is
          * the default route that _always_ has color 1 and might be positioned
          * anywhere in the list. Hence the translation of the color to index.
          */
         /* The color bit position is our index. */
-        idx = leading_zeros(dst->params.sinks[initialized].color);
-        res = init_dag_sink(&state[idx], &dst->params.sinks[initialized],
+        idx = leading_zeros(dst->params.sinks[dst->inuse].color);
+        res = init_dag_sink(&dst->state[idx], &dst->params.sinks[dst->inuse],
             dst->params.streamnum, dst->params.globalstart);
         dst->iovs[idx].maxsize =
-            dst->params.sinks[initialized].mtu - ENCAP_OVERHEAD;
-        dst->stats.sinks[idx].name = dst->params.sinks[initialized].name;
+            dst->params.sinks[dst->inuse].mtu - ENCAP_OVERHEAD;
+        if (dst->params.sinks[dst->inuse].compressflag) {
+            dst->iovs[idx].maxsize -= sizeof(dgramcompress_hdr_t);
+        }
+        dst->stats.sinks[idx].name = dst->params.sinks[dst->inuse].name;
         if (res == -1) {
-            goto perdagstreamexit;
+            return -1;
         }
     }
-    dst->inuse = initialized;
+    return 0;
+}
 
-    dag_stream_loop(dst, state, telescope_walk_records);
-    for (i = 0; i < dst->params.sinkcnt; ++i) {
-        ndag_destroy_encap(&state[i]);
+static void halt_telescope_stream(dagstreamthread_t *dst, int initialized) {
+    int i;
+
+    if (initialized) {
+        for (i = 0; i < dst->params.sinkcnt; ++i) {
+            ndag_destroy_encap(&dst->state[i]);
+        }
     }
 
-perdagstreamexit:
     /* Stop sinks and clean up their state. */
-    for (i = 0; i < initialized; ++i) {
-        halt_dag_sink(&state[i]);
+    for (i = 0; i < dst->inuse; ++i) {
+        halt_dag_sink(&dst->state[i]);
     }
 
     /* Stop reading new data. Shouldn't this happen before we stop the sinks? */
     halt_dag_stream(dst);
 
-    /* Clean up iovecs and their array. */
-    for (i = 0; i < DAG_COLOR_SLOTS; ++i) {
-        if (dst->iovs[i].vec != NULL) {
-            free(dst->iovs[i].vec);
-            dst->iovs[i].vec = NULL;
-            dst->iovs[i].len = 0;
+    fprintf(stderr, "Exiting thread for stream %d\n", dst->params.streamnum);
+}
+
+static void *per_dagworker(void *threaddata) {
+    dagworker_t *worker = (dagworker_t *)threaddata;
+    int initialized = 0;
+    int i;
+
+    /* Initialize all streams of this worker. */
+    for (initialized = 0; initialized < worker->streamcnt; ++initialized) {
+        if (init_telescope_stream(worker->streams[initialized]) == -1) {
+            dag_worker_started(worker);
+            goto perdagworkerexit;
         }
     }
 
+    dag_worker_started(worker);
+    dag_worker_loop(worker, telescope_walk_records);
+
+perdagworkerexit:
+    /* Halt every stream we attempted to start, including a failed one. */
+    for (i = 0; i < worker->streamcnt && i <= initialized; ++i) {
+        halt_telescope_stream(worker->streams[i],
+                initialized == worker->streamcnt);
+    }
+
     /* Exit. */
-    fprintf(stderr, "Exiting thread for stream %d\n", dst->params.streamnum);
     pthread_exit(NULL);
 }
 
@@ -376,14 +754,22 @@ static void *darkfilter_reloader(void *threaddata) {
     pthread_exit(NULL);
 }
 
-static darkfilter_filter_t *init_darkfilter(int first_octet, int cnt,
-                                            darkfilter_file_t *files) {
+static darkfilter_filter_t *init_darkfilter(telescope_global_t *glob,
+                                            int cnt, darkfilter_file_t *files) {
     darkfilter_filter_t *darkfilter =
-        create_darkfilter_filter(first_octet, cnt, files);
+        create_darkfilter_filter(glob->darknetoctet, glob->darknets,
+                                 glob->darknetcnt, glob->darknet6,
+                                 glob->darknet6cnt, cnt, files,
+                                 glob->blocklistsize);
+
+    if (!darkfilter) {
+        return NULL;
+    }
 
     /* create thread to watch for reload events and trigger exclusion updates */
-    if (pthread_create(&darkfilter_tid, NULL, darkfilter_reloader,
-                       (void *)darkfilter) != 0) {
+    if (cpulist_thread_create(&darkfilter_tid, &glob->housekeepingcpus,
+                              darkfilter_reloader,
+                              (void *)darkfilter) != 0) {
         fprintf(stderr, "Failed to create darkfilter reloader thread\n");
         destroy_darkfilter_filter(darkfilter);
         return NULL;
@@ -401,7 +787,8 @@ int main(int argc, char **argv) {
     char *configfile = NULL;
 
     streamparams_t params;
-    int dagfd, errorstate;
+    capture_source_t *capture = NULL;
+    int errorstate;
     int beaconcnt = 0;
     int beaconindex = 0;
     int filecnt = 0;
@@ -483,20 +870,33 @@ int main(int argc, char **argv) {
     sigaction(SIGINT, &sigact, NULL);
     sigaction(SIGTERM, &sigact, NULL);
 
-    /* Open DAG card */
-    fprintf(stderr, "Attempting to open DAG device: %s\n", glob->dagdev);
-
-    dagfd = dag_open(glob->dagdev);
-    if (dagfd < 0) {
-        fprintf(stderr, "Failed to open DAG device: %s\n", strerror(errno));
+    /* Open DAG card, or whichever capture source was configured. */
+    capture = capture_open(&glob->capture);
+    if (capture == NULL) {
         goto finalcleanup;
     }
 
     /* Fill in global parameters. */
-    params.dagdevname = glob->dagdev;
-    params.dagfd = dagfd;
+    params.capture = capture;
     params.statinterval = glob->statinterval;
     params.statdir = glob->statdir;
+    params.poll = glob->poll;
+    params.dedicated = 0;
+    params.streamspercore = glob->streamspercore;
+    params.pipeline = glob->pipeline;
+    params.pipelinedepth = glob->pipelinedepth;
+    params.cpu = -1;
+    params.txcpu = -1;
+    params.streamcpus = glob->streamcpus;
+    params.txcpus = glob->txcpus;
+    params.housekeepingcpus = glob->housekeepingcpus;
+    params.attachwindow = glob->attachwindow;
+    params.iovcapacity = glob->iovcapacity;
+    params.workermem = glob->workermem;
+    params.hugepages = glob->hugepages;
+    params.dedupwindow = glob->dedupwindow;
+    params.streamconfcnt = glob->streamcnt;
+    params.streamconfs = glob->streams;
 
     gettimeofday(&starttime, NULL);
     params.globalstart = bswap_host_to_be64(
@@ -509,7 +909,8 @@ int main(int argc, char **argv) {
         if (itr->mcastaddr != NULL) {
             ++beaconcnt;
         }
-        if (itr->filterfile != NULL) {
+        if (itr->filterfile != NULL || itr->filterfile6 != NULL ||
+                itr->rulefile != NULL || itr->blocklist != NULL) {
             ++filecnt;
         }
     }
@@ -557,25 +958,38 @@ int main(int argc, char **argv) {
             params.sinks[beaconindex].multicastgroup = itr->mcastaddr;
             params.sinks[beaconindex].monitorid = itr->monitorid;
             params.sinks[beaconindex].mtu = itr->mtu;
+            params.sinks[beaconindex].copythreshold = itr->copythreshold;
+            params.sinks[beaconindex].snaplen = itr->snaplen;
+            params.sinks[beaconindex].headersonly = itr->headersonly;
+            params.sinks[beaconindex].compressflag = itr->compressflag;
+            params.sinks[beaconindex].samplerate = itr->samplerate;
+            params.sinks[beaconindex].sampleflows = itr->sampleflows;
             params.sinks[beaconindex].ttl = itr->ttl;
             /* The config maintains ownership of the name. */
             params.sinks[beaconindex].name = itr->name;
             /* Got one.*/
             beaconindex += 1;
         }
-        if (itr->filterfile != NULL) {
+        if (itr->filterfile != NULL || itr->filterfile6 != NULL ||
+                itr->rulefile != NULL || itr->blocklist != NULL) {
             /* Data to build the filter from exclusion files. */
             darkfilterfiles[fileindex].color = itr->color;
             darkfilterfiles[fileindex].excl_file = itr->filterfile;
+            darkfilterfiles[fileindex].excl_file6 = itr->filterfile6;
+            darkfilterfiles[fileindex].rule_file = itr->rulefile;
+            darkfilterfiles[fileindex].block_file = itr->blocklist;
             darkfilterfiles[fileindex].exclude = itr->exclude;
             itr->filterfile = NULL; // Transfer ownership.
+            itr->filterfile6 = NULL;
+            itr->rulefile = NULL;
+            itr->blocklist = NULL;
             /* Got one.*/
             fileindex += 1;
         }
     }
 
     /* boot up the things needed for managing the darkfilter */
-    darkfilter = init_darkfilter(glob->darknetoctet, filecnt, darkfilterfiles);
+    darkfilter = init_darkfilter(glob, filecnt, darkfilterfiles);
     if (!darkfilter) {
         fprintf(stderr, "Failed to create darkfilter filter.\n");
         goto finalcleanup;
@@ -583,12 +997,12 @@ int main(int argc, char **argv) {
 
     while (!is_halted()) {
         if (darkfilter) {
-            errorstate = run_dag_streams(dagfd, firstport, beaconcnt,
+            errorstate = run_dag_streams(capture, firstport, beaconcnt,
                     beaconparams, &params, darkfilter, create_darkfilter,
-                    per_dagstream, destroy_darkfilter);
+                    per_dagworker, destroy_darkfilter);
         } else {
-            errorstate = run_dag_streams(dagfd, firstport, beaconcnt,
-                    beaconparams, &params, NULL, NULL, per_dagstream, NULL);
+            errorstate = run_dag_streams(capture, firstport, beaconcnt,
+                    beaconparams, &params, NULL, NULL, per_dagworker, NULL);
         }
 
         if (errorstate != 0) {
@@ -603,9 +1017,13 @@ int main(int argc, char **argv) {
     fprintf(stderr, "Shutting down DAG multiplexer.\n");
 
     /* Close DAG card */
-    dag_close(dagfd);
+    capture_close(capture);
+    capture = NULL;
 
 finalcleanup:
+    if (capture) {
+        capture_close(capture);
+    }
     if (darkfilter) {
         pthread_join(darkfilter_tid, NULL);
         destroy_darkfilter_filter(darkfilter);
@@ -616,6 +1034,15 @@ finalcleanup:
             if (darkfilterfiles[fileindex].excl_file) {
                 free(darkfilterfiles[fileindex].excl_file);
             }
+            if (darkfilterfiles[fileindex].excl_file6) {
+                free(darkfilterfiles[fileindex].excl_file6);
+            }
+            if (darkfilterfiles[fileindex].rule_file) {
+                free(darkfilterfiles[fileindex].rule_file);
+            }
+            if (darkfilterfiles[fileindex].block_file) {
+                free(darkfilterfiles[fileindex].block_file);
+            }
         }
         free(darkfilterfiles);
     }
@@ -11,7 +11,10 @@ typedef struct torrent {
      * The color is a bitmask. This allows filters to overlap. Since the default
      * should be forwarding to the catch all multicast group we should optimze
      * for that specific case. In general we have to factors that decide where
-     * to forward packets, the filterfile and mcastaddr.
+     * to forward packets, the filterfile and mcastaddr. A filterfile6 with
+     * IPv6 prefixes or a rulefile counts as a filterfile here, a sink can
+     * have any of them. A blocklist is not a filter, it only takes
+     * packets from some sources away from a sink that has an mcastaddr.
      *
      *  filterfile | mcastaddr | action
      * ------------+-----------+-------
@@ -28,6 +31,9 @@ typedef struct torrent {
     char *mcastaddr;
     char *srcaddr;
     char *filterfile;
+    char *filterfile6;
+    char *rulefile;
+    char *blocklist; // file of sources whose packets the sink doesn't want
     char *name;
     uint16_t mcastport;
     uint16_t mtu;
@@ -35,13 +41,40 @@ typedef struct torrent {
     uint8_t ttl;
     struct torrent *next;
     uint8_t exclude; // bool
+    uint16_t copythreshold; // bytes, copy shorter runs of records
+    uint16_t snaplen; // bytes of each record to send, 0 for all of them
+    uint8_t headersonly; // bool, cut records after the transport header
+    uint8_t compressflag; // bool, LZ4-compress the records of each datagram
+    uint32_t samplerate; // keep 1 in this many records, 0 or 1 for all
+    uint8_t sampleflows; // bool, sample whole flows rather than packets
 } torrent_t;
 
 typedef struct telescope_glob {
     char *dagdev;
+    capture_options_t capture;
     char *statdir;
     int darknetoctet;
+    char **darknets; // IPv4 darknet prefixes, besides darknetoctet
+    int darknetcnt;
+    char **darknet6; // IPv6 darknet prefixes
+    int darknet6cnt;
     int statinterval;
+    pollctl_params_t poll;
+    int streamspercore;
+    uint8_t pipeline;
+    int pipelinedepth;
+    uint32_t attachwindow;
+    int iovcapacity;
+    uint64_t workermem;
+    uint8_t hugepages;
+    uint32_t dedupwindow;
+    uint32_t blocklistsize; // entries of all blocklists together
+    uint8_t experimentalcompress; // bool, receivers understand LZ4 datagrams
+    cpulist_t streamcpus;
+    cpulist_t txcpus;
+    cpulist_t housekeepingcpus;
+    int streamcnt;
+    streamconf_t *streams;
     int torrentcount;
     torrent_t *torrents;
 } telescope_global_t;
@@ -0,0 +1,236 @@
+/* Optional second stage for a stream: the capture thread walks its windows
+ * into batches of datagram descriptors and a TX thread sends them.
+ *
+ * The batches form a single-producer/single-consumer ring. The capture
+ * thread fills the batch at head and publishes it by moving head, the TX
+ * thread sends the batch at tail and acknowledges it by moving tail and
+ * `released`. The iovecs in a batch point into the capture buffer, so the
+ * capture thread only releases buffer space up to `released`.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "txpipeline.h"
+#include "dagmultiplexer.h"
+
+static void txbatch_reset(txbatch_t *batch, int sinkcnt) {
+    batch->end = 0;
+    batch->keepalive = 0;
+    batch->dgramcnt = 0;
+    batch->iovcnt = 0;
+    memset(batch->sendcnt, 0, sizeof(uint16_t) * sinkcnt);
+}
+
+txpipeline_t *txpipeline_create(uint32_t depth, int sinkcnt,
+        ndag_encap_params_t *state, dgramcompress_t **compress,
+        workermem_t *mem, uint32_t maxdgrams, uint32_t maxiovs) {
+    txpipeline_t *pipe;
+    txbatch_t *batch;
+    uint32_t i;
+
+    pipe = (txpipeline_t *)workermem_alloc(mem, sizeof(txpipeline_t));
+    if (pipe == NULL) {
+        fprintf(stderr, "Failed to allocate memory for TX pipeline\n");
+        return NULL;
+    }
+    pipe->depth = depth;
+    pipe->sinkcnt = sinkcnt;
+    pipe->state = state;
+    pipe->compress = compress;
+
+    pipe->batches = (txbatch_t *)workermem_alloc(mem,
+            sizeof(txbatch_t) * depth);
+    if (pipe->batches == NULL) {
+        goto createfail;
+    }
+    for (i = 0; i < depth; ++i) {
+        batch = &pipe->batches[i];
+        batch->sendcnt = (uint16_t *)workermem_alloc(mem,
+                sizeof(uint16_t) * sinkcnt);
+        batch->dgrams = (txdatagram_t *)workermem_alloc(mem,
+                sizeof(txdatagram_t) * maxdgrams);
+        batch->iovs = (struct iovec *)workermem_alloc(mem,
+                sizeof(struct iovec) * maxiovs);
+        if (batch->sendcnt == NULL || batch->dgrams == NULL ||
+                batch->iovs == NULL) {
+            goto createfail;
+        }
+        batch->dgramcap = maxdgrams;
+        batch->iovcap = maxiovs;
+    }
+    return pipe;
+
+createfail:
+    fprintf(stderr, "Failed to allocate memory for TX pipeline batches\n");
+    return NULL;
+}
+
+static void txpipeline_send(txpipeline_t *pipe, txbatch_t *batch) {
+    txdatagram_t *dgram;
+    struct iovec *iov, compressed;
+    uint16_t iovcnt;
+    uint32_t i;
+    int sink;
+
+    if (batch->keepalive) {
+        for (sink = 0; sink < pipe->sinkcnt; ++sink) {
+            if (ndag_send_keepalive(&pipe->state[sink]) < 0) {
+                break;
+            }
+        }
+        return;
+    }
+
+    for (sink = 0; sink < pipe->sinkcnt; ++sink) {
+        ndag_reset_encap_state(&pipe->state[sink]);
+        if (pipe->compress[sink]) {
+            dgramcompress_reset(pipe->compress[sink]);
+        }
+    }
+
+    for (i = 0; i < batch->dgramcnt; ++i) {
+        dgram = &batch->dgrams[i];
+        iov = &batch->iovs[dgram->iovstart];
+        iovcnt = dgram->iovcnt;
+        if (pipe->compress[dgram->sink]) {
+            if (!dgramcompress_datagram(pipe->compress[dgram->sink], iov,
+                        iovcnt, &compressed)) {
+                halt_program();
+                return;
+            }
+            iov = &compressed;
+            iovcnt = 1;
+        }
+        if (ndag_push_encap_iovecs(&pipe->state[dgram->sink], iov, iovcnt,
+                    dgram->reccount, dgram->batchidx) == 0) {
+            halt_program();
+            return;
+        }
+    }
+
+    for (sink = 0; sink < pipe->sinkcnt; ++sink) {
+        if (batch->sendcnt[sink] > 0) {
+            if (ndag_send_encap_records(&pipe->state[sink],
+                        batch->sendcnt[sink]) == 0) {
+                break;
+            }
+        }
+    }
+}
+
+static void *txpipeline_run(void *data) {
+    txpipeline_t *pipe = (txpipeline_t *)data;
+    txbatch_t *batch;
+    uint32_t tail, head;
+
+    /* Keep going until asked to stop and everything queued is sent. */
+    while (1) {
+        tail = pipe->tail;
+        head = __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE);
+        if (tail == head) {
+            /* Check head again, it may have moved before stop was set. */
+            if (__atomic_load_n(&pipe->stop, __ATOMIC_ACQUIRE) &&
+                    __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) == tail) {
+                break;
+            }
+            usleep(TXPIPELINE_IDLE_WAIT);
+            continue;
+        }
+
+        batch = &pipe->batches[tail % pipe->depth];
+        txpipeline_send(pipe, batch);
+
+        if (!batch->keepalive) {
+            __atomic_store_n(&pipe->released, batch->end, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&pipe->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_exit(NULL);
+}
+
+int txpipeline_start(txpipeline_t *pipe, int cpu) {
+    int ret;
+#ifdef __linux__
+    pthread_attr_t attrib;
+    cpu_set_t cpus;
+#endif
+
+    pipe->stop = 0;
+
+#ifdef __linux__
+    pthread_attr_init(&attrib);
+    if (cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        pthread_attr_setaffinity_np(&attrib, sizeof(cpus), &cpus);
+    }
+    ret = pthread_create(&pipe->tid, &attrib, txpipeline_run, (void *)pipe);
+    pthread_attr_destroy(&attrib);
+#else
+    (void) cpu;
+    ret = pthread_create(&pipe->tid, NULL, txpipeline_run, (void *)pipe);
+#endif
+
+    if (ret != 0) {
+        return -1;
+    }
+    pipe->started = 1;
+    return 0;
+}
+
+void txpipeline_stop(txpipeline_t *pipe) {
+    if (!pipe->started) {
+        return;
+    }
+    __atomic_store_n(&pipe->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(pipe->tid, NULL);
+    pipe->started = 0;
+}
+
+txbatch_t *txpipeline_next(txpipeline_t *pipe) {
+    txbatch_t *batch;
+    uint32_t tail = __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE);
+
+    if (pipe->head - tail == pipe->depth) {
+        return NULL;
+    }
+    batch = &pipe->batches[pipe->head % pipe->depth];
+    txbatch_reset(batch, pipe->sinkcnt);
+    return batch;
+}
+
+void txpipeline_publish(txpipeline_t *pipe) {
+    __atomic_store_n(&pipe->head, pipe->head + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t txpipeline_released(txpipeline_t *pipe) {
+    return __atomic_load_n(&pipe->released, __ATOMIC_ACQUIRE);
+}
+
+int txbatch_push(txbatch_t *batch, int sink, struct iovec *iov,
+        uint16_t num, uint16_t reccount, uint16_t batchidx) {
+    txdatagram_t *dgram;
+
+    /* Batches are sized for a full walk, see place_dag_stream(). */
+    if (batch->dgramcnt == batch->dgramcap ||
+            batch->iovcnt + num > batch->iovcap) {
+        fprintf(stderr, "TX pipeline batch is full.\n");
+        return 0;
+    }
+
+    dgram = &batch->dgrams[batch->dgramcnt++];
+    dgram->sink = sink;
+    dgram->batchidx = batchidx;
+    dgram->reccount = reccount;
+    dgram->iovcnt = num;
+    dgram->iovstart = batch->iovcnt;
+    memcpy(&batch->iovs[batch->iovcnt], iov, sizeof(struct iovec) * num);
+    batch->iovcnt += num;
+    return 1;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
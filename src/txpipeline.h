@@ -0,0 +1,81 @@
+#ifndef TXPIPELINE_H_
+#define TXPIPELINE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "dgramcompress.h"
+#include "ndagmulticaster.h"
+#include "workermem.h"
+
+#define TXPIPELINE_DEFAULT_DEPTH 16
+#define TXPIPELINE_IDLE_WAIT 20 // microseconds
+
+/* One datagram in a batch, as a run of iovecs in the batch's pool. */
+typedef struct txdatagram {
+    uint16_t sink;
+    uint16_t batchidx;
+    uint16_t reccount;
+    uint16_t iovcnt;
+    uint32_t iovstart;
+} txdatagram_t;
+
+/* Everything walked from one capture window, ready to be sent. The arrays
+ * are sized for the worst case up front, a batch never grows. */
+typedef struct txbatch {
+    uint64_t end; // stream offset that can be released once this is sent
+    uint8_t keepalive; // bool, send keepalives rather than datagrams
+    uint16_t *sendcnt; // datagrams per sink
+
+    txdatagram_t *dgrams;
+    uint32_t dgramcnt;
+    uint32_t dgramcap;
+
+    struct iovec *iovs;
+    uint32_t iovcnt;
+    uint32_t iovcap;
+} txbatch_t;
+
+/* A single-producer/single-consumer ring of batches between a capture
+ * thread and its TX thread. The TX thread owns the encapsulation state of
+ * the stream's sinks while it runs, so sequence numbers stay continuous. */
+typedef struct txpipeline {
+    txbatch_t *batches;
+    uint32_t depth;
+    uint32_t head; // next batch to fill, written by the capture thread
+    uint32_t tail; // next batch to send, written by the TX thread
+    uint64_t released; // end of the last batch sent
+
+    int sinkcnt;
+    ndag_encap_params_t *state; // non-owning reference, owned by the stream
+    dgramcompress_t **compress; // non-owning reference, owned by the stream
+
+    pthread_t tid;
+    int started;
+    int stop;
+} txpipeline_t;
+
+/* The ring and its batches are carved from the stream's worker memory and
+ * go away with it. Each batch holds up to maxdgrams datagrams made of up to
+ * maxiovs iovecs in total. Sinks with a compressor in compress have their
+ * datagrams compressed by the TX thread. */
+txpipeline_t *txpipeline_create(uint32_t depth, int sinkcnt,
+        ndag_encap_params_t *state, dgramcompress_t **compress,
+        workermem_t *mem, uint32_t maxdgrams, uint32_t maxiovs);
+int txpipeline_start(txpipeline_t *pipe, int cpu);
+void txpipeline_stop(txpipeline_t *pipe);
+
+/* Capture side. txpipeline_next() returns NULL if the ring is full. */
+txbatch_t *txpipeline_next(txpipeline_t *pipe);
+void txpipeline_publish(txpipeline_t *pipe);
+uint64_t txpipeline_released(txpipeline_t *pipe);
+
+/* Same contract as ndag_push_encap_iovecs(): returns 0 on failure, which
+ * only happens if the batch is full. */
+int txbatch_push(txbatch_t *batch, int sink, struct iovec *iov,
+        uint16_t num, uint16_t reccount, uint16_t batchidx);
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,103 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <numa.h>
+
+#include "workermem.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+workermem_t *workermem_create(size_t size, int node, int hugepages) {
+    static int hugewarned = 0, lockwarned = 0;
+    workermem_t *mem;
+
+    mem = (workermem_t *)calloc(1, sizeof(workermem_t));
+    if (mem == NULL) {
+        fprintf(stderr, "Failed to allocate memory for worker memory\n");
+        return NULL;
+    }
+    mem->size = (size + WORKERMEM_HUGEPAGE - 1) & ~(WORKERMEM_HUGEPAGE - 1);
+    mem->node = node;
+
+#ifdef MAP_HUGETLB
+    if (hugepages) {
+        mem->base = mmap(NULL, mem->size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB,
+                -1, 0);
+        if (mem->base == MAP_FAILED) {
+            mem->base = NULL;
+            if (!hugewarned) {
+                fprintf(stderr, "No 2 MiB hugepages available for worker "
+                        "memory, using normal pages: %s\n", strerror(errno));
+                hugewarned = 1;
+            }
+        } else {
+            mem->hugepages = 1;
+        }
+    }
+#endif
+
+    if (mem->base == NULL) {
+        mem->base = mmap(NULL, mem->size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem->base == MAP_FAILED) {
+            fprintf(stderr, "Failed to map %zu bytes of worker memory: %s\n",
+                    mem->size, strerror(errno));
+            free(mem);
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if (hugepages) {
+            madvise(mem->base, mem->size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    /* Bind before touching, so the pages are faulted in on the node. */
+    if (node >= 0 && numa_available() >= 0) {
+        numa_tonode_memory(mem->base, mem->size, node);
+    }
+    memset(mem->base, 0, mem->size);
+
+    if (mlock(mem->base, mem->size) == 0) {
+        mem->locked = 1;
+    } else if (!lockwarned) {
+        fprintf(stderr, "Failed to lock worker memory, it may be paged out "
+                "(check RLIMIT_MEMLOCK): %s\n", strerror(errno));
+        lockwarned = 1;
+    }
+    return mem;
+}
+
+void workermem_destroy(workermem_t *mem) {
+    if (mem == NULL) {
+        return;
+    }
+    if (mem->locked) {
+        munlock(mem->base, mem->size);
+    }
+    munmap(mem->base, mem->size);
+    free(mem);
+}
+
+void *workermem_alloc(workermem_t *mem, size_t size) {
+    void *ptr;
+
+    size = (size + WORKERMEM_ALIGN - 1) & ~(WORKERMEM_ALIGN - 1);
+    if (size > mem->size - mem->used) {
+        return NULL;
+    }
+    ptr = mem->base + mem->used;
+    mem->used += size;
+    return ptr;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
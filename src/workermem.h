@@ -0,0 +1,32 @@
+#ifndef WORKERMEM_H_
+#define WORKERMEM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WORKERMEM_HUGEPAGE (2 * 1024 * 1024)
+#define WORKERMEM_ALIGN 64 // cache line
+
+/* Memory owned by one stream's worker: a single region on the worker's NUMA
+ * node, on hugepages if there are any, faulted in and locked up front so the
+ * hot path never takes a page fault or a TLB miss on it. Allocations are
+ * carved off the front and only given back when the region is destroyed. */
+typedef struct workermem {
+    uint8_t *base;
+    size_t size;
+    size_t used;
+    int node;
+    uint8_t hugepages; // bool, backed by hugepages
+    uint8_t locked; // bool, mlock'd
+} workermem_t;
+
+workermem_t *workermem_create(size_t size, int node, int hugepages);
+void workermem_destroy(workermem_t *mem);
+
+/* Zero-filled, aligned to WORKERMEM_ALIGN. Returns NULL if the region is
+ * full. */
+void *workermem_alloc(workermem_t *mem, size_t size);
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,190 @@
+/* Check that a running stream allocates no memory. The telescope replays a
+ * synthetic ERF file through a darkfilter, to a default sink and to a sink
+ * that cuts records short, with duplicate suppression on. It is linked with
+ * malloc, calloc and realloc wrapped (see tests/Makefile.am). A thread is
+ * armed once it sends its first datagram or, with the TX pipeline, passes
+ * its first batch to the TX thread. Any allocation it makes after that is
+ * reported, and fails the test.
+ *
+ *   allocguard [pipeline]
+ */
+#define main telescope_main
+#include "../src/telescope.c"
+#undef main
+
+#include <execinfo.h>
+
+#include "../bench/synth.h"
+
+#define GUARD_DARKNET 12
+#define GUARD_FILE_MIB 4
+#define GUARD_REPORT 10 // backtraces printed at most
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+int __real_ndag_send_encap_records(ndag_encap_params_t *params, int count);
+void __real_txpipeline_publish(txpipeline_t *pipe);
+
+static __thread int armed = 0;
+static __thread int reporting = 0;
+static volatile uint64_t sends = 0;
+static volatile uint64_t late = 0;
+
+/* Report an allocation by a thread that is already sending. */
+static void guard_check(const char *fn, size_t size) {
+    void *frames[16];
+    int n;
+
+    if (!armed || reporting) {
+        return;
+    }
+    if (__sync_fetch_and_add(&late, 1) < GUARD_REPORT) {
+        /* backtrace() may allocate itself. */
+        reporting = 1;
+        fprintf(stderr, "allocguard: %s(%zu) in a running stream\n", fn,
+                size);
+        n = backtrace(frames, 16);
+        backtrace_symbols_fd(frames, n, 2);
+        reporting = 0;
+    }
+}
+
+void *__wrap_malloc(size_t size) {
+    guard_check("malloc", size);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    guard_check("calloc", nmemb * size);
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    guard_check("realloc", size);
+    return __real_realloc(ptr, size);
+}
+
+int __wrap_ndag_send_encap_records(ndag_encap_params_t *params, int count) {
+    armed = 1;
+    __sync_fetch_and_add(&sends, 1);
+    return __real_ndag_send_encap_records(params, count);
+}
+
+void __wrap_txpipeline_publish(txpipeline_t *pipe) {
+    armed = 1;
+    __real_txpipeline_publish(pipe);
+}
+
+/* Write the replay file: synthetic records 10us apart, each followed by a
+ * copy for the duplicate suppression. */
+static int write_erf(const char *path) {
+    size_t size = GUARD_FILE_MIB << 20, off;
+    uint8_t *buf = (uint8_t *)__real_malloc(size);
+    uint64_t ts = (uint64_t)1700000000 << 32;
+    uint16_t rlen;
+    uint32_t cnt;
+    FILE *f;
+    int ret = -1;
+
+    if (buf == NULL) {
+        return -1;
+    }
+    size = synth_buffer(buf, size, SYNTH_KINDS, GUARD_DARKNET, 80, 1, &cnt);
+    if ((f = fopen(path, "w")) != NULL) {
+        for (off = 0; off < size; off += rlen) {
+            rlen = (buf[off + 10] << 8) | buf[off + 11];
+            /* ERF timestamps are little-endian fixed point. */
+            ts += ((uint64_t)10 << 32) / 1000000;
+            memcpy(buf + off, &ts, sizeof(ts));
+            if (fwrite(buf + off, 1, rlen, f) != rlen ||
+                    fwrite(buf + off, 1, rlen, f) != rlen) {
+                break;
+            }
+        }
+        ret = off < size ? -1 : 0;
+        fclose(f);
+    }
+    free(buf);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    char dir[] = "/tmp/allocguard.XXXXXX";
+    char erf[64], filter[64], config[64];
+    char *args[] = { "allocguard", "-c", config, NULL };
+    int pipeline = argc > 1 && !strcmp(argv[1], "pipeline");
+    FILE *f;
+
+    if (mkdtemp(dir) == NULL) {
+        perror("allocguard: mkdtemp");
+        return 1;
+    }
+    snprintf(erf, sizeof(erf), "%s/replay.erf", dir);
+    snprintf(filter, sizeof(filter), "%s/filter", dir);
+    snprintf(config, sizeof(config), "%s/config.yaml", dir);
+    if (write_erf(erf) != 0) {
+        fprintf(stderr, "allocguard: failed to write %s\n", erf);
+        return 1;
+    }
+    if ((f = fopen(filter, "w")) == NULL) {
+        perror("allocguard: filter file");
+        return 1;
+    }
+    fprintf(f, "%d.0.0.0/10\n", GUARD_DARKNET);
+    fclose(f);
+    if ((f = fopen(config, "w")) == NULL) {
+        perror("allocguard: config file");
+        return 1;
+    }
+    fprintf(f, "capture: erf\n"
+            "erffiles:\n"
+            "  - %s\n"
+            "replayspeed: max\n"
+            "replayloops: 20\n"
+            "darknetoctet: %d\n"
+            "dedupwindow: 1000\n"
+            "hugepages: no\n"
+            "pipeline: %s\n"
+            "outputs:\n"
+            "  - name: cut\n"
+            "    mcastaddr: 225.100.0.1\n"
+            "    mcastport: 44100\n"
+            "    srcaddr: 127.0.0.1\n"
+            "    mtu: 1500\n"
+            "    monitorid: 2\n"
+            "    filterfile: %s\n"
+            "    exclude: false\n"
+            "    snaplen: headers\n"
+            "    copythreshold: 256\n"
+            "  - name: default\n"
+            "    mcastaddr: 225.100.0.2\n"
+            "    mcastport: 44104\n"
+            "    srcaddr: 127.0.0.1\n"
+            "    mtu: 8960\n"
+            "    monitorid: 1\n",
+            erf, GUARD_DARKNET, pipeline ? "yes" : "no", filter);
+    fclose(f);
+
+    telescope_main(3, args);
+
+    unlink(config);
+    unlink(filter);
+    unlink(erf);
+    rmdir(dir);
+
+    if (sends == 0) {
+        fprintf(stderr, "allocguard: no datagrams were sent\n");
+        return 1;
+    }
+    if (late > 0) {
+        fprintf(stderr, "allocguard: %" PRIu64 " allocations in running "
+                "streams\n", late);
+        return 1;
+    }
+    printf("allocguard: %" PRIu64 " sends, no allocations in running "
+            "streams\n", sends);
+    return 0;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,3 @@
+#!/bin/sh
+# Replay with the workers sending, then with TX threads.
+./allocguard && ./allocguard pipeline
@@ -0,0 +1,191 @@
+/* Check the flow hash and the sampling of sinks. Both directions of a flow
+ * must hash the same in every encapsulation, and different flows apart.
+ * Sampled sinks must keep about 1 in N records, flow sampling must keep
+ * flows whole and nest across rates, and the same record must always be
+ * sampled the same way.
+ *
+ *   sampling
+ */
+#define main telescope_main
+#include "../src/telescope.c"
+#undef main
+
+#include <stdarg.h>
+
+#include "../bench/synth.h"
+
+#define TEST_FLOWS 100000
+#define TEST_SLACK 0.1 // allowed deviation from the sampling rate
+
+static int failures = 0;
+
+static void fail(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    fprintf(stderr, "sampling: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    ++failures;
+}
+
+/* Write a record of kind for a flow, with its ports, protocol and
+ * timestamp set. */
+static void flow_record(uint8_t *rec, int kind, uint32_t src, uint32_t dst,
+        uint16_t sport, uint16_t dport, uint8_t proto, uint64_t ts) {
+    uint16_t ethertype;
+    uint32_t remaining;
+    uint8_t *l3;
+
+    synth_record(rec, kind, src, dst, 80);
+    memcpy(rec, &ts, sizeof(ts));
+    l3 = (uint8_t *)erf_network_header(rec, &ethertype, &remaining);
+    l3[9] = proto;
+    l3[IPV4_HEADER_LEN] = sport >> 8;
+    l3[IPV4_HEADER_LEN + 1] = sport & 0xff;
+    l3[IPV4_HEADER_LEN + 2] = dport >> 8;
+    l3[IPV4_HEADER_LEN + 3] = dport & 0xff;
+}
+
+static int cmp_hash(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void check_hash(void) {
+    static uint32_t hashes[TEST_FLOWS];
+    static const uint8_t protos[3] = {
+        IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP
+    };
+    uint8_t fwd[128], rev[128];
+    uint64_t state = 1;
+    uint32_t src, dst, h, i, distinct;
+    uint16_t sport, dport;
+    uint8_t proto;
+    int kind;
+
+    for (i = 0; i < TEST_FLOWS; ++i) {
+        src = synth_rand(&state);
+        dst = synth_rand(&state);
+        sport = synth_rand(&state);
+        dport = synth_rand(&state);
+        proto = protos[i % 3];
+        flow_record(fwd, SYNTH_ETH, src, dst, sport, dport, proto, 0);
+        hashes[i] = erf_flow_hash(fwd);
+        for (kind = 0; kind < SYNTH_KINDS; ++kind) {
+            flow_record(fwd, kind, src, dst, sport, dport, proto, i);
+            flow_record(rev, kind, dst, src, dport, sport, proto, i + 1);
+            if ((h = erf_flow_hash(fwd)) != hashes[i] ||
+                    erf_flow_hash(rev) != h) {
+                fail("flow %u of kind %d hashes differently by direction "
+                        "or encapsulation", i, kind);
+                return;
+            }
+        }
+    }
+
+    qsort(hashes, TEST_FLOWS, sizeof(uint32_t), cmp_hash);
+    for (i = 1, distinct = 1; i < TEST_FLOWS; ++i) {
+        distinct += hashes[i] != hashes[i - 1];
+    }
+    if (distinct < TEST_FLOWS * 0.99) {
+        fail("only %u of %u flows hash apart", distinct, TEST_FLOWS);
+    }
+}
+
+/* Sinks 0 to 2 sample flows at 1 in 2, 10 and 100; sinks 3 to 5 sample
+ * packets at the same rates. */
+static void check_sampling(void) {
+    static const uint32_t rates[3] = { 2, 10, 100 };
+    dagstreamthread_t *dst = (dagstreamthread_t *)calloc(1,
+            sizeof(dagstreamthread_t));
+    color_t all = 0x3f, skipped, again, rev;
+    uint64_t kept[6], state = 2, ts;
+    uint8_t rec[128];
+    uint32_t src, daddr, i, pkts;
+    uint16_t sport, dport;
+    int s;
+
+    if (dst == NULL) {
+        fail("out of memory");
+        return;
+    }
+    for (s = 0; s < 6; ++s) {
+        dst->samplerate[s] = rates[s % 3];
+        kept[s] = 0;
+    }
+    dst->samplemask = all;
+    dst->sampleflowmask = 0x07;
+
+    for (i = 0; i < TEST_FLOWS; ++i) {
+        src = synth_rand(&state);
+        daddr = synth_rand(&state);
+        sport = synth_rand(&state);
+        dport = synth_rand(&state);
+        ts = ((uint64_t)(1700000000 + i) << 32) | synth_rand(&state);
+
+        flow_record(rec, i % SYNTH_KINDS, src, daddr, sport, dport,
+                IPPROTO_TCP, ts);
+        skipped = sample_record(dst, rec, all);
+        if ((again = sample_record(dst, rec, all)) != skipped) {
+            fail("record %u sampled as %x, then as %x", i, skipped, again);
+        }
+        /* The flow sinks must make the same choice for the reply, later. */
+        flow_record(rec, (i + 1) % SYNTH_KINDS, daddr, src, dport, sport,
+                IPPROTO_TCP, ts + ((uint64_t)1 << 32));
+        rev = sample_record(dst, rec, all);
+        if ((rev & 0x07) != (skipped & 0x07)) {
+            fail("flow %u sampled differently by direction", i);
+        }
+        /* Flow sampling at 1 in 100 keeps a subset of 1 in 10 and 2. */
+        if ((skipped & 0x01) && !(skipped & 0x04)) {
+            fail("flow %u kept at 1 in 100 but not at 1 in 2", i);
+        }
+        if ((skipped & 0x02) && !(skipped & 0x04)) {
+            fail("flow %u kept at 1 in 100 but not at 1 in 10", i);
+        }
+        for (s = 0; s < 6; ++s) {
+            kept[s] += !IS_SET(skipped, s);
+        }
+        if (failures > 10) {
+            break;
+        }
+    }
+
+    /* Packet sampling spreads the packets of one flow. */
+    flow_record(rec, SYNTH_ETH, 1, 2, 3, 4, IPPROTO_UDP, 0);
+    for (i = 0, pkts = 0; i < TEST_FLOWS; ++i) {
+        memcpy(rec, &i, sizeof(i));
+        pkts += !IS_SET(sample_record(dst, rec, 0x10), 4);
+    }
+    if (pkts < TEST_FLOWS / 10 * (1 - TEST_SLACK) ||
+            pkts > TEST_FLOWS / 10 * (1 + TEST_SLACK)) {
+        fail("packet sampling at 1 in 10 kept %u of %u packets of a flow",
+                pkts, TEST_FLOWS);
+    }
+
+    for (s = 0; s < 6; ++s) {
+        if (kept[s] < (double)TEST_FLOWS / rates[s % 3] * (1 - TEST_SLACK) ||
+                kept[s] > (double)TEST_FLOWS / rates[s % 3] *
+                (1 + TEST_SLACK)) {
+            fail("%s sampling at 1 in %u kept %" PRIu64 " of %u records",
+                    s < 3 ? "flow" : "packet", rates[s % 3], kept[s],
+                    TEST_FLOWS);
+        }
+    }
+    free(dst);
+}
+
+int main(void) {
+    check_hash();
+    check_sampling();
+    if (failures > 0) {
+        return 1;
+    }
+    printf("sampling: flow hash and sampling of %u flows ok\n", TEST_FLOWS);
+    return 0;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :